@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "affinity.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+#define MAX_NODES 64          // NUMA nodes beyond this share a node with the CPUs of no node
+#define CPULIST_SIZE 4096     // enough for any node's cpulist file
+
+static affinity_policy_t policy = AFFINITY_NONE;
+static cpu_set_t nodes[MAX_NODES];    // CPUs of each NUMA node the shell may run on
+static unsigned num_nodes = 0;
+static unsigned next_node = 0;        // where the round-robin among equally loaded choices resumes
+static unsigned next_cpu = 0;
+static unsigned load[CPU_SETSIZE];    // running pinned jobs that may use each CPU
+
+/*
+ * Read the CPUs of NUMA node dir/name, e.g. /sys/devices/system/node/node0/cpulist
+ * Returns 0 on success or -1 on error
+ */
+static int read_node(DIR *dir, const char *name, cpu_set_t *cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cpulist", name);
+    int fd = openat(dirfd(dir), path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    char buf[CPULIST_SIZE];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return affinity_parse(buf, cpus);
+}
+
+int affinity_init(affinity_policy_t new_policy) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+
+    // Nodes are kept as far as the shell may use them, and CPUs of no node make one of their own
+    cpu_set_t covered;
+    CPU_ZERO(&covered);
+    num_nodes = 0;
+    DIR *dir = opendir(NODE_DIR);
+    struct dirent *entry;
+    while (dir != NULL && num_nodes < MAX_NODES - 1 && (entry = readdir(dir)) != NULL) {
+        unsigned id;
+        char rest;
+        cpu_set_t cpus;
+        if (sscanf(entry->d_name, "node%u%c", &id, &rest) != 1 ||
+            read_node(dir, entry->d_name, &cpus) == -1) {
+            continue;
+        }
+        CPU_AND(&nodes[num_nodes], &cpus, &allowed);
+        if (CPU_COUNT(&nodes[num_nodes]) > 0) {
+            CPU_OR(&covered, &covered, &nodes[num_nodes]);
+            num_nodes++;
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    CPU_XOR(&nodes[num_nodes], &allowed, &covered);
+    if (CPU_COUNT(&nodes[num_nodes]) > 0) {
+        num_nodes++;
+    }
+    policy = num_nodes > 0 ? new_policy : AFFINITY_NONE;
+    return 0;
+}
+
+int affinity_pick(cpu_set_t *cpus) {
+    if (policy == AFFINITY_NONE) {
+        return 0;
+    }
+    // The node with the least load per CPU, compared as fractions
+    unsigned best = next_node % num_nodes;
+    unsigned long best_load = 0;
+    unsigned long best_count = 0;
+    for (unsigned i = 0; i < num_nodes; i++) {
+        unsigned n = (next_node + i) % num_nodes;
+        unsigned long node_load = 0;
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &nodes[n])) {
+                node_load += load[cpu];
+            }
+        }
+        unsigned long count = CPU_COUNT(&nodes[n]);
+        if (best_count == 0 || node_load * best_count < best_load * count) {
+            best = n;
+            best_load = node_load;
+            best_count = count;
+        }
+    }
+    next_node = best + 1;
+    if (policy == AFFINITY_NODE) {
+        *cpus = nodes[best];
+        return 1;
+    }
+
+    // Then the least loaded CPU in it
+    unsigned best_cpu = CPU_SETSIZE;
+    for (unsigned i = 0; i < CPU_SETSIZE; i++) {
+        unsigned cpu = (next_cpu + i) % CPU_SETSIZE;
+        if (CPU_ISSET(cpu, &nodes[best]) &&
+            (best_cpu == CPU_SETSIZE || load[cpu] < load[best_cpu])) {
+            best_cpu = cpu;
+        }
+    }
+    next_cpu = best_cpu + 1;
+    CPU_ZERO(cpus);
+    CPU_SET(best_cpu, cpus);
+    return 1;
+}
+
+int affinity_parse(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *s = list;
+    do {
+        char *end;
+        if (*s < '0' || *s > '9') {
+            return -1;
+        }
+        unsigned long first = strtoul(s, &end, 10);
+        unsigned long last = first;
+        if (*end == '-') {
+            s = end + 1;
+            if (*s < '0' || *s > '9') {
+                return -1;
+            }
+            last = strtoul(s, &end, 10);
+        }
+        if (first > last || last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        s = end + (*end == ',');
+    } while (*s != '\0');
+    return 0;
+}
+
+void affinity_format(const cpu_set_t *cpus, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        unsigned last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        char range[32];
+        int n = last == cpu ? snprintf(range, sizeof(range), "%s%u", len > 0 ? "," : "", cpu)
+                            : snprintf(range, sizeof(range), "%s%u-%u", len > 0 ? "," : "", cpu,
+                                       last);
+        if (len + n + 4 > size) {    // leave room for "..."
+            snprintf(buf + len, size - len, "...");
+            return;
+        }
+        memcpy(buf + len, range, n + 1);
+        len += n;
+        cpu = last;
+    }
+}
+
+int affinity_enter(const cpu_set_t *cpus, cpu_set_t *saved) {
+    if (sched_getaffinity(0, sizeof(*saved), saved) == -1) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    if (sched_setaffinity(0, sizeof(*cpus), cpus) == -1) {
+        // EINVAL if none of the CPUs is one the shell may use
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+void affinity_leave(const cpu_set_t *saved) {
+    if (sched_setaffinity(0, sizeof(*saved), saved) == -1) {
+        perror("sched_setaffinity");
+    }
+}
+
+void affinity_claim(const cpu_set_t *cpus) {
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        load[cpu] += CPU_ISSET(cpu, cpus) != 0;
+    }
+}
+
+void affinity_release(const cpu_set_t *cpus) {
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpus) && load[cpu] > 0) {
+            load[cpu]--;
+        }
+    }
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>    // cpu_set_t, which needs _GNU_SOURCE
+#include <stddef.h>
+
+/*
+ * CPU affinity of jobs. The pin builtin runs a job on a given set of CPUs, and with
+ * SWISH_AFFINITY=cpu or SWISH_AFFINITY=node every new background job is pinned automatically, so
+ * that many CPU-bound jobs started with '&' spread over the machine instead of competing for the
+ * same cores and caches:
+ *   cpu   each job gets a single CPU
+ *   node  each job gets every CPU of a single NUMA node, so it can use several cores but never
+ *         has its memory on another node
+ * Either way the least loaded choice is taken, where the load of a CPU is the number of running
+ * pinned jobs that may use it, and ties go round-robin. Nodes come first: a job goes to the node
+ * whose CPUs have the least load on average, then to the least loaded CPU in it. Only CPUs the
+ * shell itself may run on are used, and the NUMA nodes are read from /sys/devices/system/node (or
+ * taken to be a single node if it isn't there)
+ *
+ * A job's processes get its CPUs by inheriting them: the shell sets its own affinity to the job's
+ * CPUs while it launches the job's processes, then restores it
+ */
+
+/*
+ * A set of CPUs. The job list and cgroup headers only point to one, so that the files including
+ * them needn't define _GNU_SOURCE for <sched.h>
+ */
+typedef struct cpu_mask {
+    cpu_set_t set;
+} cpu_mask_t;
+
+typedef enum {
+    AFFINITY_NONE,    // background jobs are not pinned unless asked to be
+    AFFINITY_CPU,
+    AFFINITY_NODE,
+} affinity_policy_t;
+
+/*
+ * Find the CPUs and NUMA nodes the shell may use, and set the policy for background jobs
+ * Returns 0 on success or -1 on error (already reported), after which no job is pinned
+ * automatically
+ */
+int affinity_init(affinity_policy_t policy);
+
+/*
+ * Pick the CPUs for a new background job under the automatic policy
+ * cpus: Set to the CPUs
+ * Returns 1 if the job should be pinned to cpus, 0 if there is no automatic policy
+ */
+int affinity_pick(cpu_set_t *cpus);
+
+/*
+ * Parse a list of CPUs such as "0-3,6"
+ * Returns 0 on success or -1 if list is malformed or names a CPU beyond CPU_SETSIZE
+ */
+int affinity_parse(const char *list, cpu_set_t *cpus);
+
+/*
+ * Format a set of CPUs as a list that affinity_parse() reads back, shortened with "..." if it
+ * doesn't fit in size bytes
+ */
+void affinity_format(const cpu_set_t *cpus, char *buf, size_t size);
+
+/*
+ * Set the shell's own affinity to cpus, for the processes it launches next to inherit
+ * saved: Set to the shell's affinity, to be restored with affinity_leave()
+ * Returns 0 on success or -1 on error (already reported)
+ */
+int affinity_enter(const cpu_set_t *cpus, cpu_set_t *saved);
+
+/*
+ * Restore the shell's affinity from affinity_enter()
+ */
+void affinity_leave(const cpu_set_t *saved);
+
+/*
+ * Count a job that has started on cpus towards their load, until affinity_release()
+ */
+void affinity_claim(const cpu_set_t *cpus);
+
+/*
+ * Stop counting a job on cpus towards their load, once it has finished or been removed
+ */
+void affinity_release(const cpu_set_t *cpus);
+
+#endif    // AFFINITY_H
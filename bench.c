@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "job_list.h"
+#include "plan.h"
+#include "string_vector.h"
+#include "swish_funcs.h"
+#include "wildcard.h"
+#include "zygote.h"
+
+/*
+ * Microbenchmarks of swish's hot paths: swish_bench [FILTER]
+ * Each benchmark runs a number of samples of a fixed number of operations, and prints one JSON
+ * object per line with the mean ns/op and the percentiles of ns/op across samples. Only
+ * benchmarks whose name contains FILTER are run
+ */
+
+#define SHORT_LINE "ls -l /tmp | grep swish > out.txt"
+#define LONG_LINE_TOKENS 1000
+#define CHURN_STRINGS 16
+#define GLOB_FILES 100000
+
+/*
+ * A benchmark body: performs 'ops' operations and returns the nanoseconds they took, which lets
+ * it leave any setup and teardown out of the measurement
+ */
+typedef uint64_t (*bench_fn_t)(void *arg, unsigned ops);
+
+static const char *filter = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * Small, fast and reproducible pseudo-random numbers (xorshift32)
+ */
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Run a benchmark and print its results
+ * name: Name of the benchmark, e.g., "tokenize/short"
+ * n: Size parameter to report (e.g., number of jobs in the list), or 0 if there is none
+ * samples: Number of times to call fn
+ * ops: Number of operations fn performs per call
+ */
+static void run_bench(const char *name, unsigned n, unsigned samples, unsigned ops, bench_fn_t fn,
+                      void *arg) {
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    double *ns_per_op = malloc(samples * sizeof(double));
+    if (ns_per_op == NULL) {
+        fprintf(stderr, "Failed to allocate samples\n");
+        exit(1);
+    }
+    fn(arg, ops);    // warm up caches and allocators
+    double total = 0;
+    for (unsigned i = 0; i < samples; i++) {
+        ns_per_op[i] = (double) fn(arg, ops) / ops;
+        total += ns_per_op[i];
+    }
+    qsort(ns_per_op, samples, sizeof(double), compare_doubles);
+
+    printf("{\"bench\": \"%s\", \"n\": %u, \"samples\": %u, \"ops_per_sample\": %u, "
+           "\"ns_per_op\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}\n",
+           name, n, samples, ops, total / samples, ns_per_op[samples / 2],
+           ns_per_op[samples * 90 / 100], ns_per_op[samples * 99 / 100], ns_per_op[samples - 1]);
+    fflush(stdout);
+    free(ns_per_op);
+}
+
+/*
+ * tokenize() of one line into an arena vector, as the shell's main loop does. Every operation
+ * includes copying the line, since tokenize() splits it in place
+ */
+static uint64_t bench_tokenize(void *arg, unsigned ops) {
+    const char *line = arg;
+    size_t len = strlen(line) + 1;
+    char *buf = malloc(len);
+    strvec_t tokens;
+    if (buf == NULL || strvec_init_arena(&tokens) == -1) {
+        fprintf(stderr, "Failed to set up tokenize benchmark\n");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        memcpy(buf, line, len);
+        tokenize(buf, &tokens);
+        strvec_reset(&tokens);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    strvec_clear(&tokens);
+    free(buf);
+    return elapsed;
+}
+
+/*
+ * plan_get() of a line that was planned before, which takes the place of tokenize() for every line
+ * the shell runs again
+ */
+static uint64_t bench_plan(void *arg, unsigned ops) {
+    const char *line = arg;
+    plan_t *plan;
+    if (plan_get(line, &plan) != 0) {
+        fprintf(stderr, "Failed to set up plan benchmark\n");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        plan_get(line, &plan);
+    }
+    return now_ns() - start;
+}
+
+/*
+ * Build a vector of CHURN_STRINGS strings and free it again, in ordinary or arena mode
+ */
+static uint64_t bench_strvec_churn(void *arg, unsigned ops) {
+    int use_arena = *(int *) arg;
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        strvec_t vec;
+        if (use_arena) {
+            strvec_init_arena(&vec);
+        } else {
+            strvec_init(&vec);
+        }
+        for (unsigned j = 0; j < CHURN_STRINGS; j++) {
+            strvec_add(&vec, "--some-argument");
+        }
+        strvec_clear(&vec);
+    }
+    return now_ns() - start;
+}
+
+/*
+ * Fill a job list with n jobs whose pids are 1 to n, every other one DONE
+ */
+static void fill_jobs(job_list_t *jobs, unsigned n) {
+    job_list_init(jobs);
+    for (unsigned i = 0; i < n; i++) {
+        if (job_list_add(jobs, i + 1, "job", i % 2 == 0 ? BACKGROUND : DONE) == -1) {
+            fprintf(stderr, "Failed to add to job list\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * job_list_add() of n jobs into an empty list; 'ops' must be n
+ */
+static uint64_t bench_job_add(void *arg, unsigned ops) {
+    job_list_t jobs;
+    uint64_t start = now_ns();
+    fill_jobs(&jobs, ops);
+    uint64_t elapsed = now_ns() - start;
+    job_list_free(&jobs);
+    return elapsed;
+}
+
+/*
+ * job_list_get() of random IDs in a list of n jobs
+ */
+static uint64_t bench_job_get(void *arg, unsigned ops) {
+    unsigned n = *(unsigned *) arg;
+    job_list_t jobs;
+    fill_jobs(&jobs, n);
+    uint32_t state = 2463534242u;
+    uintptr_t sum = 0;    // keeps the lookups from being optimized away
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        sum += (uintptr_t) job_list_get(&jobs, next_random(&state) % n);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    job_list_free(&jobs);
+    return elapsed + (sum == 0);
+}
+
+/*
+ * job_list_find_pid() of random pids in a list of n jobs
+ */
+static uint64_t bench_job_find_pid(void *arg, unsigned ops) {
+    unsigned n = *(unsigned *) arg;
+    job_list_t jobs;
+    fill_jobs(&jobs, n);
+    uint32_t state = 2463534242u;
+    uintptr_t sum = 0;
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        sum += (uintptr_t) job_list_find_pid(&jobs, next_random(&state) % n + 1);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    job_list_free(&jobs);
+    return elapsed + (sum == 0);
+}
+
+/*
+ * job_list_remove() of a random job followed by job_list_add() of a new one, in a list of n jobs
+ */
+static uint64_t bench_job_remove_add(void *arg, unsigned ops) {
+    unsigned n = *(unsigned *) arg;
+    job_list_t jobs;
+    fill_jobs(&jobs, n);
+    uint32_t state = 2463534242u;
+    pid_t next_pid = n + 1;
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        job_list_remove(&jobs, next_random(&state) % n);
+        job_list_add(&jobs, next_pid++, "job", BACKGROUND);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    job_list_free(&jobs);
+    return elapsed;
+}
+
+/*
+ * job_list_remove_by_status() of the DONE half of a list of n jobs; 'ops' must be 1
+ */
+static uint64_t bench_job_remove_by_status(void *arg, unsigned ops) {
+    unsigned n = *(unsigned *) arg;
+    job_list_t jobs;
+    fill_jobs(&jobs, n);
+    uint64_t start = now_ns();
+    job_list_remove_by_status(&jobs, DONE);
+    uint64_t elapsed = now_ns() - start;
+    job_list_free(&jobs);
+    return elapsed;
+}
+
+/*
+ * Run /bin/true in the foreground through run_pipeline(), from launch until it has been reaped
+ */
+static uint64_t bench_launch(void *arg, unsigned ops) {
+    job_list_t *jobs = arg;
+    char cmd[] = "/bin/true";
+    strvec_t tokens;
+    strvec_init_arena(&tokens);
+    tokenize(cmd, &tokens);
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        if (run_pipeline(&tokens, jobs, 0) == -1) {
+            fprintf(stderr, "Failed to run /bin/true\n");
+            exit(1);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    strvec_clear(&tokens);
+    return elapsed;
+}
+
+/*
+ * Expand a pattern matching 100 of the GLOB_FILES files in a directory, with the directory
+ * listing cached or (if arg->clear_cache) read again for every operation
+ */
+typedef struct {
+    char pattern[PATH_MAX];
+    int clear_cache;
+} glob_arg_t;
+
+static uint64_t bench_glob(void *arg, unsigned ops) {
+    glob_arg_t *glob_arg = arg;
+    strvec_t tokens;
+    strvec_init_arena(&tokens);
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < ops; i++) {
+        if (glob_arg->clear_cache) {
+            wildcard_cache_clear();
+        }
+        strvec_add(&tokens, "ls");
+        strvec_add(&tokens, glob_arg->pattern);
+        if (wildcard_expand(&tokens) == -1 || tokens.length != 101) {
+            fprintf(stderr, "Failed to expand %s\n", glob_arg->pattern);
+            exit(1);
+        }
+        strvec_reset(&tokens);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    strvec_clear(&tokens);
+    return elapsed;
+}
+
+/*
+ * Create or remove GLOB_FILES empty files in dir
+ * Returns 0 on success or -1 on error
+ */
+static int glob_files(const char *dir, int create) {
+    char path[PATH_MAX];
+    for (unsigned i = 0; i < GLOB_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%06u", dir, i);
+        if (create) {
+            int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                return -1;
+            }
+            close(fd);
+        } else {
+            unlink(path);
+        }
+    }
+    return 0;
+}
+
+static void run_glob_benches(void) {
+    if (filter != NULL && strstr("glob/cached glob/uncached", filter) == NULL) {
+        return;
+    }
+    char dir[] = "/tmp/swish_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    if (glob_files(dir, 1) == 0) {
+        // Backdate the directory, since a listing is only cached once its mtime is old enough
+        struct timespec times[2] = {{0, UTIME_OMIT}, {time(NULL) - 60, 0}};
+        utimensat(AT_FDCWD, dir, times, 0);
+        glob_arg_t glob_arg;
+        snprintf(glob_arg.pattern, sizeof(glob_arg.pattern), "%s/f0123*", dir);
+        glob_arg.clear_cache = 0;
+        run_bench("glob/cached", GLOB_FILES, 20, 100, bench_glob, &glob_arg);
+        glob_arg.clear_cache = 1;
+        run_bench("glob/uncached", GLOB_FILES, 20, 10, bench_glob, &glob_arg);
+        wildcard_free();
+    } else {
+        perror("Failed to create files to glob");
+    }
+    glob_files(dir, 0);
+    rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [filter]\n", argv[0]);
+        return 2;
+    }
+    filter = argc == 2 ? argv[1] : NULL;
+
+    run_bench("tokenize/short", 0, 200, 1000, bench_tokenize, SHORT_LINE);
+    char *long_line = malloc(LONG_LINE_TOKENS * 8 + 1);
+    if (long_line == NULL) {
+        fprintf(stderr, "Failed to allocate long line\n");
+        return 1;
+    }
+    char *end = long_line;
+    for (unsigned i = 0; i < LONG_LINE_TOKENS; i++) {
+        end += sprintf(end, "arg%04u ", i);
+    }
+    run_bench("tokenize/long", LONG_LINE_TOKENS, 200, 10, bench_tokenize, long_line);
+    run_bench("plan/cached_short", 0, 200, 1000, bench_plan, SHORT_LINE);
+    run_bench("plan/cached_long", LONG_LINE_TOKENS, 200, 10, bench_plan, long_line);
+    plan_cache_free();
+    free(long_line);
+
+    int use_arena = 0;
+    run_bench("strvec/add_clear", CHURN_STRINGS, 200, 1000, bench_strvec_churn, &use_arena);
+    use_arena = 1;
+    run_bench("strvec/add_clear_arena", CHURN_STRINGS, 200, 1000, bench_strvec_churn, &use_arena);
+
+    unsigned sizes[] = {10, 1000, 100000};
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        unsigned n = sizes[i];
+        unsigned samples = n >= 100000 ? 20 : 200;
+        run_bench("job_list/add", n, samples, n, bench_job_add, NULL);
+        run_bench("job_list/get", n, samples, 10000, bench_job_get, &n);
+        run_bench("job_list/find_pid", n, samples, 10000, bench_job_find_pid, &n);
+        run_bench("job_list/remove_add", n, samples, 10000, bench_job_remove_add, &n);
+        run_bench("job_list/remove_by_status", n, samples, 1, bench_job_remove_by_status, &n);
+    }
+
+    run_glob_benches();
+
+    // No terminal handoff, as when swish runs a script
+    set_interactive(0);
+    job_list_t jobs;
+    job_list_init(&jobs);
+    set_launch_mode(LAUNCH_SPAWN);
+    run_bench("launch/spawn", 0, 1000, 1, bench_launch, &jobs);
+    set_launch_mode(LAUNCH_FORK);
+    run_bench("launch/fork", 0, 1000, 1, bench_launch, &jobs);
+    if (zygote_start() == 0) {
+        set_launch_mode(LAUNCH_ZYGOTE);
+        run_bench("launch/zygote", 0, 1000, 1, bench_launch, &jobs);
+        zygote_stop();
+    }
+    job_list_free(&jobs);
+    return 0;
+}
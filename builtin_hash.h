@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef BUILTIN_HASH_H
+#define BUILTIN_HASH_H
+
+#include <stdint.h>
+
+/*
+ * Seeded FNV-1a hash of a builtin's name
+ * Shared by gen_builtin_table, which searches for a seed that gives every builtin its own slot,
+ * and by builtin_lookup(), which uses that seed at run time
+ * name: The name to hash
+ * seed: Seed chosen by gen_builtin_table
+ * Returns the 32-bit hash of name
+ */
+static inline uint32_t builtin_hash(const char *name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+#endif    // BUILTIN_HASH_H
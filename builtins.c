@@ -0,0 +1,907 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "builtins.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "builtin_hash.h"
+#include "graph.h"
+#include "job_list.h"
+#include "path_cache.h"
+#include "plan.h"
+#include "string_vector.h"
+#include "swish_funcs.h"
+#include "wildcard.h"
+
+#include "builtin_table.h"
+
+#define CAT_BUF_SIZE (128 * 1024)    // read()/write() size when cat can't copy inside the kernel
+
+const builtin_t *builtin_lookup(const char *name) {
+    const builtin_t *builtin =
+        &builtin_table[builtin_hash(name, BUILTIN_HASH_SEED) & (BUILTIN_TABLE_SIZE - 1)];
+    if (builtin->name == NULL || strcmp(builtin->name, name) != 0) {
+        return NULL;
+    }
+    return builtin;
+}
+
+// Get the shell's current working directory
+int builtin_pwd(strvec_t *tokens, job_list_t *jobs) {
+    char dir_name[PATH_MAX];
+    if (getcwd(dir_name, PATH_MAX) == NULL) {
+        perror("getcwd");
+        return BUILTIN_FATAL;
+    }
+
+    printf("%s\n", dir_name);
+    return BUILTIN_OK;
+}
+
+// Change the shell's current working directory
+int builtin_cd(strvec_t *tokens, job_list_t *jobs) {
+    char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        printf("Failed to get home directory\n");
+    }
+    char *directory = strvec_get(tokens, 1);
+    if (directory == NULL) {
+        if (chdir(home_dir) == -1) {
+            perror("chdir");
+        }
+    } else {
+        if (chdir(directory) == -1) {
+            perror("chdir");
+        }
+    }
+    return BUILTIN_OK;
+}
+
+// Exit the shell, optionally with a given status (by default, that of the last command)
+int builtin_exit(strvec_t *tokens, job_list_t *jobs) {
+    char *status = strvec_get(tokens, 1);
+    if (status != NULL) {
+        set_last_status(atoi(status) & 0xff);
+    }
+    return BUILTIN_EXIT;
+}
+
+/*
+ * Seconds elapsed from 'from' to 'to'
+ */
+static double seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/*
+ * A timeval as a number of seconds
+ */
+static double seconds_of(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Print out current list of pending jobs, with the resources each has used so far if given "-l"
+int builtin_jobs(strvec_t *tokens, job_list_t *jobs) {
+    char *option = strvec_get(tokens, 1);
+    int long_format = option != NULL && strcmp(option, "-l") == 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    job_t *current = job_list_next(jobs, 0);
+    while (current != NULL) {
+        char *status_desc;
+        if (current->status == BACKGROUND) {
+            status_desc = "background";
+        } else if (current->status == DONE) {
+            status_desc = "done";
+        } else {
+            status_desc = "stopped";
+        }
+        char cpus[64] = "";
+        if (current->cpus != NULL) {
+            strcpy(cpus, ", cpus ");
+            affinity_format(&current->cpus->set, cpus + strlen(cpus), sizeof(cpus) - strlen(cpus));
+        }
+        printf("%u: %s (%s%s%s)", current->id, current->name, status_desc,
+               current->timed_out ? ", timed out" : "", cpus);
+        if (current->graph != NULL) {
+            unsigned pos = 0;
+            const graph_node_t *node;
+            const char *separator = " failed:";
+            while ((node = graph_next_failed(current->graph, &pos)) != NULL) {
+                printf("%s %s (%d)", separator, node->target, node->exit_status);
+                separator = ",";
+            }
+        }
+        if (long_format) {
+            // CPU time and memory only include processes that have exited, as the kernel only
+            // reports them when a process is reaped
+            const job_usage_t *usage = &current->usage;
+            printf(" pid %d real %.3fs user %.3fs sys %.3fs maxrss %ldK ctxsw %ld/%ld",
+                   current->pid,
+                   seconds_between(&usage->start, current->status == DONE ? &usage->end : &now),
+                   seconds_of(&usage->utime), seconds_of(&usage->stime), usage->maxrss,
+                   usage->nvcsw, usage->nivcsw);
+            // A job's cgroup counts every process in it, running or not
+            cgroup_stats_t stats;
+            if (current->cgroup_fd != -1 && cgroup_stats(current->cgroup_fd, &stats) == 0) {
+                if (stats.memory_current != -1) {
+                    printf(" cgroup mem %lldK", stats.memory_current / 1024);
+                    if (stats.memory_peak != -1) {
+                        printf(" peak %lldK", stats.memory_peak / 1024);
+                    }
+                }
+                printf(" cgroup cpu %.3fs (user %.3fs sys %.3fs)", stats.cpu_usec / 1e6,
+                       stats.user_usec / 1e6, stats.system_usec / 1e6);
+            }
+        }
+        printf("\n");
+        current = job_list_next(jobs, current->id + 1);
+    }
+    // Finished jobs are only listed once
+    job_list_remove_by_status(jobs, DONE);
+    return BUILTIN_OK;
+}
+
+// Move stopped job into foreground
+int builtin_fg(strvec_t *tokens, job_list_t *jobs) {
+    if (resume_job(tokens, jobs, 1) == -1) {
+        printf("Failed to resume job in foreground\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Move stopped job into background
+int builtin_bg(strvec_t *tokens, job_list_t *jobs) {
+    if (resume_job(tokens, jobs, 0) == -1) {
+        printf("Failed to resume job in background\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Wait for a specific job identified by its ID in job list
+int builtin_wait_for(strvec_t *tokens, job_list_t *jobs) {
+    if (await_background_job(tokens, jobs) == -1) {
+        printf("Failed to wait for background job\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Wait for all background jobs, printing each one as it finishes if given "--progress"
+int builtin_wait_all(strvec_t *tokens, job_list_t *jobs) {
+    char *option = strvec_get(tokens, 1);
+    int show_progress = option != NULL && strcmp(option, "--progress") == 0;
+    if (await_all_background_jobs(jobs, show_progress) == -1) {
+        printf("Failed to wait for all background jobs\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Wait for whichever background job finishes first
+int builtin_wait_any(strvec_t *tokens, job_list_t *jobs) {
+    if (await_any_background_job(jobs) == -1) {
+        printf("Failed to wait for any background job\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Run a command for each of a list of items, a bounded number at a time, as a single job
+int builtin_parallel(strvec_t *tokens, job_list_t *jobs) {
+    if (run_parallel(tokens, jobs) == -1) {
+        printf("Failed to run parallel batch\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Run the commands of a dependency graph file, as many at a time as their dependencies allow
+int builtin_run_graph(strvec_t *tokens, job_list_t *jobs) {
+    if (run_graph(tokens, jobs) == -1) {
+        printf("Failed to run graph\n");
+    }
+    return BUILTIN_OK;
+}
+
+/*
+ * Run the rest of a builtin's command line, from tokens[first] on, as if it had been typed on its
+ * own: a builtin is dispatched as usual, and anything else runs as a pipeline, in the background if
+ * it ends in "&". The command borrows the tokens, so nothing is copied
+ * timeout, kill_grace: Deadline for the job and grace period before SIGKILL, as for
+ *                      run_pipeline_timeout(), or NULL for none
+ * limits: Limits for the job, as for run_pipeline_limits(), or NULL for none. A command with a
+ *         deadline or limits always runs as a job, even if it names a builtin
+ * Returns what the builtin returned, BUILTIN_OK once the pipeline has run, or BUILTIN_FATAL
+ */
+static int run_tail(strvec_t *tokens, unsigned first, job_list_t *jobs,
+                    const struct timespec *timeout, const struct timespec *kill_grace,
+                    const job_limits_t *limits) {
+    strvec_t cmd;
+    if (strvec_init_arena(&cmd) == -1) {
+        printf("Failed to initialize command vector\n");
+        return BUILTIN_FATAL;
+    }
+    for (unsigned i = first; i < tokens->length; i++) {
+        if (strvec_add_ref(&cmd, tokens->data[i]) == -1) {
+            printf("Failed to add token to command vector\n");
+            strvec_clear(&cmd);
+            return BUILTIN_FATAL;
+        }
+    }
+    const builtin_t *builtin =
+        timeout == NULL && limits == NULL ? builtin_lookup(cmd.data[0]) : NULL;
+    int result = BUILTIN_OK;
+    if (builtin != NULL) {
+        result = builtin->fn(&cmd, jobs);
+    } else {
+        int is_background = token_kind(cmd.data[cmd.length - 1]) == TOKEN_BACKGROUND;
+        if (is_background) {
+            strvec_take(&cmd, cmd.length - 1);
+        }
+        int launched = limits != NULL
+                           ? run_pipeline_limits(&cmd, jobs, is_background, limits)
+                           : run_pipeline_timeout(&cmd, jobs, is_background, timeout, kill_grace);
+        if (launched == -1) {
+            result = BUILTIN_FATAL;
+        }
+    }
+    strvec_clear(&cmd);
+    return result;
+}
+
+// Run a command with a deadline, after which its job is sent SIGTERM, and SIGKILL if it is still
+// running a grace period later: timeout [-k GRACE] DURATION command [arg...] [&]
+int builtin_timeout(strvec_t *tokens, job_list_t *jobs) {
+    unsigned first = 1;
+    struct timespec kill_grace = {DEFAULT_KILL_GRACE, 0};
+    if (first + 1 < tokens->length && strcmp(tokens->data[first], "-k") == 0) {
+        if (parse_duration(tokens->data[first + 1], &kill_grace) == -1) {
+            fprintf(stderr, "timeout: invalid grace period '%s'\n", tokens->data[first + 1]);
+            set_last_status(STATUS_USAGE);
+            return BUILTIN_OK;
+        }
+        first += 2;
+    }
+    struct timespec timeout;
+    if (first + 1 >= tokens->length || token_kind(tokens->data[first + 1]) == TOKEN_BACKGROUND) {
+        fprintf(stderr, "Usage: timeout [-k GRACE] DURATION command [arg...] [&]\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    } else if (parse_duration(tokens->data[first], &timeout) == -1) {
+        fprintf(stderr, "timeout: invalid duration '%s'\n", tokens->data[first]);
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+    return run_tail(tokens, first + 1, jobs, &timeout, &kill_grace, NULL);
+}
+
+/*
+ * Parse a size in bytes, with an optional K, M, or G suffix (powers of 1024)
+ * Returns the size, or -1 if s isn't a positive size
+ */
+static long long parse_size(const char *s) {
+    char *end;
+    errno = 0;
+    long long size = strtoll(s, &end, 10);
+    long long unit = 1;
+    if (*end == 'K' || *end == 'k') {
+        unit = 1024;
+    } else if (*end == 'M' || *end == 'm') {
+        unit = 1024 * 1024;
+    } else if (*end == 'G' || *end == 'g') {
+        unit = 1024 * 1024 * 1024;
+    }
+    end += unit != 1;
+    if (errno != 0 || end == s || *end != '\0' || size <= 0 || size > LLONG_MAX / unit) {
+        return -1;
+    }
+    return size * unit;
+}
+
+// Run a command with limits on the memory and CPU its job may use, in its cgroup when it has one
+// (see cgroup.h): limit [-m SIZE] [-c CPUS] command [arg...] [&], where CPUS may be fractional
+int builtin_limit(strvec_t *tokens, job_list_t *jobs) {
+    job_limits_t limits = {0, 0, NULL};
+    unsigned first = 1;
+    while (first + 1 < tokens->length && (strcmp(tokens->data[first], "-m") == 0 ||
+                                          strcmp(tokens->data[first], "-c") == 0)) {
+        const char *value = tokens->data[first + 1];
+        if (tokens->data[first][1] == 'm') {
+            if ((limits.memory_max = parse_size(value)) == -1) {
+                fprintf(stderr, "limit: invalid size '%s'\n", value);
+                set_last_status(STATUS_USAGE);
+                return BUILTIN_OK;
+            }
+        } else {
+            char *end;
+            double cpus = strtod(value, &end);
+            if (end == value || *end != '\0' || !(cpus > 0) ||
+                cpus > LONG_MAX / CGROUP_CPU_PERIOD) {
+                fprintf(stderr, "limit: invalid number of CPUs '%s'\n", value);
+                set_last_status(STATUS_USAGE);
+                return BUILTIN_OK;
+            }
+            // The kernel's smallest quota is 1ms per period
+            limits.cpu_quota = cpus * CGROUP_CPU_PERIOD;
+            if (limits.cpu_quota < 1000) {
+                limits.cpu_quota = 1000;
+            }
+        }
+        first += 2;
+    }
+    if (first >= tokens->length || token_kind(tokens->data[first]) == TOKEN_BACKGROUND) {
+        fprintf(stderr, "Usage: limit [-m SIZE] [-c CPUS] command [arg...]\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+    return run_tail(tokens, first, jobs, NULL, NULL, &limits);
+}
+
+// Capture the output of background jobs started from now on ("capture on"), or stop ("capture off")
+int builtin_capture(strvec_t *tokens, job_list_t *jobs) {
+    char *option = strvec_get(tokens, 1);
+    if (option != NULL && strcmp(option, "on") == 0) {
+        set_capture_output(1);
+    } else if (option != NULL && strcmp(option, "off") == 0) {
+        set_capture_output(0);
+    } else {
+        fprintf(stderr, "Usage: capture on|off\n");
+        set_last_status(STATUS_USAGE);
+    }
+    return BUILTIN_OK;
+}
+
+// Print the captured output of a background job, and keep printing it as it grows if given
+// "--follow"
+int builtin_output(strvec_t *tokens, job_list_t *jobs) {
+    if (show_job_output(tokens, jobs) == -1) {
+        printf("Failed to show job output\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Show, prime, or clear the cache of where commands were found on PATH:
+//   hash              list the cached commands
+//   hash NAME...      look up each command now, so launching it later doesn't search PATH
+//   hash -d NAME...   forget where each command was found
+//   hash -r           forget every command
+int builtin_path_hash(strvec_t *tokens, job_list_t *jobs) {
+    char *option = strvec_get(tokens, 1);
+    if (option == NULL) {
+        unsigned pos = 0;
+        const char *name;
+        const char *path;
+        unsigned hits;
+        if (!path_cache_next(&pos, &name, &path, &hits)) {
+            printf("hash: hash table empty\n");
+            return BUILTIN_OK;
+        }
+        printf("hits\tcommand\n");
+        do {
+            printf("%4u\t%s\n", hits, path);
+        } while (path_cache_next(&pos, &name, &path, &hits));
+    } else if (strcmp(option, "-r") == 0) {
+        path_cache_clear();
+    } else if (strcmp(option, "-d") == 0) {
+        for (unsigned i = 2; i < tokens->length; i++) {
+            if (path_cache_forget(tokens->data[i]) == -1) {
+                fprintf(stderr, "hash: %s: not found\n", tokens->data[i]);
+            }
+        }
+    } else if (option[0] == '-') {
+        fprintf(stderr, "Usage: hash [-r | -d name... | name...]\n");
+        set_last_status(STATUS_USAGE);
+    } else {
+        for (unsigned i = 1; i < tokens->length; i++) {
+            if (path_cache_find(tokens->data[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", tokens->data[i]);
+            }
+        }
+    }
+    return BUILTIN_OK;
+}
+
+// Run a command (or parallel batch) in the foreground and report the time and resources it used
+int builtin_time(strvec_t *tokens, job_list_t *jobs) {
+    if (tokens->length < 2) {
+        fprintf(stderr, "Usage: time command [arg...]\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+    if (token_kind(tokens->data[tokens->length - 1]) == TOKEN_BACKGROUND) {
+        fprintf(stderr, "time: cannot time a background job\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = run_tail(tokens, 1, jobs, NULL, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (result != BUILTIN_OK) {
+        return result;
+    }
+
+    fprintf(stderr, "real\t%.3fs\n", seconds_between(&start, &end));
+    // The job's CPU time and memory, if one ran and finished (rather than being stopped)
+    const job_usage_t *usage = get_last_usage();
+    if (seconds_between(&start, &usage->start) >= 0) {
+        fprintf(stderr, "user\t%.3fs\nsys\t%.3fs\n", seconds_of(&usage->utime),
+                seconds_of(&usage->stime));
+        fprintf(stderr, "maxrss\t%ldK\nctxsw\t%ld voluntary, %ld involuntary\n", usage->maxrss,
+                usage->nvcsw, usage->nivcsw);
+    }
+    return BUILTIN_OK;
+}
+
+// Run a command N times, parsing it only once: repeat N command [arg...] [&]
+int builtin_repeat(strvec_t *tokens, job_list_t *jobs) {
+    char *end = "";
+    long count = tokens->length > 2 ? strtol(tokens->data[1], &end, 10) : -1;
+    if (count < 0 || *end != '\0' || end == tokens->data[1]) {
+        fprintf(stderr, "Usage: repeat N command [arg...]\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+    plan_t *plan = plan_compile(tokens->data + 2, tokens->length - 2, NULL);
+    if (plan == NULL) {
+        printf("Failed to compile loop body\n");
+        return BUILTIN_FATAL;
+    }
+    int result = plan_loop(plan, NULL, count, jobs);
+    plan_free(plan);
+    return result;
+}
+
+/*
+ * Returns 1 if name can be a variable name (a letter or '_', then letters, digits, or '_'), 0
+ * otherwise
+ */
+static int valid_var_name(const char *name) {
+    if (!isalpha((unsigned char) name[0]) && name[0] != '_') {
+        return 0;
+    }
+    for (const char *c = name + 1; *c != '\0'; c++) {
+        if (!isalnum((unsigned char) *c) && *c != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Run a list of commands once for each word, with every $NAME or ${NAME} in it replaced by the
+// word, and parsing it only once: for NAME in WORD... ; do command... ; done
+int builtin_for(strvec_t *tokens, job_list_t *jobs) {
+    char **data = tokens->data;
+    unsigned len = tokens->length;
+    unsigned words_end = 3;
+    while (words_end < len && token_kind(data[words_end]) != TOKEN_SEPARATOR) {
+        words_end++;
+    }
+    if (len < 7 || !valid_var_name(data[1]) || strcmp(data[2], "in") != 0 ||
+        words_end + 3 >= len || strcmp(data[words_end + 1], "do") != 0 ||
+        token_kind(data[len - 2]) != TOKEN_SEPARATOR || strcmp(data[len - 1], "done") != 0) {
+        fprintf(stderr, "Usage: for NAME in WORD... ; do command... ; done\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+
+    // The shell leaves a loop unexpanded (see plan.h), so the words are expanded here. They are
+    // copied out of the arena vector, whose storage the body's own expansions reuse
+    strvec_t expanded;
+    strvec_t words;
+    if (strvec_init_arena(&expanded) == -1) {
+        printf("Failed to initialize loop words vector\n");
+        return BUILTIN_FATAL;
+    }
+    if (strvec_init(&words) == -1) {
+        printf("Failed to initialize loop words vector\n");
+        strvec_clear(&expanded);
+        return BUILTIN_FATAL;
+    }
+    int failed = 0;
+    for (unsigned i = 3; i < words_end && !failed; i++) {
+        failed = strvec_add(&expanded, data[i]) == -1;    // wildcard_expand() unescapes in place
+    }
+    failed = failed || wildcard_expand(&expanded) == -1;
+    for (unsigned i = 0; i < expanded.length && !failed; i++) {
+        failed = strvec_add(&words, expanded.data[i]) == -1;
+    }
+    strvec_clear(&expanded);
+    plan_t *plan = failed ? NULL : plan_compile(data + words_end + 2, len - words_end - 4, data[1]);
+    if (plan == NULL) {
+        printf("Failed to compile loop body\n");
+        strvec_clear(&words);
+        return BUILTIN_FATAL;
+    }
+    int result = plan_loop(plan, words.data, words.length, jobs);
+    plan_free(plan);
+    strvec_clear(&words);
+    return result;
+}
+
+/*
+ * Run a command line that one of the in-process commands below can't handle itself, such as a
+ * pipeline or an option it doesn't implement, through the executable of the same name
+ * Returns BUILTIN_OK, or BUILTIN_FATAL on a fatal error
+ */
+static int run_external(strvec_t *tokens, job_list_t *jobs) {
+    int is_background = token_kind(tokens->data[tokens->length - 1]) == TOKEN_BACKGROUND;
+    if (is_background) {
+        strvec_take(tokens, tokens->length - 1);
+    }
+    return run_pipeline(tokens, jobs, is_background) == -1 ? BUILTIN_FATAL : BUILTIN_OK;
+}
+
+/*
+ * Returns 1 if a command's only argument asks for its help or version text, which is left to the
+ * executable to print
+ */
+static int wants_help(strvec_t *tokens, int num_args) {
+    return num_args == 2 &&
+           (strcmp(tokens->data[1], "--help") == 0 || strcmp(tokens->data[1], "--version") == 0);
+}
+
+/*
+ * Returns 1 if the shell can read (or if is_input is 0, write) a file in-process without
+ * blocking: a regular file, or for output /dev/null or the terminal. Anything else, such as a
+ * pipe or FIFO, can block indefinitely, and then only a child process could be interrupted or
+ * stopped without stopping the shell with it
+ */
+static int never_blocks(const struct stat *st, int is_input) {
+    if (S_ISREG(st->st_mode)) {
+        return 1;
+    } else if (is_input || !S_ISCHR(st->st_mode)) {
+        return 0;
+    }
+    struct stat other;
+    if (stat("/dev/null", &other) == 0 && other.st_rdev == st->st_rdev) {
+        return 1;
+    }
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+        if (isatty(fd) && fstat(fd, &other) == 0 && other.st_rdev == st->st_rdev) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if a simple command's redirections, and its stdout if that isn't redirected, can all
+ * be used in-process (see never_blocks()). Files are checked before they are opened, since even
+ * opening a FIFO blocks until its other end is opened. A file that doesn't exist yet is created
+ * as a regular file, or fails to open straight away
+ */
+static int redirects_never_block(strvec_t *tokens, int num_args) {
+    int redirects_stdout = 0;
+    for (unsigned i = num_args; i < tokens->length; i += 2) {
+        token_kind_t kind = token_kind(tokens->data[i]);
+        redirects_stdout |= kind == TOKEN_REDIRECT_OUT || kind == TOKEN_REDIRECT_APPEND;
+        struct stat st;
+        if (stat(tokens->data[i + 1], &st) == 0 && !never_blocks(&st, kind == TOKEN_REDIRECT_IN)) {
+            return 0;
+        }
+    }
+    struct stat st;
+    return redirects_stdout || (fstat(STDOUT_FILENO, &st) == 0 && never_blocks(&st, 0));
+}
+
+/*
+ * Run 'true' or 'false' in the shell, which still creates or truncates any files it redirects to
+ */
+static int run_constant(strvec_t *tokens, job_list_t *jobs, int status) {
+    int num_args = simple_command_args(tokens);
+    if (num_args == -1 || wants_help(tokens, num_args) ||
+        !redirects_never_block(tokens, num_args)) {
+        return run_external(tokens, jobs);
+    }
+    int saved_fds[3];
+    int result = apply_redirects(tokens, num_args, saved_fds);
+    if (result == 0) {
+        restore_redirects(saved_fds);
+        set_last_status(status);
+    }
+    return result == -1 ? BUILTIN_FATAL : BUILTIN_OK;
+}
+
+// Do nothing, successfully
+int builtin_true(strvec_t *tokens, job_list_t *jobs) {
+    return run_constant(tokens, jobs, 0);
+}
+
+// Do nothing, unsuccessfully
+int builtin_false(strvec_t *tokens, job_list_t *jobs) {
+    return run_constant(tokens, jobs, 1);
+}
+
+// Run a command with the arguments after ":::" packed into as few runs as ARG_MAX allows, as a
+// single job: xargs [-P N] [-n MAX] command [arg...] ::: arg... [&]. Without ":::", the arguments
+// come from stdin, which is left to the xargs executable
+int builtin_xargs(strvec_t *tokens, job_list_t *jobs) {
+    if (strvec_find(tokens, ":::") == -1) {
+        return run_external(tokens, jobs);
+    }
+    if (run_xargs(tokens, jobs) == -1) {
+        printf("Failed to run xargs batch\n");
+    }
+    return BUILTIN_OK;
+}
+
+// Run a command on a set of CPUs, given as a list such as "0-3,6": pin CPUS command [arg...] [&]
+int builtin_pin(strvec_t *tokens, job_list_t *jobs) {
+    if (tokens->length < 3 || token_kind(tokens->data[2]) == TOKEN_BACKGROUND) {
+        fprintf(stderr, "Usage: pin CPUS command [arg...]\n");
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+    cpu_mask_t cpus;
+    cpu_set_t allowed;
+    if (affinity_parse(tokens->data[1], &cpus.set) == -1) {
+        fprintf(stderr, "pin: invalid CPU list '%s'\n", tokens->data[1]);
+        set_last_status(STATUS_USAGE);
+        return BUILTIN_OK;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_AND(&allowed, &allowed, &cpus.set);
+        if (CPU_COUNT(&allowed) == 0) {
+            fprintf(stderr, "pin: none of CPUs %s is available\n", tokens->data[1]);
+            set_last_status(1);
+            return BUILTIN_OK;
+        }
+    }
+    job_limits_t limits = {0, 0, &cpus};
+    return run_tail(tokens, 2, jobs, NULL, NULL, &limits);
+}
+
+/*
+ * Parse a signal given by number or by name, with or without its "SIG" prefix
+ * Returns the signal, or -1 if s names none
+ */
+static int parse_signal(const char *s) {
+    if (isdigit((unsigned char) s[0])) {
+        char *end;
+        long sig = strtol(s, &end, 10);
+        return *end == '\0' && sig >= 0 && sig < NSIG ? (int) sig : -1;
+    }
+    if (strncmp(s, "SIG", 3) == 0) {
+        s += 3;
+    }
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *name = sigabbrev_np(sig);
+        if (name != NULL && strcmp(name, s) == 0) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+// Send a signal (SIGTERM by default) to every process of each job given, including any that left
+// the job's process group if it has a cgroup: kill [-SIG | -s SIG] %N... Anything else, such as
+// a pid, is left to the kill executable
+int builtin_kill(strvec_t *tokens, job_list_t *jobs) {
+    int sig = SIGTERM;
+    unsigned first = 1;
+    if (first + 1 < tokens->length && strcmp(tokens->data[first], "-s") == 0) {
+        sig = parse_signal(tokens->data[first + 1]);
+        first += 2;
+    } else if (first + 1 < tokens->length && tokens->data[first][0] == '-' &&
+               tokens->data[first][1] != '\0') {
+        sig = parse_signal(tokens->data[first] + 1);
+        first++;
+    }
+    if (first >= tokens->length) {
+        return run_external(tokens, jobs);
+    }
+    for (unsigned i = first; i < tokens->length; i++) {
+        if (tokens->data[i][0] != '%' || !isdigit((unsigned char) tokens->data[i][1])) {
+            return run_external(tokens, jobs);
+        }
+    }
+    if (sig == -1) {
+        fprintf(stderr, "kill: invalid signal '%s'\n", tokens->data[first - 1]);
+        set_last_status(1);
+        return BUILTIN_OK;
+    }
+
+    int status = 0;
+    for (unsigned i = first; i < tokens->length; i++) {
+        char *end;
+        unsigned long id = strtoul(tokens->data[i] + 1, &end, 10);
+        job_t *job = *end == '\0' && id <= UINT_MAX ? job_list_get(jobs, id) : NULL;
+        if (job == NULL || job->status == DONE) {
+            fprintf(stderr, "kill: %s: no such job\n", tokens->data[i]);
+            status = 1;
+        } else if (signal_job(job, sig) == -1) {
+            fprintf(stderr, "kill: %s: %s\n", tokens->data[i], strerror(errno));
+            status = 1;
+        }
+    }
+    set_last_status(status);
+    return BUILTIN_OK;
+}
+
+// Print the arguments separated by spaces, as coreutils echo does (with -n for no newline)
+int builtin_echo(strvec_t *tokens, job_list_t *jobs) {
+    int num_args = simple_command_args(tokens);
+    // echo -e interprets escapes, and POSIXLY_CORRECT changes which options are recognized
+    if (num_args == -1 || wants_help(tokens, num_args) || getenv("POSIXLY_CORRECT") != NULL ||
+        !redirects_never_block(tokens, num_args)) {
+        return run_external(tokens, jobs);
+    }
+    int newline = 1;
+    int first = 1;
+    for (; first < num_args; first++) {
+        const char *arg = tokens->data[first];
+        if (arg[0] != '-' || arg[1] == '\0' || strspn(arg + 1, "neE") != strlen(arg + 1)) {
+            break;    // not an option, so this and the rest are printed
+        } else if (strchr(arg, 'e') != NULL) {
+            return run_external(tokens, jobs);
+        } else if (strchr(arg, 'n') != NULL) {
+            newline = 0;
+        }
+    }
+
+    int saved_fds[3];
+    int result = apply_redirects(tokens, num_args, saved_fds);
+    if (result != 0) {
+        return result == -1 ? BUILTIN_FATAL : BUILTIN_OK;
+    }
+    for (int i = first; i < num_args; i++) {
+        fputs(tokens->data[i], stdout);
+        if (i + 1 < num_args) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    int status = 0;
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "echo: write error: %s\n", strerror(errno));
+        clearerr(stdout);
+        status = 1;
+    }
+    restore_redirects(saved_fds);
+    set_last_status(status);
+    return BUILTIN_OK;
+}
+
+/*
+ * Copy everything from in_fd to out_fd, inside the kernel where possible: copy_file_range()
+ * between regular files (which may share extents rather than copy data), sendfile() from a regular
+ * file to anything else, and read()/write() otherwise
+ * name: Name of the input file, for error messages
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int copy_fd(int in_fd, int out_fd, const char *name) {
+    int use_copy_range = 1;
+    int use_sendfile = 1;
+    while (use_copy_range || use_sendfile) {
+        ssize_t n = use_copy_range ? copy_file_range(in_fd, NULL, out_fd, NULL, SSIZE_MAX, 0)
+                                   : sendfile(out_fd, in_fd, NULL, SSIZE_MAX);
+        if (n == 0) {
+            return 0;
+        } else if (n > 0) {
+            continue;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EISDIR) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        // The files don't support this call (e.g., a pipe, or an output opened with O_APPEND),
+        // so move on to the next way of copying. Any data copied so far is not repeated, since
+        // both calls advance the file offsets
+        if (use_copy_range) {
+            use_copy_range = 0;
+        } else {
+            use_sendfile = 0;
+        }
+    }
+
+    char buf[CAT_BUF_SIZE];
+    while (1) {
+        ssize_t n = read(in_fd, buf, sizeof(buf));
+        if (n == 0) {
+            return 0;
+        } else if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out_fd, buf + written, n - written);
+            if (w == -1 && errno != EINTR) {
+                fprintf(stderr, "cat: write error: %s\n", strerror(errno));
+                return -1;
+            }
+            written += w == -1 ? 0 : w;
+        }
+    }
+}
+
+/*
+ * Returns 1 if in_fd is the regular file that out_fd writes to, and cat would read back its own
+ * output, as coreutils cat refuses to
+ */
+static int is_output_file(int in_fd, int out_fd) {
+    struct stat in_st;
+    struct stat out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1 || !S_ISREG(in_st.st_mode) ||
+        in_st.st_dev != out_st.st_dev || in_st.st_ino != out_st.st_ino) {
+        return 0;
+    }
+    return lseek(in_fd, 0, SEEK_CUR) < out_st.st_size;
+}
+
+// Concatenate files to stdout, copying them inside the kernel
+int builtin_cat(strvec_t *tokens, job_list_t *jobs) {
+    int num_args = simple_command_args(tokens);
+    int has_option = 0;
+    int reads_stdin = num_args == 1;
+    for (int i = 1; i < num_args; i++) {
+        has_option |= tokens->data[i][0] == '-' && tokens->data[i][1] != '\0';
+        reads_stdin |= strcmp(tokens->data[i], "-") == 0;
+    }
+    int redirects_stdin = 0;
+    for (unsigned i = num_args; num_args != -1 && i < tokens->length; i += 2) {
+        redirects_stdin |= token_kind(tokens->data[i]) == TOKEN_REDIRECT_IN;
+    }
+    // Reading the shell's own stdin in-process would leave it unable to stop or interrupt cat, as
+    // would reading or writing anything that can block, such as /dev/zero or a FIFO
+    if (num_args == -1 || has_option || (reads_stdin && !redirects_stdin) ||
+        !redirects_never_block(tokens, num_args)) {
+        return run_external(tokens, jobs);
+    }
+    for (int i = 1; i < num_args; i++) {
+        struct stat st;
+        if (strcmp(tokens->data[i], "-") != 0 && stat(tokens->data[i], &st) == 0 &&
+            !never_blocks(&st, 1)) {
+            return run_external(tokens, jobs);
+        }
+    }
+
+    int saved_fds[3];
+    int result = apply_redirects(tokens, num_args, saved_fds);
+    if (result != 0) {
+        return result == -1 ? BUILTIN_FATAL : BUILTIN_OK;
+    }
+    int status = 0;
+    for (int i = num_args == 1 ? 0 : 1; i < num_args; i++) {
+        const char *name = i == 0 ? "-" : tokens->data[i];
+        int in_fd = STDIN_FILENO;
+        if (strcmp(name, "-") != 0 && (in_fd = open(name, O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (is_output_file(in_fd, STDOUT_FILENO)) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            status = 1;
+        } else if (copy_fd(in_fd, STDOUT_FILENO, name) == -1) {
+            status = 1;
+        }
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+    }
+    restore_redirects(saved_fds);
+    set_last_status(status);
+    return BUILTIN_OK;
+}
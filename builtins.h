@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "job_list.h"
+#include "string_vector.h"
+
+// Return values of builtin handlers
+#define BUILTIN_OK 0        // keep reading commands (any error has already been reported)
+#define BUILTIN_EXIT 1      // the shell should exit normally
+#define BUILTIN_FATAL -1    // the shell hit an unrecoverable error and should exit with status 1
+
+/*
+ * Handler for one builtin command
+ * tokens: The command line, starting with the builtin's name
+ * jobs: List of jobs currently stopped or running in the background
+ * Returns BUILTIN_OK, BUILTIN_EXIT, or BUILTIN_FATAL
+ */
+typedef int (*builtin_fn_t)(strvec_t *tokens, job_list_t *jobs);
+
+typedef struct {
+    const char *name;
+    builtin_fn_t fn;
+} builtin_t;
+
+// Declare a handler for every builtin registered in builtins.def
+#define BUILTIN(name, fn) int fn(strvec_t *tokens, job_list_t *jobs);
+#include "builtins.def"
+#undef BUILTIN
+
+/*
+ * Find the builtin with a given name
+ * Uses the perfect hash table generated from builtins.def, so this costs one hash and at most one
+ * string comparison however many builtins there are
+ * name: The first token of a command line
+ * Returns a pointer to the builtin, or NULL if name is not a builtin (i.e., an external command)
+ */
+const builtin_t *builtin_lookup(const char *name);
+
+#endif    // BUILTINS_H
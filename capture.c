@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 8
+#define MAX_DRAIN (4 * CAPTURE_SIZE)    // most bytes read from one pipe at a time, for fairness
+
+struct capture {
+    int fd;                        // read end of the pipe, or -1 once it has reached end of file
+    unsigned start;                // index in buf of the oldest byte kept
+    unsigned len;                  // number of bytes kept, at most CAPTURE_SIZE
+    unsigned long long total;      // number of bytes read from the pipe so far
+    unsigned retired_id;           // ID of the job it belonged to, once retired
+    char buf[CAPTURE_SIZE];
+};
+
+static int epoll_fd = -1;
+static unsigned num_active = 0;
+static capture_t *retired[CAPTURE_MAX_RETIRED];    // oldest first
+static unsigned num_retired = 0;
+
+int capture_poll_fd(void) {
+    if (epoll_fd == -1 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+    }
+    return epoll_fd;
+}
+
+capture_t *capture_open(int *write_fd) {
+    if (capture_poll_fd() == -1) {
+        return NULL;
+    }
+    capture_t *capture = malloc(sizeof(capture_t));
+    if (capture == NULL) {
+        fprintf(stderr, "Failed to allocate output buffer\n");
+        return NULL;
+    }
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        free(capture);
+        return NULL;
+    }
+    // Only the shell's end is non-blocking; the job blocks as usual if the pipe fills up
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = capture;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fds[0], &event) == -1) {
+        perror("epoll_ctl");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        free(capture);
+        return NULL;
+    }
+    capture->fd = pipe_fds[0];
+    capture->start = 0;
+    capture->len = 0;
+    capture->total = 0;
+    num_active++;
+    *write_fd = pipe_fds[1];
+    return capture;
+}
+
+/*
+ * Stop reading a capture's pipe, keeping the output read so far
+ */
+static void close_pipe(capture_t *capture) {
+    if (capture->fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, capture->fd, NULL);
+        close(capture->fd);
+        capture->fd = -1;
+        num_active--;
+    }
+}
+
+/*
+ * Read what is available from a capture's pipe straight into its ring buffer, overwriting the
+ * oldest output once the buffer is full
+ */
+static void read_pipe(capture_t *capture) {
+    for (unsigned drained = 0; drained < MAX_DRAIN;) {
+        unsigned tail = (capture->start + capture->len) % CAPTURE_SIZE;
+        ssize_t n = read(capture->fd, capture->buf + tail, CAPTURE_SIZE - tail);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            return;
+        } else if (n <= 0) {    // every process has closed its end (or the pipe failed)
+            close_pipe(capture);
+            return;
+        }
+        drained += n;
+        capture->total += n;
+        capture->len += n;
+        if (capture->len > CAPTURE_SIZE) {
+            capture->start = (capture->start + capture->len - CAPTURE_SIZE) % CAPTURE_SIZE;
+            capture->len = CAPTURE_SIZE;
+        }
+    }
+}
+
+int capture_drain(void) {
+    if (epoll_fd == -1) {
+        return 0;
+    }
+    while (1) {
+        struct epoll_event events[MAX_EVENTS];
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < num_events; i++) {
+            read_pipe(events[i].data.ptr);
+        }
+        if (num_events < MAX_EVENTS) {
+            return 0;
+        }
+    }
+}
+
+unsigned capture_active(void) {
+    return num_active;
+}
+
+int capture_is_open(const capture_t *capture) {
+    return capture->fd != -1;
+}
+
+/*
+ * Write all of buf to fd
+ * Returns 0 on success or -1 on error
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+long long capture_print(const capture_t *capture, unsigned long long *pos, int out_fd) {
+    unsigned long long oldest = capture->total - capture->len;
+    long long skipped = 0;
+    if (*pos < oldest) {
+        skipped = oldest - *pos;
+        *pos = oldest;
+    }
+    // The bytes to write may wrap around the end of the ring buffer
+    unsigned first = (capture->start + (*pos - oldest)) % CAPTURE_SIZE;
+    unsigned remaining = capture->total - *pos;
+    while (remaining > 0) {
+        unsigned len = remaining < CAPTURE_SIZE - first ? remaining : CAPTURE_SIZE - first;
+        if (write_all(out_fd, capture->buf + first, len) == -1) {
+            return -1;
+        }
+        *pos += len;
+        remaining -= len;
+        first = 0;
+    }
+    return skipped;
+}
+
+void capture_retire(capture_t *capture, unsigned job_id) {
+    // Drop the output of an earlier job with the same ID, even if this job has none to keep, or
+    // else the oldest if there's no room
+    unsigned i = 0;
+    while (i < num_retired && retired[i]->retired_id != job_id) {
+        i++;
+    }
+    if (i == num_retired && capture != NULL && num_retired == CAPTURE_MAX_RETIRED) {
+        i = 0;
+    }
+    if (i < num_retired) {
+        capture_free(retired[i]);
+        for (; i + 1 < num_retired; i++) {
+            retired[i] = retired[i + 1];
+        }
+        num_retired--;
+    }
+    if (capture == NULL) {
+        return;
+    }
+    capture->retired_id = job_id;
+    retired[num_retired++] = capture;
+}
+
+capture_t *capture_find_retired(unsigned job_id) {
+    for (unsigned i = 0; i < num_retired; i++) {
+        if (retired[i]->retired_id == job_id) {
+            return retired[i];
+        }
+    }
+    return NULL;
+}
+
+void capture_free(capture_t *capture) {
+    if (capture != NULL) {
+        close_pipe(capture);
+        free(capture);
+    }
+}
+
+void capture_free_all(void) {
+    for (unsigned i = 0; i < num_retired; i++) {
+        capture_free(retired[i]);
+    }
+    num_retired = 0;
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
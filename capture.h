@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#define CAPTURE_SIZE (64 * 1024)    // bytes of output kept for each job; older output is dropped
+#define CAPTURE_MAX_RETIRED 16      // removed jobs whose output is kept (see capture_retire())
+
+/*
+ * Captured output of a background job: the read end of a pipe that the job's stdout and stderr
+ * write to, and a ring buffer holding the last CAPTURE_SIZE bytes read from it
+ * Every open pipe is registered with one epoll instance, so the shell can drain them all without
+ * blocking whenever capture_poll_fd() is readable
+ */
+typedef struct capture capture_t;
+
+/*
+ * Get the descriptor that becomes readable whenever a captured job has written output
+ * Returns the descriptor (created on the first call), or -1 on error
+ */
+int capture_poll_fd(void);
+
+/*
+ * Start capturing output into a new ring buffer
+ * write_fd: Set to the write end of the pipe, for the job's processes to write to. The caller must
+ *           close it once they have been started
+ * Returns the capture, or NULL on error (already reported)
+ */
+capture_t *capture_open(int *write_fd);
+
+/*
+ * Read whatever captured output is available, without blocking
+ * Returns 0 on success or -1 on error
+ */
+int capture_drain(void);
+
+/*
+ * Returns the number of captures whose pipe has not yet reached end of file
+ */
+unsigned capture_active(void);
+
+/*
+ * Returns 1 if any process may still write to a capture's pipe, 0 once it has reached end of file
+ */
+int capture_is_open(const capture_t *capture);
+
+/*
+ * Write the output captured since a position to a descriptor
+ * pos: Number of bytes the capture had read when this was last called (0 to start). Updated to
+ *      the number read so far
+ * out_fd: Descriptor to write to
+ * Returns the number of bytes after the old position that were skipped because they had already
+ * been overwritten, or -1 on a write error
+ */
+long long capture_print(const capture_t *capture, unsigned long long *pos, int out_fd);
+
+/*
+ * Keep the output of a job that is being removed from the job list, so it can still be printed
+ * The capture replaces any kept for an earlier job with the same ID, and only the last
+ * CAPTURE_MAX_RETIRED are kept. This takes ownership of capture, which may be NULL if the job had
+ * no output captured, in which case any earlier job's output is still dropped
+ * job_id: ID of the job
+ */
+void capture_retire(capture_t *capture, unsigned job_id);
+
+/*
+ * Find the output kept for a removed job
+ * job_id: ID of the job
+ * Returns the capture, or NULL if none was kept for a job with this ID
+ */
+capture_t *capture_find_retired(unsigned job_id);
+
+/*
+ * Close a capture's pipe and free its ring buffer
+ * capture: The capture to free, or NULL
+ */
+void capture_free(capture_t *capture);
+
+/*
+ * Free every capture kept by capture_retire(), and close the descriptor from capture_poll_fd()
+ */
+void capture_free_all(void);
+
+#endif    // CAPTURE_H
@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CGROUP_FILE_SIZE 4096    // enough for any of the cgroup files the shell reads
+
+static int shell_fd = -1;                 // the shell's cgroup, swish-PID, or -1 if not in use
+static char shell_path[PATH_MAX];
+static pid_t owner = 0;                   // pid of the shell, the only process that removes cgroups
+static unsigned next_id = 0;
+
+/*
+ * Read a whole file, relative to directory dir, into buf as a string
+ * Returns the number of bytes read, or -1 on error
+ */
+static ssize_t read_file(int dir, const char *name, char *buf, size_t size) {
+    int fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t len = 0;
+    ssize_t n;
+    while (len + 1 < (ssize_t) size && (n = read(fd, buf + len, size - len - 1)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        len += n;
+    }
+    buf[len] = '\0';
+    close(fd);
+    return len;
+}
+
+/*
+ * Write a string to a file relative to directory dir, as a single write() since each write to a
+ * cgroup file is one command
+ * Returns 0 on success or -1 on error
+ */
+static int write_file(int dir, const char *name, const char *s) {
+    int fd = openat(dir, name, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t len = strlen(s);
+    int result = write(fd, s, len) == (ssize_t) len ? 0 : -1;
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return result;
+}
+
+/*
+ * Find where the cgroup v2 hierarchy is mounted, from /proc/self/mountinfo
+ * Returns 0 on success or -1 if there is none
+ */
+static int find_mount(char *mount, size_t size) {
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    if (f == NULL) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    int result = -1;
+    while (result == -1 && getline(&line, &line_size, f) != -1) {
+        // ID PARENT MAJOR:MINOR ROOT MOUNT_POINT OPTIONS [OPTIONAL...] - TYPE SOURCE ...
+        char *fields = strstr(line, " - cgroup2 ");
+        char point[PATH_MAX];
+        if (fields != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1 &&
+            strlen(point) < size) {
+            strcpy(mount, point);
+            result = 0;
+        }
+    }
+    free(line);
+    fclose(f);
+    return result;
+}
+
+/*
+ * Find the shell's own cgroup, from the "0::" line of /proc/self/cgroup
+ * Returns 0 on success or -1 if it isn't in a cgroup v2 hierarchy
+ */
+static int find_own_cgroup(char *path, size_t size) {
+    char buf[CGROUP_FILE_SIZE];
+    if (read_file(AT_FDCWD, "/proc/self/cgroup", buf, sizeof(buf)) == -1) {
+        return -1;
+    }
+    for (char *line = buf; line != NULL && *line != '\0';) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (strncmp(line, "0::", 3) == 0 && strlen(line + 3) < size) {
+            strcpy(path, line + 3);
+            return 0;
+        }
+        line = next;
+    }
+    return -1;
+}
+
+/*
+ * Enable the memory and cpu controllers for the children of cgroup dir, each one that it has
+ * available. Failing to do so only means limits fall back to setrlimit()
+ */
+static void enable_controllers(int dir) {
+    char available[CGROUP_FILE_SIZE];
+    if (read_file(dir, "cgroup.controllers", available, sizeof(available)) == -1) {
+        return;
+    }
+    const char *controllers[] = {"memory", "cpu"};
+    for (unsigned i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        char *found = strstr(available, controllers[i]);
+        size_t len = strlen(controllers[i]);
+        if (found != NULL && (found[len] == ' ' || found[len] == '\n' || found[len] == '\0')) {
+            char command[16];
+            snprintf(command, sizeof(command), "+%s", controllers[i]);
+            write_file(dir, "cgroup.subtree_control", command);
+        }
+    }
+}
+
+int cgroup_init(void) {
+    char mount[PATH_MAX];
+    char own[PATH_MAX];
+    if (find_mount(mount, sizeof(mount)) == -1 || find_own_cgroup(own, sizeof(own)) == -1) {
+        fprintf(stderr, "cgroups: no cgroup v2 hierarchy, so jobs run without cgroups\n");
+        return -1;
+    }
+    char parent[PATH_MAX];
+    if (snprintf(parent, sizeof(parent), "%s%s", mount, strcmp(own, "/") == 0 ? "" : own) >=
+            (int) sizeof(parent) ||
+        snprintf(shell_path, sizeof(shell_path), "%s/swish-%d", parent, getpid()) >=
+            (int) sizeof(shell_path)) {
+        fprintf(stderr, "cgroups: path too long, so jobs run without cgroups\n");
+        return -1;
+    }
+
+    // The cgroup the shell was started in still holds the shell, which keeps it from enabling
+    // controllers for its children unless it is the root. The shell's own cgroup holds no
+    // processes, so it can always pass on the controllers it gets
+    int parent_fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parent_fd != -1) {
+        enable_controllers(parent_fd);
+        close(parent_fd);
+    }
+    if (mkdir(shell_path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "cgroups: %s: %s, so jobs run without cgroups\n", shell_path,
+                strerror(errno));
+        return -1;
+    }
+    if ((shell_fd = open(shell_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "cgroups: %s: %s, so jobs run without cgroups\n", shell_path,
+                strerror(errno));
+        rmdir(shell_path);
+        return -1;
+    }
+    enable_controllers(shell_fd);
+    owner = getpid();
+    return 0;
+}
+
+int cgroup_enabled(void) {
+    return shell_fd != -1;
+}
+
+int cgroup_create(unsigned *id) {
+    char name[32];
+    snprintf(name, sizeof(name), "job-%u", next_id);
+    if (mkdirat(shell_fd, name, 0755) == -1) {
+        fprintf(stderr, "cgroups: %s/%s: %s\n", shell_path, name, strerror(errno));
+        return -1;
+    }
+    int fd = openat(shell_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "cgroups: %s/%s: %s\n", shell_path, name, strerror(errno));
+        unlinkat(shell_fd, name, AT_REMOVEDIR);
+        return -1;
+    }
+    *id = next_id++;
+    return fd;
+}
+
+int cgroup_set_memory_max(int fd, long long bytes) {
+    char value[32];
+    snprintf(value, sizeof(value), "%lld", bytes);
+    return write_file(fd, "memory.max", value);
+}
+
+int cgroup_set_cpu_max(int fd, long quota) {
+    char value[48];
+    snprintf(value, sizeof(value), "%ld %d", quota, CGROUP_CPU_PERIOD);
+    return write_file(fd, "cpu.max", value);
+}
+
+/*
+ * Returns the number after "key " at the start of a line of a flat-keyed cgroup file, or -1 if
+ * there is none
+ */
+static long long stat_value(const char *buf, const char *key) {
+    size_t len = strlen(key);
+    for (const char *line = buf; line != NULL; line = strchr(line, '\n')) {
+        line += *line == '\n';
+        if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+            return strtoll(line + len + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+int cgroup_stats(int fd, cgroup_stats_t *stats) {
+    char buf[CGROUP_FILE_SIZE];
+    if (read_file(fd, "cpu.stat", buf, sizeof(buf)) == -1) {
+        return -1;
+    }
+    stats->cpu_usec = stat_value(buf, "usage_usec");
+    stats->user_usec = stat_value(buf, "user_usec");
+    stats->system_usec = stat_value(buf, "system_usec");
+    stats->memory_current = -1;
+    stats->memory_peak = -1;
+    if (read_file(fd, "memory.current", buf, sizeof(buf)) != -1) {
+        stats->memory_current = strtoll(buf, NULL, 10);
+    }
+    if (read_file(fd, "memory.peak", buf, sizeof(buf)) != -1) {    // Linux 5.19 and later
+        stats->memory_peak = strtoll(buf, NULL, 10);
+    }
+    return 0;
+}
+
+int cgroup_signal(int fd, int sig) {
+    if (sig == SIGKILL && write_file(fd, "cgroup.kill", "1") == 0) {    // Linux 5.14 and later
+        return 0;
+    }
+    // Otherwise signal each process in turn. One that forks in the meantime may leave a new
+    // process behind, which the next signal reaches
+    char buf[CGROUP_FILE_SIZE];
+    int procs = openat(fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    if (procs == -1) {
+        return -1;
+    }
+    FILE *f = fdopen(procs, "r");
+    if (f == NULL) {
+        close(procs);
+        return -1;
+    }
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        pid_t pid = strtol(buf, NULL, 10);
+        if (pid > 0 && kill(pid, sig) == -1 && errno != ESRCH) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+pid_t cgroup_fork(int fd) {
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = fd;
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid != -1 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL)) {
+        return pid;
+    }
+
+    // Before Linux 5.7, the child moves itself before it executes anything
+    pid = fork();
+    if (pid == 0 && write_file(fd, "cgroup.procs", "0") == -1) {
+        static const char msg[] = "cgroups: failed to join the job's cgroup\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    }
+    return pid;
+}
+
+void cgroup_remove(int fd, unsigned id) {
+    close(fd);
+    if (getpid() != owner) {
+        return;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "job-%u", id);
+    unlinkat(shell_fd, name, AT_REMOVEDIR);    // fails with EBUSY if processes are left
+}
+
+void cgroup_stop(void) {
+    if (shell_fd == -1) {
+        return;
+    }
+    close(shell_fd);
+    shell_fd = -1;
+    rmdir(shell_path);
+}
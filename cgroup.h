@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <sys/types.h>
+
+#define CGROUP_CPU_PERIOD 100000    // microseconds over which a job's CPU quota is measured
+
+/*
+ * Per-job cgroups (cgroup v2), used when the shell is started with SWISH_CGROUPS=1. The shell makes
+ * a cgroup named swish-PID inside the one it was started in, and one inside that for each job,
+ * job-N. A job's processes are created straight in its cgroup with clone3(CLONE_INTO_CGROUP) (or,
+ * on kernels without it, join it before they execute anything), so every process they start stays
+ * in it too, even one that leaves the job's process group. That lets jobs -l show the whole
+ * tree's memory and CPU use while it runs, the limit builtin set memory.max and cpu.max, and kill
+ * and timeouts reach all of it at once through cgroup.kill
+ *
+ * When there is no cgroup v2 hierarchy that the shell can write to, or the memory or cpu
+ * controller isn't delegated to it, jobs run without cgroups as usual, and memory limits fall back
+ * to setrlimit(RLIMIT_AS) in each of the job's processes
+ */
+
+struct cpu_mask;
+
+typedef struct {
+    long long memory_max;           // bytes, or 0 for no limit
+    long cpu_quota;                 // microseconds of CPU time per CGROUP_CPU_PERIOD, or 0 for none
+    const struct cpu_mask *cpus;    // CPUs to pin the job to (see affinity.h), or NULL for any
+} job_limits_t;
+
+typedef struct {
+    long long memory_current;    // bytes in use now, or -1 without the memory controller
+    long long memory_peak;       // most bytes ever in use, or -1 if the kernel doesn't say
+    long long cpu_usec;          // CPU time used by every process that has been in the cgroup
+    long long user_usec;
+    long long system_usec;
+} cgroup_stats_t;
+
+/*
+ * Make the shell's own cgroup and enable the memory and cpu controllers for its jobs where
+ * possible. Problems are reported, after which cgroups are not used
+ * Returns 0 if jobs will get cgroups, -1 otherwise
+ */
+int cgroup_init(void);
+
+/*
+ * Returns 1 if jobs get cgroups, 0 otherwise
+ */
+int cgroup_enabled(void);
+
+/*
+ * Make a new, empty cgroup for a job
+ * id: Set to the number in the cgroup's name, for cgroup_remove()
+ * Returns a descriptor of the cgroup's directory, or -1 on error (already reported)
+ */
+int cgroup_create(unsigned *id);
+
+/*
+ * Set a job cgroup's memory.max
+ * Returns 0 on success or -1 if it can't be set (e.g., the memory controller isn't enabled)
+ */
+int cgroup_set_memory_max(int fd, long long bytes);
+
+/*
+ * Set a job cgroup's cpu.max to quota microseconds per CGROUP_CPU_PERIOD
+ * Returns 0 on success or -1 if it can't be set (e.g., the cpu controller isn't enabled)
+ */
+int cgroup_set_cpu_max(int fd, long quota);
+
+/*
+ * Read what the processes in a job's cgroup have used
+ * Returns 0 on success or -1 on error
+ */
+int cgroup_stats(int fd, cgroup_stats_t *stats);
+
+/*
+ * Send a signal to every process in a job's cgroup. SIGKILL goes through cgroup.kill, so no
+ * process can escape it by forking
+ * Returns 0 on success or -1 on error
+ */
+int cgroup_signal(int fd, int sig);
+
+/*
+ * Create a child process in a job's cgroup, as fork() does. The child is normally made with a bare
+ * clone3() system call, which skips glibc's own fork() handling (resetting its locks and running
+ * atfork handlers), so the child may only make async-signal-safe calls until it execs
+ * Returns the child's pid in the parent and 0 in the child, or -1 on error
+ */
+pid_t cgroup_fork(int fd);
+
+/*
+ * Close a job's cgroup, and remove it if no process is left in it. A cgroup that still has
+ * processes (which have outlived their job) is left in place. Only the shell itself removes
+ * cgroups, so this does nothing but close fd in a child of the shell
+ * fd, id: The cgroup's descriptor and the id from cgroup_create()
+ */
+void cgroup_remove(int fd, unsigned id);
+
+/*
+ * Remove the shell's own cgroup, if its jobs' cgroups are all gone
+ */
+void cgroup_stop(void);
+
+#endif    // CGROUP_H
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+// Build-time generator for builtin_table.h: finds a seed for builtin_hash() under which every
+// builtin listed in builtins.def lands in a different slot of a power-of-2 sized table, then
+// prints that table as C source
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "builtin_hash.h"
+
+#define MAX_SEED_TRIES (1u << 22)
+
+#define BUILTIN(name, fn) name,
+static const char *names[] = {
+#include "builtins.def"
+};
+#undef BUILTIN
+
+#define BUILTIN(name, fn) #fn,
+static const char *handlers[] = {
+#include "builtins.def"
+};
+#undef BUILTIN
+
+#define NUM_BUILTINS (sizeof(names) / sizeof(names[0]))
+
+/*
+ * Check whether seed hashes every builtin to a distinct slot of a table with 'size' slots
+ * slots: Filled with each builtin's slot if so
+ * Returns 1 if the seed gives a perfect hash, 0 otherwise
+ */
+static int try_seed(uint32_t seed, unsigned size, unsigned *slots) {
+    unsigned char used[size];
+    memset(used, 0, size);
+    for (unsigned i = 0; i < NUM_BUILTINS; i++) {
+        slots[i] = builtin_hash(names[i], seed) & (size - 1);
+        if (used[slots[i]]) {
+            return 0;
+        }
+        used[slots[i]] = 1;
+    }
+    return 1;
+}
+
+int main(void) {
+    unsigned slots[NUM_BUILTINS];
+    // Start with a table at least twice the number of builtins, so a seed turns up quickly
+    unsigned size = 1;
+    while (size < 2 * NUM_BUILTINS) {
+        size *= 2;
+    }
+
+    uint32_t seed = 0;
+    while (!try_seed(seed, size, slots)) {
+        if (++seed == MAX_SEED_TRIES) {
+            seed = 0;
+            size *= 2;
+        }
+    }
+
+    printf("// Generated by gen_builtin_table from builtins.def. Do not edit.\n\n");
+    printf("#define BUILTIN_HASH_SEED %uu\n", seed);
+    printf("#define BUILTIN_TABLE_SIZE %u\n\n", size);
+    printf("static const builtin_t builtin_table[BUILTIN_TABLE_SIZE] = {\n");
+    for (unsigned i = 0; i < NUM_BUILTINS; i++) {
+        printf("    [%u] = {\"%s\", %s},\n", slots[i], names[i], handlers[i]);
+    }
+    printf("};\n");
+    return 0;
+}
@@ -0,0 +1,540 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "graph.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "string_vector.h"
+#include "swish_funcs.h"
+
+#define INITIAL_NODES 16
+
+/*
+ * A dependency named on a graph file line, before it is resolved to a node
+ */
+typedef struct {
+    char *name;
+    unsigned node;    // node that depends on it
+    unsigned dep;     // node it names, once resolved
+} dep_ref_t;
+
+/*
+ * State of loading a graph file
+ */
+typedef struct {
+    const char *path;
+    graph_t *graph;
+    unsigned nodes_capacity;
+    dep_ref_t *deps;
+    unsigned num_deps;
+    unsigned deps_capacity;
+    unsigned *dep_start;    // node i's dependencies are deps[dep_start[i]] up to dep_start[i + 1]
+    unsigned *table;        // hash table from target to node index plus 1, or 0 for an empty entry
+    unsigned table_size;    // a power of 2
+} loader_t;
+
+/*
+ * FNV-1a hash of a target name
+ */
+static uint32_t target_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Find the hash table entry for a target: the entry holding it, or the empty entry it belongs in
+ */
+static unsigned *lookup(loader_t *ld, const char *name) {
+    unsigned i = target_hash(name) & (ld->table_size - 1);
+    while (ld->table[i] != 0 && strcmp(ld->graph->nodes[ld->table[i] - 1].target, name) != 0) {
+        i = (i + 1) & (ld->table_size - 1);
+    }
+    return &ld->table[i];
+}
+
+/*
+ * Returns the index in graph->succs just past the last of a node's successors
+ */
+static unsigned succ_end(const graph_t *graph, unsigned node) {
+    return node + 1 < graph->num_nodes ? graph->nodes[node + 1].first_succ : graph->num_succs;
+}
+
+/*
+ * Read a whole file into a new buffer, terminated by '\0'
+ * Returns the buffer, to be freed with free(), or NULL on error (already reported)
+ */
+static char *read_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    size_t capacity = st.st_size + 1;
+    size_t len = 0;
+    char *text = malloc(capacity);
+    if (text == NULL) {
+        fprintf(stderr, "Failed to allocate graph file buffer\n");
+        close(fd);
+        return NULL;
+    }
+
+    ssize_t n;
+    // The size may have changed since fstat(), so read until end of file regardless
+    while ((n = read(fd, text + len, capacity - len - 1)) != 0) {
+        if (n == -1) {
+            perror(path);
+            free(text);
+            close(fd);
+            return NULL;
+        }
+        len += n;
+        if (len + 1 == capacity) {
+            char *bigger = realloc(text, capacity * 2);
+            if (bigger == NULL) {
+                fprintf(stderr, "Failed to allocate graph file buffer\n");
+                free(text);
+                close(fd);
+                return NULL;
+            }
+            text = bigger;
+            capacity *= 2;
+        }
+    }
+    close(fd);
+    text[len] = '\0';
+    return text;
+}
+
+/*
+ * Add a node for a target, growing the node arrays as needed
+ * Returns the new node, or NULL on error
+ */
+static graph_node_t *add_node(loader_t *ld, const char *target, unsigned line) {
+    graph_t *graph = ld->graph;
+    if (graph->num_nodes + 1 >= ld->nodes_capacity) {
+        unsigned capacity = ld->nodes_capacity == 0 ? INITIAL_NODES : ld->nodes_capacity * 2;
+        graph_node_t *nodes = realloc(graph->nodes, capacity * sizeof(graph_node_t));
+        if (nodes == NULL) {
+            return NULL;
+        }
+        graph->nodes = nodes;
+        unsigned *dep_start = realloc(ld->dep_start, capacity * sizeof(unsigned));
+        if (dep_start == NULL) {
+            return NULL;
+        }
+        ld->dep_start = dep_start;
+        ld->nodes_capacity = capacity;
+    }
+
+    graph_node_t *node = &graph->nodes[graph->num_nodes];
+    ld->dep_start[graph->num_nodes++] = ld->num_deps;
+    memset(node, 0, sizeof(graph_node_t));
+    node->target = target;
+    node->line = line;
+    node->state = NODE_WAITING;
+    return node;
+}
+
+/*
+ * Record that the most recently added node depends on a target
+ * Returns 0 on success or -1 on error
+ */
+static int add_dep(loader_t *ld, char *name) {
+    if (ld->num_deps == ld->deps_capacity) {
+        unsigned capacity = ld->deps_capacity == 0 ? INITIAL_NODES : ld->deps_capacity * 2;
+        dep_ref_t *deps = realloc(ld->deps, capacity * sizeof(dep_ref_t));
+        if (deps == NULL) {
+            return -1;
+        }
+        ld->deps = deps;
+        ld->deps_capacity = capacity;
+    }
+    ld->deps[ld->num_deps].name = name;
+    ld->deps[ld->num_deps++].node = ld->graph->num_nodes - 1;
+    return 0;
+}
+
+/*
+ * Parse one line of a graph file, which has already been split off and starts with the target
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int parse_line(loader_t *ld, char *line, unsigned line_num) {
+    graph_t *graph = ld->graph;
+    char *colon = strchr(line, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "run-graph: %s:%u: expected 'target: dependencies ; command'\n", ld->path,
+                line_num);
+        return -1;
+    }
+    char *end = colon;
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    *end = '\0';
+    if (end == line || strpbrk(line, " \t") != NULL) {
+        fprintf(stderr, "run-graph: %s:%u: invalid target\n", ld->path, line_num);
+        return -1;
+    }
+    graph_node_t *node = add_node(ld, line, line_num);
+    if (node == NULL) {
+        fprintf(stderr, "Failed to allocate graph node\n");
+        return -1;
+    }
+
+    char *command = strchr(colon + 1, ';');
+    if (command != NULL) {
+        *command++ = '\0';
+    }
+    char *save;
+    for (char *dep = strtok_r(colon + 1, " \t", &save); dep != NULL;
+         dep = strtok_r(NULL, " \t", &save)) {
+        if (add_dep(ld, dep) == -1) {
+            fprintf(stderr, "Failed to allocate graph dependency\n");
+            return -1;
+        }
+    }
+
+    node->first_token = graph->tokens.length;
+    if (command != NULL) {
+        int result = tokenize(command, &graph->tokens);
+        if (result != 0) {
+            if (result == 1) {
+                fprintf(stderr, "run-graph: %s:%u: invalid command\n", ld->path, line_num);
+            }
+            return -1;
+        }
+    }
+    node->num_tokens = graph->tokens.length - node->first_token;
+    for (unsigned i = node->first_token; i < graph->tokens.length; i++) {
+        token_kind_t kind = token_kind(graph->tokens.data[i]);
+        if (kind == TOKEN_BACKGROUND || kind == TOKEN_SEPARATOR) {
+            fprintf(stderr, "run-graph: %s:%u: a node's command can't use '%s'\n", ld->path,
+                    line_num, graph->tokens.data[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Index the nodes by target, and turn every dependency into an edge from the node depended on to
+ * the node that depends on it
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int link_nodes(loader_t *ld) {
+    graph_t *graph = ld->graph;
+    ld->table_size = INITIAL_NODES;
+    while (ld->table_size < graph->num_nodes * 2) {
+        ld->table_size *= 2;
+    }
+    ld->table = calloc(ld->table_size, sizeof(unsigned));
+    graph->succs = malloc((ld->num_deps + 1) * sizeof(unsigned));
+    if (ld->table == NULL || graph->succs == NULL) {
+        fprintf(stderr, "Failed to allocate graph\n");
+        return -1;
+    }
+    for (unsigned i = 0; i < graph->num_nodes; i++) {
+        unsigned *entry = lookup(ld, graph->nodes[i].target);
+        if (*entry != 0) {
+            fprintf(stderr, "run-graph: %s:%u: '%s' is already defined on line %u\n", ld->path,
+                    graph->nodes[i].line, graph->nodes[i].target, graph->nodes[*entry - 1].line);
+            return -1;
+        }
+        *entry = i + 1;
+    }
+
+    // Count each node's successors, then lay their lists out back to back
+    for (unsigned i = 0; i < ld->num_deps; i++) {
+        unsigned found = *lookup(ld, ld->deps[i].name);
+        if (found == 0) {
+            fprintf(stderr, "run-graph: %s:%u: unknown dependency '%s'\n", ld->path,
+                    graph->nodes[ld->deps[i].node].line, ld->deps[i].name);
+            return -1;
+        }
+        ld->deps[i].dep = found - 1;
+        graph->nodes[found - 1].first_succ++;
+        graph->nodes[ld->deps[i].node].num_waiting++;
+    }
+    unsigned total = 0;
+    for (unsigned i = 0; i < graph->num_nodes; i++) {
+        unsigned count = graph->nodes[i].first_succ;
+        graph->nodes[i].first_succ = total;
+        total += count;
+    }
+    graph->num_succs = total;
+    ld->dep_start[graph->num_nodes] = ld->num_deps;
+    return 0;
+}
+
+/*
+ * Report a cycle among the nodes that a topological sort could not reach
+ * remaining: Number of each node's dependencies that were never sorted
+ */
+static void report_cycle(loader_t *ld, const unsigned *remaining) {
+    graph_t *graph = ld->graph;
+    unsigned node = 0;
+    while (remaining[node] == 0) {
+        node++;
+    }
+    // Every unsorted node depends on another unsorted node, so stepping back through dependencies
+    // as many times as there are nodes ends up on a cycle
+    for (unsigned step = 0; step < graph->num_nodes; step++) {
+        for (unsigned i = ld->dep_start[node]; i < ld->dep_start[node + 1]; i++) {
+            unsigned dep = ld->deps[i].dep;
+            if (remaining[dep] != 0) {
+                node = dep;
+                break;
+            }
+        }
+    }
+    fprintf(stderr, "run-graph: %s:%u: '%s' depends on itself through a cycle\n", ld->path,
+            graph->nodes[node].line, graph->nodes[node].target);
+}
+
+/*
+ * Fill in the successor lists, check that there are no cycles, and compute every node's height
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int sort_nodes(loader_t *ld) {
+    graph_t *graph = ld->graph;
+    unsigned n = graph->num_nodes;
+    unsigned *fill = malloc((n + 1) * sizeof(unsigned));
+    unsigned *order = malloc((n + 1) * sizeof(unsigned));
+    unsigned *remaining = malloc((n + 1) * sizeof(unsigned));
+    if (fill == NULL || order == NULL || remaining == NULL) {
+        fprintf(stderr, "Failed to allocate graph\n");
+        free(fill);
+        free(order);
+        free(remaining);
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        fill[i] = graph->nodes[i].first_succ;
+        remaining[i] = graph->nodes[i].num_waiting;
+    }
+    for (unsigned i = 0; i < ld->num_deps; i++) {
+        graph->succs[fill[ld->deps[i].dep]++] = ld->deps[i].node;
+    }
+
+    // Kahn's algorithm, with order doubling as the queue of nodes whose dependencies are all sorted
+    unsigned num_sorted = 0;
+    for (unsigned i = 0; i < n; i++) {
+        if (remaining[i] == 0) {
+            order[num_sorted++] = i;
+        }
+    }
+    for (unsigned head = 0; head < num_sorted; head++) {
+        unsigned node = order[head];
+        for (unsigned i = graph->nodes[node].first_succ; i < succ_end(graph, node); i++) {
+            if (--remaining[graph->succs[i]] == 0) {
+                order[num_sorted++] = graph->succs[i];
+            }
+        }
+    }
+    int result = 0;
+    if (num_sorted < n) {
+        report_cycle(ld, remaining);
+        result = -1;
+    } else {
+        // Successors come later in the order, so going backwards their heights are already known
+        for (unsigned k = n; k-- > 0;) {
+            graph_node_t *node = &graph->nodes[order[k]];
+            node->height = 1;
+            for (unsigned i = node->first_succ; i < succ_end(graph, order[k]); i++) {
+                if (graph->nodes[graph->succs[i]].height >= node->height) {
+                    node->height = graph->nodes[graph->succs[i]].height + 1;
+                }
+            }
+        }
+    }
+    free(fill);
+    free(order);
+    free(remaining);
+    return result;
+}
+
+/*
+ * Returns 1 if node a should start before node b, 0 otherwise
+ */
+static int runs_before(const graph_t *graph, unsigned a, unsigned b) {
+    if (graph->nodes[a].height != graph->nodes[b].height) {
+        return graph->nodes[a].height > graph->nodes[b].height;
+    }
+    return a < b;    // then in the order they are defined in
+}
+
+/*
+ * Add a node to the ready heap
+ */
+static void push_ready(graph_t *graph, unsigned node) {
+    graph->nodes[node].state = NODE_READY;
+    unsigned i = graph->num_ready++;
+    while (i > 0 && runs_before(graph, node, graph->ready[(i - 1) / 2])) {
+        graph->ready[i] = graph->ready[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    graph->ready[i] = node;
+}
+
+graph_t *graph_load(const char *path, unsigned max_running) {
+    graph_t *graph = calloc(1, sizeof(graph_t));
+    if (graph == NULL) {
+        fprintf(stderr, "Failed to allocate graph\n");
+        return NULL;
+    }
+    graph->max_running = max_running;
+    if (strvec_init_arena(&graph->tokens) == -1) {
+        fprintf(stderr, "Failed to initialize graph tokens\n");
+        free(graph);
+        return NULL;
+    }
+    loader_t ld = {.path = path, .graph = graph};
+    if ((graph->text = read_file(path)) == NULL) {
+        graph_free(graph);
+        return NULL;
+    }
+
+    int result = 0;
+    unsigned line_num = 0;
+    char *next = graph->text;
+    while (result == 0 && next != NULL) {
+        char *line = next;
+        line_num++;
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        line += strspn(line, " \t");
+        if (*line != '\0' && *line != '#') {
+            result = parse_line(&ld, line, line_num);
+        }
+    }
+    if (result == 0 && graph->num_nodes > 0) {
+        result = link_nodes(&ld);
+    }
+    if (result == 0 && graph->num_nodes > 0) {
+        result = sort_nodes(&ld);
+    }
+    if (graph->max_running > graph->num_nodes) {
+        graph->max_running = graph->num_nodes;
+    }
+    if (result == 0) {
+        graph->ready = malloc((graph->num_nodes + 1) * sizeof(unsigned));
+        graph->running = malloc((graph->max_running + 1) * sizeof(unsigned));
+        if (graph->ready == NULL || graph->running == NULL) {
+            fprintf(stderr, "Failed to allocate graph\n");
+            result = -1;
+        }
+    }
+    free(ld.deps);
+    free(ld.dep_start);
+    free(ld.table);
+    if (result == -1) {
+        graph_free(graph);
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < graph->num_nodes; i++) {
+        if (graph->nodes[i].num_waiting == 0) {
+            push_ready(graph, i);
+        }
+    }
+    return graph;
+}
+
+void graph_free(graph_t *graph) {
+    if (graph == NULL) {
+        return;
+    }
+    strvec_clear(&graph->tokens);
+    free(graph->nodes);
+    free(graph->succs);
+    free(graph->ready);
+    free(graph->running);
+    free(graph->text);
+    free(graph);
+}
+
+int graph_take_ready(graph_t *graph) {
+    if (graph->num_ready == 0 || graph->num_running >= graph->max_running) {
+        return -1;
+    }
+    unsigned node = graph->ready[0];
+    unsigned last = graph->ready[--graph->num_ready];
+    unsigned i = 0;
+    while (2 * i + 1 < graph->num_ready) {
+        unsigned child = 2 * i + 1;
+        if (child + 1 < graph->num_ready &&
+            runs_before(graph, graph->ready[child + 1], graph->ready[child])) {
+            child++;
+        }
+        if (!runs_before(graph, graph->ready[child], last)) {
+            break;
+        }
+        graph->ready[i] = graph->ready[child];
+        i = child;
+    }
+    graph->ready[i] = last;
+
+    graph->nodes[node].state = NODE_RUNNING;
+    graph->nodes[node].pid = 0;
+    graph->running[graph->num_running++] = node;
+    return node;
+}
+
+int graph_find_pid(const graph_t *graph, pid_t pid) {
+    for (unsigned i = 0; i < graph->num_running; i++) {
+        if (graph->nodes[graph->running[i]].pid == pid) {
+            return graph->running[i];
+        }
+    }
+    return -1;
+}
+
+void graph_node_done(graph_t *graph, unsigned node, int exit_status) {
+    graph_node_t *done = &graph->nodes[node];
+    done->exit_status = exit_status;
+    done->state = exit_status == 0 ? NODE_SUCCEEDED : NODE_FAILED;
+    for (unsigned i = 0; i < graph->num_running; i++) {
+        if (graph->running[i] == node) {
+            graph->running[i] = graph->running[--graph->num_running];
+            break;
+        }
+    }
+    if (exit_status != 0) {
+        graph->num_failed++;
+        return;
+    }
+    for (unsigned i = done->first_succ; i < succ_end(graph, node); i++) {
+        if (--graph->nodes[graph->succs[i]].num_waiting == 0) {
+            push_ready(graph, graph->succs[i]);
+        }
+    }
+}
+
+const graph_node_t *graph_next_failed(const graph_t *graph, unsigned *pos) {
+    while (*pos < graph->num_nodes) {
+        const graph_node_t *node = &graph->nodes[(*pos)++];
+        if (node->state == NODE_FAILED) {
+            return node;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <sys/types.h>
+
+#include "string_vector.h"
+
+/*
+ * Dependency graph of commands for run-graph (see run_graph() in swish_funcs.h). A graph file has
+ * one node per line:
+ *   target: dep... ; command [arg...]
+ * The node's command runs once every node it depends on has succeeded. The dependencies and the
+ * command may both be left out (without a command, the ';' is optional too), and blank lines and
+ * lines starting with '#' are ignored. Dependencies may be named before or after their own lines
+ *
+ * Nodes become ready the moment their last dependency succeeds, and ready nodes are started in
+ * order of the longest chain of nodes still waiting on them, so the critical path is never held up
+ * by nodes that have plenty of slack. The successors of a node that fails are never run, but every
+ * other node still is
+ */
+
+typedef enum {
+    NODE_WAITING,      // some dependencies have not succeeded yet
+    NODE_READY,        // on the ready heap
+    NODE_RUNNING,
+    NODE_SUCCEEDED,
+    NODE_FAILED,       // exited with a nonzero status, or could not be started
+} node_state_t;
+
+typedef struct {
+    const char *target;
+    unsigned line;            // line of the graph file the node is defined on
+    unsigned first_token;     // the command is tokens[first_token] up to first_token + num_tokens
+    unsigned num_tokens;
+    unsigned first_succ;      // successors are succs[first_succ] up to the next node's first_succ
+    unsigned num_waiting;     // dependencies that have not succeeded yet
+    unsigned height;          // nodes on the longest chain from this one to one without successors
+    node_state_t state;
+    pid_t pid;                // pid of the command's last stage while it is running, or 0
+    int exit_status;
+} graph_node_t;
+
+typedef struct graph {
+    graph_node_t *nodes;
+    unsigned num_nodes;
+    unsigned *succs;          // every node's successors, back to back (one entry per dependency)
+    unsigned num_succs;
+    unsigned *ready;          // binary heap of ready nodes, greatest height first
+    unsigned num_ready;
+    unsigned *running;        // nodes currently running, in no particular order
+    unsigned num_running;
+    unsigned max_running;
+    unsigned num_failed;
+    unsigned num_unrun;       // nodes that never ran, once the graph is finished
+    int holder_exited;        // the process holding the job's process group is gone
+    int finished;             // nothing more will run, and the job's exit status has been set
+    strvec_t tokens;          // every node's command, from tokenize()
+    char *text;               // contents of the graph file, which targets and tokens point into
+} graph_t;
+
+/*
+ * Read and check a graph file: every dependency must be a node, no target may be defined twice,
+ * and there must be no cycles. Problems are reported with the line they are on
+ * path: Path of the graph file
+ * max_running: Most nodes to run at once
+ * Returns the graph, to be freed with graph_free(), or NULL on error (already reported)
+ */
+graph_t *graph_load(const char *path, unsigned max_running);
+
+/*
+ * Free a graph and everything in it
+ * graph: The graph, or NULL
+ */
+void graph_free(graph_t *graph);
+
+/*
+ * Take the ready node with the greatest height, marking it as running, unless max_running nodes
+ * are running already
+ * Returns the index of the node, or -1 if none can start now
+ */
+int graph_take_ready(graph_t *graph);
+
+/*
+ * Find the running node whose command's last stage has a given pid
+ * Returns the index of the node, or -1 if there is none
+ */
+int graph_find_pid(const graph_t *graph, pid_t pid);
+
+/*
+ * Record that a running node has finished, making ready any successors that were only waiting on
+ * it if it succeeded
+ * node: Index of the node
+ * exit_status: Exit status of the node's command, where 0 means it succeeded
+ */
+void graph_node_done(graph_t *graph, unsigned node, int exit_status);
+
+/*
+ * Iterate over the nodes that failed, in the order they are defined in
+ * pos: 0 to start, then passed back unchanged
+ * Returns the next failed node, or NULL when there are no more
+ */
+const graph_node_t *graph_next_failed(const graph_t *graph, unsigned *pos);
+
+#endif    // GRAPH_H
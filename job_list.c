@@ -1,116 +1,294 @@
 // Author: John Kolb <jhkolb@umn.edu>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#define _GNU_SOURCE
+
 #include "job_list.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
+
+#include "affinity.h"
+#include "capture.h"
+#include "cgroup.h"
+#include "graph.h"
+
+#define INITIAL_SLOTS 8
+#define INITIAL_PIDS 16
+#define NO_SLOT ((unsigned) -1)
+#define PID_EMPTY 0
+#define PID_DELETED -1
 
 void job_list_init(job_list_t *list) {
-    list->head = NULL;
+    list->slots = NULL;
+    list->capacity = 0;
+    list->num_slots = 0;
+    list->free_head = NO_SLOT;
     list->length = 0;
+    list->pids = NULL;
+    list->pids_size = 0;
+    list->pids_used = 0;
 }
 
 void job_list_free(job_list_t *list) {
-    job_t *current = list->head;
-    while (current != NULL) {
-        job_t *temp = current;
-        current = current->next;
-        free(temp);
+    for (unsigned i = 0; i < list->num_slots; i++) {
+        if (list->slots[i].in_use) {
+            free(list->slots[i].batch);
+            free(list->slots[i].cpus);
+            graph_free(list->slots[i].graph);
+            capture_free(list->slots[i].capture);
+            if (list->slots[i].cgroup_fd != -1) {
+                cgroup_remove(list->slots[i].cgroup_fd, list->slots[i].cgroup_id);
+            }
+        }
     }
-    list->head = NULL;
-    list->length = 0;
+    free(list->slots);
+    free(list->pids);
+    job_list_init(list);
 }
 
-int job_list_add(job_list_t *list, pid_t pid, const char *name, job_status_t status) {
-    if (list->head == NULL) {
-        if ((list->head = malloc(sizeof(job_t))) == NULL) {
-            return -1;
-        }
-        strncpy(list->head->name, name, NAME_LEN);
-        list->head->name[NAME_LEN - 1] = '\0';
-        list->head->status = status;
-        list->head->next = NULL;
-        list->head->pid = pid;
-        list->length = 1;
-        return 0;
+/*
+ * Starting point of the probe sequence for pid in a table of size 'size' (a power of 2)
+ */
+static unsigned pid_hash(pid_t pid, unsigned size) {
+    // Multiplicative hashing spreads consecutive pids across the table
+    uint32_t h = (uint32_t) pid * 2654435769u;
+    return (h ^ (h >> 16)) & (size - 1);
+}
+
+/*
+ * Returns 1 if a pid table entry still refers to a live job, 0 if that job has since been removed
+ */
+static int pid_entry_valid(const job_list_t *list, const pid_entry_t *entry) {
+    const job_t *job = &list->slots[entry->slot];
+    return job->in_use && job->generation == entry->generation;
+}
+
+/*
+ * Find the table entry for pid, or NULL if it is not in the table
+ */
+static pid_entry_t *pid_lookup(job_list_t *list, pid_t pid) {
+    if (list->pids_size == 0) {
+        return NULL;
     }
 
-    job_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
+    unsigned i = pid_hash(pid, list->pids_size);
+    while (list->pids[i].pid != PID_EMPTY) {
+        if (list->pids[i].pid == pid) {
+            return &list->pids[i];
+        }
+        i = (i + 1) & (list->pids_size - 1);
     }
-    if ((current->next = malloc(sizeof(job_t))) == NULL) {
+    return NULL;
+}
+
+/*
+ * Rebuild the pid table with 'size' entries, dropping deleted entries and entries for removed jobs
+ * Returns 0 on success or -1 on error
+ */
+static int pid_table_resize(job_list_t *list, unsigned size) {
+    pid_entry_t *old_pids = list->pids;
+    unsigned old_size = list->pids_size;
+    if ((list->pids = calloc(size, sizeof(pid_entry_t))) == NULL) {
+        list->pids = old_pids;
         return -1;
     }
-    strncpy(current->next->name, name, NAME_LEN);
-    current->next->name[NAME_LEN - 1] = '\0';
-    current->next->status = status;
-    current->next->next = NULL;
-    current->next->pid = pid;
-    list->length++;
+    list->pids_size = size;
+    list->pids_used = 0;
+
+    for (unsigned i = 0; i < old_size; i++) {
+        if (old_pids[i].pid > 0 && pid_entry_valid(list, &old_pids[i])) {
+            unsigned j = pid_hash(old_pids[i].pid, size);
+            while (list->pids[j].pid != PID_EMPTY) {
+                j = (j + 1) & (size - 1);
+            }
+            list->pids[j] = old_pids[i];
+            list->pids_used++;
+        }
+    }
+    free(old_pids);
+    return 0;
+}
+
+/*
+ * Map pid to the job in 'slot', replacing any existing entry for the same pid
+ * Returns 0 on success or -1 on error
+ */
+static int pid_insert(job_list_t *list, pid_t pid, unsigned slot) {
+    pid_entry_t *entry = pid_lookup(list, pid);
+    if (entry == NULL) {
+        // Keep the table at most half full (counting deleted entries) so probe sequences stay
+        // short. Rebuilding drops deleted and stale entries; grow if it would still be over a
+        // quarter full
+        if (2 * (list->pids_used + 1) > list->pids_size) {
+            unsigned size = list->pids_size == 0 ? INITIAL_PIDS : list->pids_size;
+            if (pid_table_resize(list, size) == -1 ||
+                (4 * (list->pids_used + 1) > size && pid_table_resize(list, 2 * size) == -1)) {
+                return -1;
+            }
+        }
+
+        unsigned i = pid_hash(pid, list->pids_size);
+        while (list->pids[i].pid > 0) {
+            i = (i + 1) & (list->pids_size - 1);
+        }
+        entry = &list->pids[i];
+        if (entry->pid == PID_EMPTY) {
+            list->pids_used++;
+        }
+        entry->pid = pid;
+    }
+    entry->slot = slot;
+    entry->generation = list->slots[slot].generation;
     return 0;
 }
 
+int job_list_add(job_list_t *list, pid_t pid, const char *name, job_status_t status) {
+    unsigned slot;
+    if (list->free_head != NO_SLOT) {
+        slot = list->free_head;
+        list->free_head = list->slots[slot].next_free;
+    } else {
+        if (list->num_slots == list->capacity) {
+            // Expand underlying array
+            unsigned new_capacity = list->capacity == 0 ? INITIAL_SLOTS : 2 * list->capacity;
+            job_t *new_slots = realloc(list->slots, new_capacity * sizeof(job_t));
+            if (new_slots == NULL) {
+                return -1;
+            }
+            list->slots = new_slots;
+            list->capacity = new_capacity;
+        }
+        slot = list->num_slots++;
+        list->slots[slot].generation = 0;
+    }
+
+    job_t *job = &list->slots[slot];
+    strncpy(job->name, name, NAME_LEN);
+    job->name[NAME_LEN - 1] = '\0';
+    job->status = status;
+    job->pid = pid;
+    job->num_procs = 1;
+    job->last_pid = pid;
+    job->exit_status = 0;
+    job->batch = NULL;
+    job->capture = NULL;
+    job->graph = NULL;
+    memset(&job->usage, 0, sizeof(job_usage_t));
+    clock_gettime(CLOCK_MONOTONIC, &job->usage.start);
+    memset(&job->deadline, 0, sizeof(struct timespec));
+    memset(&job->kill_grace, 0, sizeof(struct timespec));
+    job->timed_out = 0;
+    job->server_conn = 0;
+    job->cgroup_fd = -1;
+    job->cpus = NULL;
+    job->id = slot;
+    job->in_use = 1;
+    list->length++;
+
+    if (pid_insert(list, pid, slot) == -1) {
+        job_list_remove(list, slot);
+        return -1;
+    }
+    return slot;
+}
+
 job_t *job_list_get(job_list_t *list, unsigned idx) {
-    if (idx >= list->length) {
+    if (idx >= list->num_slots || !list->slots[idx].in_use) {
         return NULL;
     }
+    return &list->slots[idx];
+}
 
-    job_t *current = list->head;
-    for (int i = 0; i < idx; i++) {
-        if (current == NULL) {
-            return NULL;
+job_t *job_list_next(job_list_t *list, unsigned idx) {
+    for (unsigned i = idx; i < list->num_slots; i++) {
+        if (list->slots[i].in_use) {
+            return &list->slots[i];
         }
-        current = current->next;
     }
-    return current;
+    return NULL;
 }
 
 int job_list_remove(job_list_t *list, unsigned idx) {
-    if (idx >= list->length) {
+    job_t *job = job_list_get(list, idx);
+    if (job == NULL) {
         return -1;
     }
 
-    if (idx == 0) {
-        job_t *temp = list->head;
-        list->head = list->head->next;
-        free(temp);
-        list->length--;
-        return 0;
+    free(job->batch);
+    job->batch = NULL;
+    graph_free(job->graph);
+    job->graph = NULL;
+    capture_retire(job->capture, job->id);
+    job->capture = NULL;
+    if (job->cgroup_fd != -1) {
+        cgroup_remove(job->cgroup_fd, job->cgroup_id);
+        job->cgroup_fd = -1;
     }
-
-    job_t *current = list->head;
-    for (int i = 0; i < idx - 1; i++) {
-        current = current->next;
+    if (job->cpus != NULL && job->status != DONE) {    // a finished job has released its CPUs
+        affinity_release(&job->cpus->set);
     }
-    job_t *temp = current->next;
-    current->next = current->next->next;
-    free(temp);
+    free(job->cpus);
+    job->cpus = NULL;
+    // Any pid entries still pointing here become stale, and are skipped or replaced later
+    job->in_use = 0;
+    job->generation++;
+    job->next_free = list->free_head;
+    list->free_head = idx;
     list->length--;
+
+    if (list->length == 0) {    // start numbering from 0 again once every job is gone
+        list->num_slots = 0;
+        list->free_head = NO_SLOT;
+        if (list->pids_size > 0) {
+            memset(list->pids, 0, list->pids_size * sizeof(pid_entry_t));
+            list->pids_used = 0;
+        }
+    }
     return 0;
 }
 
 void job_list_remove_by_status(job_list_t *list, job_status_t status) {
-    while (list->head != NULL && list->head->status == status) {
-        job_t *temp = list->head;
-        list->head = list->head->next;
-        list->length--;
-        free(temp);
-    }
-
-    if (list->head != NULL) {    // Could have removed all nodes in loop above
-        job_t *current = list->head;
-        while (current->next != NULL) {
-            if (current->next->status == status) {
-                job_t *temp = current->next;
-                current->next = current->next->next;
-                list->length--;
-                free(temp);
-            } else {
-                current = current->next;
-            }
+    for (unsigned i = 0; i < list->num_slots; i++) {
+        if (list->slots[i].in_use && list->slots[i].status == status) {
+            job_list_remove(list, i);
         }
     }
 }
+
+int job_list_add_pid(job_list_t *list, unsigned idx, pid_t pid) {
+    job_t *job = job_list_get(list, idx);
+    if (job == NULL || pid_insert(list, pid, idx) == -1) {
+        return -1;
+    }
+    job->num_procs++;
+    return 0;
+}
+
+job_t *job_list_find_pid(job_list_t *list, pid_t pid) {
+    pid_entry_t *entry = pid_lookup(list, pid);
+    if (entry == NULL || !pid_entry_valid(list, entry)) {
+        return NULL;
+    }
+    return &list->slots[entry->slot];
+}
+
+job_t *job_list_remove_pid(job_list_t *list, pid_t pid) {
+    pid_entry_t *entry = pid_lookup(list, pid);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->pid = PID_DELETED;
+    if (!pid_entry_valid(list, entry)) {
+        return NULL;
+    }
+    job_t *job = &list->slots[entry->slot];
+    if (job->num_procs > 0) {
+        job->num_procs--;
+    }
+    return job;
+}
@@ -5,25 +5,73 @@
 #define JOB_LIST_H
 
 #include <stdlib.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 
 #define NAME_LEN 32
 
+struct batch;
+struct capture;
+struct cpu_mask;
+struct graph;
+
 typedef enum {
     STOPPED,
     BACKGROUND,
+    DONE,          // every process in the job has exited, but the job has not been reported yet
+    FOREGROUND,    // the job currently holds the terminal and the shell is waiting for it
 } job_status_t;
 
+typedef struct {
+    struct timespec start;    // CLOCK_MONOTONIC time at which the job was added
+    struct timespec end;      // time at which its last process exited, or 0 while it has any left
+    struct timeval utime;     // user CPU time of the job's processes that have exited
+    struct timeval stime;     // system CPU time of the job's processes that have exited
+    long maxrss;              // largest peak resident set size of any of them, in KiB
+    long nvcsw;               // voluntary context switches of those processes
+    long nivcsw;              // involuntary context switches of those processes
+} job_usage_t;
+
 typedef struct job {
     char name[NAME_LEN];
     int status;
-    pid_t pid;
-    struct job *next;
+    pid_t pid;              // process group ID (the pid of the job's first process)
+    unsigned num_procs;     // number of processes in the job that have not yet exited
+    pid_t last_pid;         // pid of the job's last pipeline stage, whose status is the job's
+    int exit_status;        // exit status of the last stage (128 + N if killed by signal N)
+    unsigned id;            // stable job ID, which is also the job's slot in the list
+    int in_use;             // 0 if this slot is on the free list
+    unsigned generation;    // bumped whenever the slot is freed, to invalidate stale pid entries
+    unsigned next_free;     // next slot on the free list, when this slot is not in use
+    struct batch *batch;    // items of a parallel batch still to run, or NULL (see run_parallel())
+    struct capture *capture;    // output of a background job, if captured (see capture.h)
+    struct graph *graph;    // nodes of a run-graph job, kept until the job is removed (see graph.h)
+    job_usage_t usage;      // resources used so far, updated as each process is reaped
+    struct timespec deadline;      // CLOCK_MONOTONIC time of the job's next timeout signal, or 0
+    struct timespec kill_grace;    // time between SIGTERM and SIGKILL once the job times out
+    int timed_out;                 // last signal sent because the job timed out, or 0 if none
+    unsigned server_conn;    // job server connection that submitted the job, or 0 (see server.h)
+    int cgroup_fd;           // the job's cgroup, or -1 if it has none (see cgroup.h)
+    unsigned cgroup_id;
+    struct cpu_mask *cpus;   // CPUs the job's processes are pinned to, or NULL (see affinity.h)
 } job_t;
 
 typedef struct {
-    job_t *head;
-    unsigned length;
+    pid_t pid;    // 0 for an empty entry, -1 for a deleted one
+    unsigned slot;
+    unsigned generation;
+} pid_entry_t;
+
+typedef struct {
+    job_t *slots;          // slots[id] holds the job with ID id
+    unsigned capacity;     // number of slots allocated
+    unsigned num_slots;    // every job ID in use is less than this
+    unsigned free_head;    // first slot on the free list
+    unsigned length;       // number of jobs in the list
+    pid_entry_t *pids;     // open-addressing hash table from each job process to its slot
+    unsigned pids_size;    // a power of 2, or 0 before the first job is added
+    unsigned pids_used;    // entries that are not empty, including deleted ones
 } job_list_t;
 
 /*
@@ -41,37 +89,76 @@ void job_list_free(job_list_t *list);
 
 /*
  * Add a new job to a jobs list
+ * The job gets the most recently freed ID, or the next unused one. IDs restart from 0 whenever the
+ * list becomes empty. Its start time is recorded, and its resource usage starts out at zero
  * list: The jobs list to add to
  * pid: The process ID of the job's underlying process (spawned from the shell)
+ *      For a pipeline this is the pid of its first stage, which is also the job's process group ID
+ *      The job starts with this one process; use job_list_add_pid() for the rest
  * name: The name of the job's program (e.g., "ls", "cat", or "wc")
  * status: The job's current status
- * Returns 0 on success or -1 on error
+ * Returns the new job's ID on success or -1 on error
+ * Note: This may move the list's storage, so don't hold pointers from job_list_get() across it
  */
 int job_list_add(job_list_t *list, pid_t pid, const char *name, job_status_t status);
 
 /*
  * Retrieve an element from a jobs list
  * list: Pointer to the jobs list to retrieve from
- * idx: Index of the entry to retrieve
+ * idx: ID of the job to retrieve
  * Returns a pointer to a job_t (not a copy) on success or NULL on error
  */
 job_t *job_list_get(job_list_t *list, unsigned idx);
 
 /*
- * Removes an element at a specific index from a jobs list
- * The memory for this element is freed
+ * Iterate over a jobs list in order of job ID
+ * list: Pointer to the jobs list to iterate over
+ * idx: Smallest job ID to consider, i.e., 0 to start or the previous job's ID plus 1
+ * Returns a pointer to the job with the lowest ID that is at least idx, or NULL if there is none
+ */
+job_t *job_list_next(job_list_t *list, unsigned idx);
+
+/*
+ * Removes a job from a jobs list, making its ID available for reuse
+ * The job's batch, if it still has one, and its graph are freed with it, as is its cgroup once it
+ * is empty, while its captured output is kept for a while longer (see capture_retire()). If it is
+ * pinned and still running, its CPUs stop counting towards their load (see affinity.h)
  * list: Pointer to the jobs list to remove from
- * idx: Index of the element to remove
+ * idx: ID of the job to remove
  * Returns 0 on success or -1 on error
  */
 int job_list_remove(job_list_t *list, unsigned idx);
 
 /*
- * Remove all jobs of a specific status (STOPPED or BACKGROUND) from a jobs list
- * The memory for all entries removed from the list is freed
+ * Remove all jobs of a specific status (STOPPED, BACKGROUND, or DONE) from a jobs list
  * list: The jobs list to remove from
- * status: The status of all jobs that should be removed (BACKGROUND or STOPPED)
+ * status: The status of all jobs that should be removed (BACKGROUND, STOPPED, or DONE)
  */
 void job_list_remove_by_status(job_list_t *list, job_status_t status);
 
+/*
+ * Record another process (e.g., a later pipeline stage) as belonging to a job
+ * list: The jobs list containing the job
+ * idx: ID of the job
+ * pid: Process ID to add, which increases the job's num_procs by one
+ * Returns 0 on success or -1 on error
+ */
+int job_list_add_pid(job_list_t *list, unsigned idx, pid_t pid);
+
+/*
+ * Look up the job that a process belongs to in constant time
+ * list: The jobs list to search
+ * pid: Process ID of any process in the job
+ * Returns a pointer to the job (not a copy), or NULL if no job in the list has this process
+ */
+job_t *job_list_find_pid(job_list_t *list, pid_t pid);
+
+/*
+ * Forget a process that has exited and been reaped, decreasing its job's num_procs by one
+ * list: The jobs list containing the process's job
+ * pid: Process ID to remove
+ * Returns a pointer to the job the process belonged to, or NULL if it wasn't part of any job
+ */
+job_t *job_list_remove_pid(job_list_t *list, pid_t pid);
+
 #endif    // JOB_LIST_H
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "line_reader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN_CAPACITY 16
+
+int line_reader_init(line_reader_t *reader, int fd, size_t capacity) {
+    if (capacity < MIN_CAPACITY) {
+        capacity = MIN_CAPACITY;
+    }
+    reader->fd = fd;
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->end = 0;
+    reader->scan = 0;
+    reader->eof = 0;
+    reader->buf = malloc(capacity);
+    if (reader->buf == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int line_reader_init_string(line_reader_t *reader, const char *s) {
+    size_t len = strlen(s);
+    // One extra byte so a last line without '\n' can be terminated in place
+    if (line_reader_init(reader, -1, len + 1) == -1) {
+        return -1;
+    }
+    memcpy(reader->buf, s, len);
+    reader->end = len;
+    reader->eof = 1;    // there is nothing more to read
+    return 0;
+}
+
+void line_reader_free(line_reader_t *reader) {
+    free(reader->buf);
+    reader->buf = NULL;
+    reader->capacity = 0;
+}
+
+int line_reader_has_line(line_reader_t *reader) {
+    if (reader->eof) {
+        return 1;
+    }
+    if (memchr(reader->buf + reader->scan, '\n', reader->end - reader->scan) != NULL) {
+        return 1;
+    }
+    reader->scan = reader->end;    // no need to look at these bytes again
+    return 0;
+}
+
+/*
+ * Read more input into the buffer, first moving any partial line to the front and growing the
+ * buffer if that line already fills it. One byte is always left free for a terminating '\0'
+ * Returns the number of bytes read (0 at end of file), or -1 on error
+ */
+static ssize_t fill(line_reader_t *reader) {
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->scan -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end + 1 >= reader->capacity) {
+        char *new_buf = realloc(reader->buf, 2 * reader->capacity);
+        if (new_buf == NULL) {
+            return -1;
+        }
+        reader->buf = new_buf;
+        reader->capacity *= 2;
+    }
+
+    ssize_t n;
+    do {
+        n = read(reader->fd, reader->buf + reader->end, reader->capacity - reader->end - 1);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        perror("read");
+        return -1;
+    }
+    if (n == 0) {
+        reader->eof = 1;
+    }
+    reader->end += n;
+    return n;
+}
+
+int line_reader_next(line_reader_t *reader, char **line) {
+    while (1) {
+        char *newline = memchr(reader->buf + reader->scan, '\n', reader->end - reader->scan);
+        if (newline != NULL) {
+            *newline = '\0';
+            *line = reader->buf + reader->start;
+            reader->start = reader->scan = newline - reader->buf + 1;
+            return 1;
+        }
+        reader->scan = reader->end;
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return 0;
+            }
+            // Last line of input has no '\n'. fill() always leaves room to terminate it
+            reader->buf[reader->end] = '\0';
+            *line = reader->buf + reader->start;
+            reader->start = reader->end;
+            return 1;
+        }
+        if (fill(reader) == -1) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stddef.h>
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t capacity;
+    size_t start;    // offset of the first byte not yet returned as part of a line
+    size_t end;      // offset just past the last byte read from fd
+    size_t scan;     // offset from which to keep searching for '\n' (everything before has none)
+    int eof;         // nonzero once read() has reported end of file
+} line_reader_t;
+
+/*
+ * Initialize a reader of newline-terminated lines of any length from a file descriptor
+ * The reader keeps one buffer across lines, growing it geometrically whenever a line doesn't fit
+ * reader: Pointer to the reader to initialize
+ * fd: Descriptor to read from
+ * capacity: Initial size of the buffer, which is also the most read() asks for at once. A large
+ *           buffer lets non-interactive input be read in a few big blocks
+ * Returns 0 on success or -1 on error
+ */
+int line_reader_init(line_reader_t *reader, int fd, size_t capacity);
+
+/*
+ * Initialize a reader that returns the lines of a string instead of reading from a descriptor
+ * reader: Pointer to the reader to initialize
+ * s: The string to split into lines, which is copied into the reader's buffer
+ * Returns 0 on success or -1 on error
+ */
+int line_reader_init_string(line_reader_t *reader, const char *s);
+
+/*
+ * Free the reader's buffer
+ * reader: Pointer to the reader to free
+ */
+void line_reader_free(line_reader_t *reader);
+
+/*
+ * Return the next line, reading from the descriptor (and blocking) only if no complete line is
+ * buffered yet. A final line without a trailing '\n' is returned as well
+ * reader: Pointer to the reader
+ * line: Set to the line, with its '\n' replaced by '\0'. The line lives inside the reader's buffer,
+ *       so it is not copied, but it is only valid until the next call
+ * Returns 1 if a line was returned, 0 at end of file, or -1 on error
+ */
+int line_reader_next(line_reader_t *reader, char **line);
+
+/*
+ * Check whether line_reader_next() can return without reading from the descriptor
+ * reader: Pointer to the reader
+ * Returns 1 if a complete line (or the end of the input) is already buffered, 0 otherwise
+ */
+int line_reader_has_line(line_reader_t *reader);
+
+#endif    // LINE_READER_H
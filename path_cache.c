@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "path_cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INITIAL_ENTRIES 32
+#define DEFAULT_PATH "/bin:/usr/bin"    // what execvp() searches when PATH is unset
+
+typedef struct {
+    char *name;        // NULL for an empty or deleted entry. Shares one allocation with path
+    char *path;
+    uint32_t hash;
+    unsigned hits;
+    int deleted;
+} path_entry_t;
+
+static path_entry_t *entries = NULL;
+static unsigned entries_size = 0;    // a power of 2, or 0 before the first command is cached
+static unsigned entries_used = 0;    // entries that are not empty, including deleted ones
+static char *cached_path_env = NULL;    // value of PATH that the cached entries were found with
+static char uncached_path[PATH_MAX];    // result of a search that could not be cached
+
+/*
+ * FNV-1a hash of a command name
+ */
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Find the entry for name, or NULL if it is not cached
+ */
+static path_entry_t *lookup(const char *name, uint32_t hash) {
+    if (entries_size == 0) {
+        return NULL;
+    }
+
+    unsigned i = hash & (entries_size - 1);
+    while (entries[i].name != NULL || entries[i].deleted) {
+        if (entries[i].name != NULL && entries[i].hash == hash &&
+            strcmp(entries[i].name, name) == 0) {
+            return &entries[i];
+        }
+        i = (i + 1) & (entries_size - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Rebuild the table with 'size' entries, dropping deleted ones
+ * Returns 0 on success or -1 on error
+ */
+static int resize(unsigned size) {
+    path_entry_t *new_entries = calloc(size, sizeof(path_entry_t));
+    if (new_entries == NULL) {
+        return -1;
+    }
+
+    entries_used = 0;
+    for (unsigned i = 0; i < entries_size; i++) {
+        if (entries[i].name != NULL) {
+            unsigned j = entries[i].hash & (size - 1);
+            while (new_entries[j].name != NULL) {
+                j = (j + 1) & (size - 1);
+            }
+            new_entries[j] = entries[i];
+            entries_used++;
+        }
+    }
+    free(entries);
+    entries = new_entries;
+    entries_size = size;
+    return 0;
+}
+
+/*
+ * Add an entry mapping name to path, which must not already be cached
+ * Returns the entry on success or NULL on error
+ */
+static path_entry_t *insert(const char *name, uint32_t hash, const char *path) {
+    // Keep the table at most half full (counting deleted entries) so probe sequences stay short
+    if (2 * (entries_used + 1) > entries_size) {
+        unsigned size = entries_size == 0 ? INITIAL_ENTRIES : entries_size;
+        if (4 * (entries_used + 1) > size) {
+            size *= 2;
+        }
+        if (resize(size) == -1) {
+            return NULL;
+        }
+    }
+
+    size_t name_len = strlen(name);
+    char *block = malloc(name_len + strlen(path) + 2);
+    if (block == NULL) {
+        return NULL;
+    }
+    unsigned i = hash & (entries_size - 1);
+    while (entries[i].name != NULL) {
+        i = (i + 1) & (entries_size - 1);
+    }
+    path_entry_t *entry = &entries[i];
+    if (!entry->deleted) {
+        entries_used++;
+    }
+    entry->name = block;
+    entry->path = block + name_len + 1;
+    memcpy(block, name, name_len + 1);
+    strcpy(entry->path, path);
+    entry->hash = hash;
+    entry->hits = 0;
+    entry->deleted = 0;
+    return entry;
+}
+
+/*
+ * Empty the cache if PATH has changed since its entries were found
+ */
+static void check_path_env(const char *path_env) {
+    if (cached_path_env != NULL && strcmp(cached_path_env, path_env) == 0) {
+        return;
+    }
+    path_cache_clear();
+    free(cached_path_env);
+    cached_path_env = strdup(path_env);    // if this fails, we just clear again next time
+}
+
+/*
+ * Search the directories in path_env for an executable regular file called name, like execvp()
+ * buf: Filled with the file's path
+ * Returns 0 if it was found, or -1 with errno set to ENOENT or EACCES
+ */
+static int search_path(const char *path_env, const char *name, char *buf) {
+    size_t name_len = strlen(name);
+    int err = ENOENT;
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        const char *dir_name = dir_len == 0 ? "." : dir;    // empty means the current directory
+        if (dir_len == 0) {
+            dir_len = 1;
+        }
+
+        if (dir_len + name_len + 2 <= PATH_MAX) {
+            memcpy(buf, dir_name, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode)) {
+                if (access(buf, X_OK) == 0) {
+                    return 0;
+                }
+                err = EACCES;    // keep looking, but report this if nothing else turns up
+            }
+        }
+
+        if (*end == '\0') {
+            break;
+        }
+        dir = end + 1;
+    }
+    errno = err;
+    return -1;
+}
+
+const char *path_cache_find(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = DEFAULT_PATH;
+    }
+    check_path_env(path_env);
+
+    uint32_t hash = name_hash(name);
+    path_entry_t *entry = lookup(name, hash);
+    if (entry == NULL) {
+        if (search_path(path_env, name, uncached_path) == -1) {
+            return NULL;
+        }
+        // A path found through a relative PATH entry depends on the working directory
+        if (uncached_path[0] != '/' || (entry = insert(name, hash, uncached_path)) == NULL) {
+            return uncached_path;
+        }
+    }
+    entry->hits++;
+    return entry->path;
+}
+
+int path_cache_forget(const char *name) {
+    path_entry_t *entry = lookup(name, name_hash(name));
+    if (entry == NULL) {
+        return -1;
+    }
+    free(entry->name);
+    entry->name = NULL;
+    entry->path = NULL;
+    entry->deleted = 1;
+    return 0;
+}
+
+void path_cache_clear(void) {
+    for (unsigned i = 0; i < entries_size; i++) {
+        free(entries[i].name);
+    }
+    if (entries_size > 0) {
+        memset(entries, 0, entries_size * sizeof(path_entry_t));
+    }
+    entries_used = 0;
+}
+
+int path_cache_next(unsigned *pos, const char **name, const char **path, unsigned *hits) {
+    for (; *pos < entries_size; (*pos)++) {
+        if (entries[*pos].name != NULL) {
+            *name = entries[*pos].name;
+            *path = entries[*pos].path;
+            *hits = entries[*pos].hits;
+            (*pos)++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void path_cache_free(void) {
+    path_cache_clear();
+    free(entries);
+    entries = NULL;
+    entries_size = 0;
+    free(cached_path_env);
+    cached_path_env = NULL;
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+/*
+ * Cache of where commands were found on PATH, so that a command is only searched for once rather
+ * than on every launch. The shell has a single cache, which is emptied whenever PATH changes
+ */
+
+/*
+ * Find the file that running a command executes
+ * A name that contains a '/' is used as is. Otherwise the cached path is returned, or PATH is
+ * searched the way execvp() would and the result cached (unless found through a relative PATH
+ * entry such as ".", which would change meaning with the working directory)
+ * name: The command name, e.g., "ls"
+ * Returns the path to execute, which is valid until the next call to a path_cache function, or
+ * NULL with errno set (ENOENT if it was not found, EACCES if it was found but is not executable)
+ */
+const char *path_cache_find(const char *name);
+
+/*
+ * Remove a command from the cache, e.g., because executing its cached path failed with ENOENT
+ * name: The command name
+ * Returns 0 if the command was cached, -1 if it was not
+ */
+int path_cache_forget(const char *name);
+
+/*
+ * Remove every command from the cache
+ */
+void path_cache_clear(void);
+
+/*
+ * Iterate over the cached commands, in no particular order
+ * pos: Position to continue from, which should be 0 to start. Updated for the next call
+ * name, path: Set to the command name and the path it was found at
+ * hits: Set to the number of times the command has been looked up since it was cached
+ * Returns 1 if a command was returned, or 0 once there are none left
+ */
+int path_cache_next(unsigned *pos, const char **name, const char **path, unsigned *hits);
+
+/*
+ * Free all memory used by the cache
+ */
+void path_cache_free(void);
+
+#endif    // PATH_CACHE_H
@@ -0,0 +1,457 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "plan.h"
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "string_vector.h"
+#include "swish_funcs.h"
+#include "wildcard.h"
+
+static plan_t *buckets[PLAN_BUCKETS];
+static plan_t *newest = NULL;    // most recently used cached plan
+static plan_t *oldest = NULL;    // least recently used cached plan, the next to be dropped
+static unsigned num_cached = 0;
+static int interrupted = 0;      // a foreground job of the line being run was interrupted with ^C
+
+/*
+ * FNV-1a hash of a command line
+ */
+static uint32_t line_hash(const char *line) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) line; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Returns the length of the reference to var at s ("$var" or "${var}"), or 0 if there is none
+ */
+static size_t var_ref_len(const char *s, const char *var) {
+    size_t var_len = strlen(var);
+    if (s[0] != '$') {
+        return 0;
+    }
+    if (s[1] == '{') {
+        return strncmp(s + 2, var, var_len) == 0 && s[2 + var_len] == '}' ? var_len + 3 : 0;
+    }
+    if (strncmp(s + 1, var, var_len) != 0) {
+        return 0;
+    }
+    char after = s[1 + var_len];
+    return isalnum((unsigned char) after) || after == '_' ? 0 : var_len + 1;
+}
+
+/*
+ * Returns the first '$' in s that tokenize() hasn't escaped (because it was quoted), or NULL if
+ * there is none
+ */
+static const char *next_dollar(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+        } else if (*s == '$') {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns 1 if tok refers to var anywhere, 0 otherwise
+ */
+static int refers_to(const char *tok, const char *var) {
+    for (const char *mark = next_dollar(tok); mark != NULL; mark = next_dollar(mark + 1)) {
+        if (var_ref_len(mark, var) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if tokens[i] is the keyword word ("do" or "done"), which it only is right after a ';',
+ * 0 otherwise
+ */
+static int is_keyword(char **tokens, unsigned i, const char *word) {
+    return i > 0 && token_kind(tokens[i - 1]) == TOKEN_SEPARATOR && strcmp(tokens[i], word) == 0;
+}
+
+/*
+ * Returns the index of the ';' that ends the command starting at tokens[start], or len if it
+ * runs to the end. Loop bodies are skipped over, see plan.h
+ */
+static unsigned command_end(char **tokens, unsigned len, unsigned start) {
+    unsigned depth = 0;    // "do"s not yet matched by a "done"
+    for (unsigned i = start; i < len; i++) {
+        if (token_kind(tokens[i]) == TOKEN_SEPARATOR) {
+            if (depth == 0 && (i + 1 == len || strcmp(tokens[i + 1], "do") != 0)) {
+                return i;
+            }
+        } else if (is_keyword(tokens, i, "do")) {
+            depth++;
+        } else if (depth > 0 && is_keyword(tokens, i, "done")) {
+            depth--;
+        }
+    }
+    return len;
+}
+
+/*
+ * Returns 1 if builtin is a loop, which runs its body through a plan of its own, 0 otherwise
+ */
+static int is_loop(const builtin_t *builtin) {
+    return builtin != NULL && (builtin->fn == builtin_repeat || builtin->fn == builtin_for);
+}
+
+/*
+ * Work out everything about a plan's tokens that doesn't depend on the loop variable's value
+ * Returns 0 on success or -1 on error
+ */
+static int plan_finish(plan_t *plan) {
+    char **tokens = plan->tokens.data;
+    unsigned len = plan->tokens.length;
+    unsigned max_commands = 1;
+    unsigned num_pipes = 0;
+    for (unsigned i = 0; i < len; i++) {
+        token_kind_t kind = token_kind(tokens[i]);
+        max_commands += kind == TOKEN_SEPARATOR;
+        num_pipes += kind == TOKEN_PIPE || kind == TOKEN_PIPE_ALL;
+    }
+    plan->commands = malloc(max_commands * sizeof(plan_command_t));
+    plan->stages = malloc((max_commands + num_pipes) * sizeof(stage_t));
+    if (plan->commands == NULL || plan->stages == NULL) {
+        return -1;
+    }
+    if (plan->var != NULL) {
+        if ((plan->holes = malloc((len + 1) * sizeof(unsigned))) == NULL) {
+            return -1;
+        }
+        for (unsigned i = 0; i < len; i++) {
+            if (token_kind(tokens[i]) == TOKEN_WORD && refers_to(tokens[i], plan->var)) {
+                plan->holes[plan->num_holes++] = i;
+            }
+        }
+    }
+
+    unsigned num_stages = 0;
+    unsigned next_hole = 0;
+    for (unsigned start = 0, end; start < len; start = end + 1) {
+        end = command_end(tokens, len, start);
+        if (end == start) {
+            continue;
+        }
+        plan_command_t *cmd = &plan->commands[plan->num_commands++];
+        memset(cmd, 0, sizeof(plan_command_t));
+        cmd->start = start;
+        cmd->end = end;
+        cmd->is_background = token_kind(tokens[end - 1]) == TOKEN_BACKGROUND;
+        cmd->dynamic_command = plan->var != NULL && refers_to(tokens[start], plan->var);
+        if (!cmd->dynamic_command) {
+            cmd->builtin = builtin_lookup(tokens[start]);
+        }
+        // A loop is left unexpanded, so that its body is expanded on each iteration, after the
+        // loop variable is substituted, and quoted characters in it stay escaped until then. A
+        // value substituted for the variable may itself be a pattern
+        while (next_hole < plan->num_holes && plan->holes[next_hole] < end) {
+            cmd->needs_expansion = 1;
+            next_hole++;
+        }
+        for (unsigned i = start; i < end && !cmd->needs_expansion; i++) {
+            if (token_kind(tokens[i]) == TOKEN_WORD && strpbrk(tokens[i], "*?[\\") != NULL) {
+                cmd->needs_expansion = 1;
+            }
+        }
+        if (is_loop(cmd->builtin)) {
+            cmd->needs_expansion = 0;
+        }
+        if (cmd->builtin != NULL || cmd->needs_expansion) {
+            continue;    // the stages are only needed to launch exactly these tokens
+        }
+        unsigned pipeline_len = end - start - cmd->is_background;
+        cmd->first_stage = num_stages;
+        cmd->num_stages = find_stages(tokens + start, pipeline_len, plan->stages + num_stages);
+        num_stages += cmd->num_stages;
+    }
+    return 0;
+}
+
+plan_t *plan_compile(char *const *tokens, unsigned num_tokens, const char *var) {
+    plan_t *plan = calloc(1, sizeof(plan_t));
+    if (plan == NULL) {
+        return NULL;
+    }
+    if (strvec_init_arena(&plan->tokens) == -1) {
+        free(plan);
+        return NULL;
+    }
+    plan->var = var;
+    for (unsigned i = 0; i < num_tokens; i++) {
+        if (strvec_add_ref(&plan->tokens, tokens[i]) == -1) {
+            plan_free(plan);
+            return NULL;
+        }
+    }
+    if (plan_finish(plan) == -1) {
+        plan_free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+void plan_free(plan_t *plan) {
+    if (plan == NULL) {
+        return;
+    }
+    strvec_clear(&plan->tokens);
+    free(plan->commands);
+    free(plan->stages);
+    free(plan->holes);
+    free(plan->subst_buf);
+    free(plan->line);
+    free(plan);
+}
+
+/*
+ * Remove a cached plan from the order of use
+ */
+static void unlink_plan(plan_t *plan) {
+    if (plan->newer != NULL) {
+        plan->newer->older = plan->older;
+    } else {
+        newest = plan->older;
+    }
+    if (plan->older != NULL) {
+        plan->older->newer = plan->newer;
+    } else {
+        oldest = plan->newer;
+    }
+}
+
+/*
+ * Make a cached plan the most recently used
+ */
+static void push_newest(plan_t *plan) {
+    plan->newer = NULL;
+    plan->older = newest;
+    if (newest != NULL) {
+        newest->newer = plan;
+    } else {
+        oldest = plan;
+    }
+    newest = plan;
+}
+
+/*
+ * Drop the least recently used plan from the cache
+ */
+static void evict_oldest(void) {
+    plan_t *victim = oldest;
+    unlink_plan(victim);
+    plan_t **link = &buckets[victim->hash & (PLAN_BUCKETS - 1)];
+    while (*link != victim) {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = victim->next_in_bucket;
+    num_cached--;
+    plan_free(victim);
+}
+
+int plan_get(const char *line, plan_t **plan) {
+    uint32_t hash = line_hash(line);
+    plan_t **bucket = &buckets[hash & (PLAN_BUCKETS - 1)];
+    for (plan_t *cached = *bucket; cached != NULL; cached = cached->next_in_bucket) {
+        if (cached->hash == hash && strcmp(cached->line, line) == 0) {
+            if (cached != newest) {
+                unlink_plan(cached);
+                push_newest(cached);
+            }
+            *plan = cached;
+            return 0;
+        }
+    }
+
+    plan_t *compiled = calloc(1, sizeof(plan_t));
+    if (compiled == NULL) {
+        fprintf(stderr, "Failed to allocate command plan\n");
+        return -1;
+    }
+    // The line is kept twice: once as the key, and once for tokenize() to split in place
+    size_t len = strlen(line);
+    if (strvec_init_arena(&compiled->tokens) == -1 ||
+        (compiled->line = malloc(2 * (len + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate command plan\n");
+        plan_free(compiled);
+        return -1;
+    }
+    memcpy(compiled->line, line, len + 1);
+    char *text = memcpy(compiled->line + len + 1, line, len + 1);
+    int result = tokenize(text, &compiled->tokens);
+    if (result != 0) {
+        plan_free(compiled);
+        return result;
+    }
+    if (plan_finish(compiled) == -1) {
+        fprintf(stderr, "Failed to allocate command plan\n");
+        plan_free(compiled);
+        return -1;
+    }
+
+    compiled->hash = hash;
+    compiled->next_in_bucket = *bucket;
+    *bucket = compiled;
+    push_newest(compiled);
+    if (++num_cached > PLAN_CACHE_SIZE) {
+        evict_oldest();
+    }
+    *plan = compiled;
+    return 0;
+}
+
+/*
+ * Copy tok into the plan's substitution buffer, with every reference to its variable replaced by
+ * value
+ * Returns the copy, which is overwritten by the next substitution, or NULL on error
+ */
+static char *substitute_var(plan_t *plan, const char *tok, const char *value) {
+    size_t value_len = strlen(value);
+    size_t len = strlen(tok);
+    for (const char *mark = next_dollar(tok); mark != NULL; mark = next_dollar(mark + 1)) {
+        len += var_ref_len(mark, plan->var) > 0 ? value_len : 0;
+    }
+    if (len + 1 > plan->subst_size) {
+        char *buf = realloc(plan->subst_buf, len + 1);
+        if (buf == NULL) {
+            return NULL;
+        }
+        plan->subst_buf = buf;
+        plan->subst_size = len + 1;
+    }
+
+    char *out = plan->subst_buf;
+    for (const char *mark = next_dollar(tok); mark != NULL; mark = next_dollar(tok)) {
+        size_t ref_len = var_ref_len(mark, plan->var);
+        out = mempcpy(out, tok, mark - tok);
+        if (ref_len > 0) {
+            out = mempcpy(out, value, value_len);
+            tok = mark + ref_len;
+        } else {
+            *out++ = '$';
+            tok = mark + 1;
+        }
+    }
+    out = stpcpy(out, tok);
+    return plan->subst_buf;
+}
+
+/*
+ * Fill a vector with the tokens to run one of a plan's commands with
+ * next_hole: Index of the first hole at or after the command's start, which is advanced past it
+ * Returns 0 on success or -1 on error
+ */
+static int bind_command(plan_t *plan, const plan_command_t *cmd, const char *value,
+                        unsigned *next_hole, strvec_t *tokens) {
+    while (*next_hole < plan->num_holes && plan->holes[*next_hole] < cmd->start) {
+        (*next_hole)++;
+    }
+    for (unsigned i = cmd->start; i < cmd->end; i++) {
+        char *tok = plan->tokens.data[i];
+        int result;
+        if (*next_hole < plan->num_holes && plan->holes[*next_hole] == i) {
+            (*next_hole)++;
+            char *s = substitute_var(plan, tok, value);
+            result = s == NULL ? -1 : strvec_add(tokens, s);
+        } else if (cmd->needs_expansion && token_kind(tok) == TOKEN_WORD) {
+            result = strvec_add(tokens, tok);    // wildcard_expand() removes escapes in place
+        } else {
+            result = strvec_add_ref(tokens, tok);
+        }
+        if (result == -1) {
+            return -1;
+        }
+    }
+    return cmd->needs_expansion ? wildcard_expand(tokens) : 0;
+}
+
+/*
+ * Run one of a plan's commands, with the tokens filled in by bind_command()
+ * Returns BUILTIN_OK, BUILTIN_EXIT, or BUILTIN_FATAL
+ */
+static int run_plan_command(const plan_t *plan, const plan_command_t *cmd, strvec_t *tokens,
+                            job_list_t *jobs) {
+    if (tokens->length == 0) {
+        return BUILTIN_OK;
+    }
+    const builtin_t *builtin = cmd->builtin;
+    if (cmd->needs_expansion || cmd->dynamic_command) {
+        builtin = builtin_lookup(tokens->data[0]);
+    }
+    if (builtin != NULL) {
+        return builtin->fn(tokens, jobs);
+    }
+
+    if (cmd->is_background) {
+        strvec_take(tokens, tokens->length - 1);
+    }
+    int result;
+    if (cmd->num_stages > 0 && !cmd->needs_expansion) {
+        result = run_stages(tokens, plan->stages + cmd->first_stage, jobs, cmd->is_background);
+    } else {
+        result = run_pipeline(tokens, jobs, cmd->is_background);    // validates the pipeline
+    }
+    // Only a foreground job leaves a status that says it was interrupted
+    if (!cmd->is_background && get_last_status() == 128 + SIGINT) {
+        interrupted = 1;
+    }
+    return result == -1 ? BUILTIN_FATAL : BUILTIN_OK;
+}
+
+int plan_run(plan_t *plan, const char *value, strvec_t *tokens, job_list_t *jobs) {
+    if (plan->line != NULL) {
+        interrupted = 0;    // a new line read by the shell, rather than a loop body
+    }
+    unsigned next_hole = 0;
+    for (unsigned i = 0; i < plan->num_commands && !interrupted; i++) {
+        const plan_command_t *cmd = &plan->commands[i];
+        strvec_reset(tokens);
+        if (bind_command(plan, cmd, value, &next_hole, tokens) == -1) {
+            printf("Failed to add token to command vector\n");
+            return BUILTIN_FATAL;
+        }
+        int result = run_plan_command(plan, cmd, tokens, jobs);
+        if (result != BUILTIN_OK) {
+            return result;
+        }
+    }
+    return BUILTIN_OK;
+}
+
+int plan_loop(plan_t *plan, char *const *values, unsigned long count, job_list_t *jobs) {
+    strvec_t tokens;
+    if (strvec_init_arena(&tokens) == -1) {
+        printf("Failed to initialize loop body vector\n");
+        return BUILTIN_FATAL;
+    }
+    int result = BUILTIN_OK;
+    for (unsigned long i = 0; i < count && result == BUILTIN_OK && !interrupted; i++) {
+        result = plan_run(plan, values != NULL ? values[i] : NULL, &tokens, jobs);
+    }
+    strvec_clear(&tokens);
+    return result;
+}
+
+void plan_cache_free(void) {
+    while (oldest != NULL) {
+        evict_oldest();
+    }
+}
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+
+#include "builtins.h"
+#include "job_list.h"
+#include "string_vector.h"
+#include "swish_funcs.h"
+
+#define PLAN_CACHE_SIZE 64    // most command lines whose plans are kept
+#define PLAN_BUCKETS 128      // hash table buckets for the cached plans, a power of 2
+
+/*
+ * Command plans: everything about a command line that doesn't change from one run to the next,
+ * worked out once. A plan holds the line's tokens, split into the commands of a list separated by
+ * ';', and for each command whether it runs in the background, which builtin it names, and where
+ * each pipeline stage and its redirections lie, so running it again costs no tokenizing, builtin
+ * lookup, or scanning for operators
+ *
+ * Plans of lines read by the shell are cached by the text of the line, and the least recently used
+ * plan is dropped once there are more than PLAN_CACHE_SIZE. Loops (repeat and for) compile their
+ * body into a plan of their own, and only substitute the loop variable on each iteration. A loop's
+ * own tokens aren't expanded, so the body's wildcards are expanded on each iteration instead, once
+ * the variable has been substituted
+ *
+ * A ';' is part of the command it is in, rather than ending it, inside the body of a for loop
+ * ("for NAME in WORD... ; do command... ; done"): where the next token is "do", and between a "do"
+ * and its matching "done" (each of which only counts right after a ';')
+ */
+
+typedef struct {
+    unsigned start;              // the command is tokens[start] up to tokens[end] of its plan
+    unsigned end;
+    int is_background;           // the tokens end in "&" (which a builtin handles itself)
+    int needs_expansion;         // some tokens must go through wildcard_expand() on every run
+    const builtin_t *builtin;    // builtin named by the first token, if it can be known in advance
+    int dynamic_command;         // the first token is substituted, so the builtin is looked up late
+    unsigned first_stage;        // stages are stages[first_stage] up to first_stage + num_stages
+    unsigned num_stages;         // 0 for a builtin, or an invalid pipeline
+} plan_command_t;
+
+typedef struct plan {
+    strvec_t tokens;             // the line's tokens, including any "&" and ';'
+    plan_command_t *commands;    // in order, leaving out empty ones
+    unsigned num_commands;
+    stage_t *stages;             // every command's stages from find_stages(), back to back
+    unsigned *holes;             // tokens that refer to the loop variable, in order
+    unsigned num_holes;
+    const char *var;             // name of the loop variable, or NULL
+    char *subst_buf;             // reused for substituting the loop variable
+    size_t subst_size;
+    char *line;                  // line the plan was made from, or NULL if it isn't cached
+    uint32_t hash;
+    struct plan *next_in_bucket;
+    struct plan *newer;          // neighbours in order of use
+    struct plan *older;
+} plan_t;
+
+/*
+ * Get the plan for a command line, from the cache or else by tokenizing the line
+ * line: The line, which is left unchanged
+ * plan: Set to the plan, which stays valid until the next call
+ * Returns 0 on success, 1 if the line has a syntax error (already reported), or -1 on error
+ */
+int plan_get(const char *line, plan_t **plan);
+
+/*
+ * Compile tokens into a plan of their own, which isn't cached, for running repeatedly. Wildcards
+ * are expanded on each run, after the variable is substituted
+ * tokens: Tokens from tokenize() (or the arguments of a builtin), which must outlive the plan
+ * num_tokens: Number of tokens
+ * var: Name of a variable that is substituted wherever "$var" or "${var}" appears in the tokens
+ *      each time the plan is run, or NULL for none
+ * Returns the plan, to be freed with plan_free(), or NULL on error
+ */
+plan_t *plan_compile(char *const *tokens, unsigned num_tokens, const char *var);
+
+/*
+ * Free a plan from plan_compile()
+ */
+void plan_free(plan_t *plan);
+
+/*
+ * Run each command of a plan in turn: its builtin, or else its pipeline as a job. Each command's
+ * tokens are the plan's own, with the variable substituted and wildcards expanded if need be. The
+ * rest of the commands are skipped once a foreground job is interrupted with ^C
+ * value: Value of the plan's variable, if it has one
+ * tokens: An arena vector to hold each command's tokens, which is reset before each command.
+ *         Unchanged tokens are added by reference, so they must not be modified
+ * jobs: List of jobs currently stopped or running in the background
+ * Returns BUILTIN_OK, BUILTIN_EXIT, or BUILTIN_FATAL (see builtins.h)
+ */
+int plan_run(plan_t *plan, const char *value, strvec_t *tokens, job_list_t *jobs);
+
+/*
+ * Run a plan once for each of count iterations, stopping early if it is interrupted with ^C
+ * values: Value of the plan's variable for each iteration, or NULL if it has no variable
+ * jobs: List of jobs currently stopped or running in the background
+ * Returns BUILTIN_OK, BUILTIN_EXIT, or BUILTIN_FATAL (see builtins.h)
+ */
+int plan_loop(plan_t *plan, char *const *values, unsigned long count, job_list_t *jobs);
+
+/*
+ * Free every cached plan
+ */
+void plan_cache_free(void);
+
+#endif    // PLAN_H
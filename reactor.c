@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "reactor.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "job_list.h"
+#include "server.h"
+#include "swish_funcs.h"
+
+#define MAX_EVENTS 8
+
+int reactor_init(reactor_t *reactor, int input_fd) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    // SIGCHLD must be blocked for the signalfd to receive it instead of the default disposition
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    if ((reactor->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("signalfd");
+        return -1;
+    }
+    if ((reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        close(reactor->signal_fd);
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = reactor->signal_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->signal_fd, &event) == -1) {
+        perror("epoll_ctl");
+        reactor_free(reactor);
+        return -1;
+    }
+
+    reactor->input_fd = input_fd;
+    event.data.fd = input_fd;
+    if (input_fd != -1 && epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, input_fd, &event) == -1) {
+        if (errno != EPERM) {
+            perror("epoll_ctl");
+            reactor_free(reactor);
+            return -1;
+        }
+        // A regular file is always "ready", so there's nothing to wait on
+        reactor->input_fd = -1;
+    }
+
+    // Nested epoll instance holding every capture pipe, so pipes come and go without touching ours
+    if ((reactor->capture_fd = capture_poll_fd()) == -1) {
+        reactor_free(reactor);
+        return -1;
+    }
+    event.data.fd = reactor->capture_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->capture_fd, &event) == -1) {
+        perror("epoll_ctl");
+        reactor_free(reactor);
+        return -1;
+    }
+
+    if ((reactor->timer_fd = deadline_timer_fd()) == -1) {
+        reactor_free(reactor);
+        return -1;
+    }
+    event.data.fd = reactor->timer_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &event) == -1) {
+        perror("epoll_ctl");
+        reactor_free(reactor);
+        return -1;
+    }
+
+    reactor->server_fd = server_poll_fd();
+    event.data.fd = reactor->server_fd;
+    if (reactor->server_fd != -1 &&
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->server_fd, &event) == -1) {
+        perror("epoll_ctl");
+        reactor_free(reactor);
+        return -1;
+    }
+    set_child_signal_fd(reactor->signal_fd);
+    return 0;
+}
+
+void reactor_free(reactor_t *reactor) {
+    set_child_signal_fd(-1);
+    close(reactor->epoll_fd);
+    close(reactor->signal_fd);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/*
+ * Consume every pending SIGCHLD notification from the reactor's signalfd
+ * Several child state changes can be merged into a single notification, so callers must reap
+ * until wait4() reports nothing left rather than once per notification
+ * Returns 0 on success or -1 on error
+ */
+static int drain_signal_fd(reactor_t *reactor) {
+    struct signalfd_siginfo info;
+    while (read(reactor->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    if (errno != EAGAIN) {
+        perror("read from signalfd");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for events, and handle every one that arrives together
+ * input_ready: Set to 1 if the command input is ready (or at end of file), left alone otherwise
+ * Returns 0 on success or -1 on error
+ */
+static int handle_events(reactor_t *reactor, job_list_t *jobs, int *input_ready) {
+    struct epoll_event events[MAX_EVENTS];
+    int num_events = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+    if (num_events == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+        if (events[i].data.fd == reactor->signal_fd) {
+            if (drain_signal_fd(reactor) == -1 || reap_jobs(jobs) == -1 ||
+                server_report(jobs) == -1) {
+                return -1;
+            }
+        } else if (events[i].data.fd == reactor->timer_fd) {
+            if (expire_deadlines(jobs) == -1) {
+                return -1;
+            }
+        } else if (events[i].data.fd == reactor->capture_fd) {
+            if (capture_drain() == -1) {
+                return -1;
+            }
+        } else if (events[i].data.fd == reactor->server_fd) {
+            if (server_handle(jobs) == -1) {
+                return -1;
+            }
+        } else if (events[i].data.fd == reactor->input_fd) {
+            *input_ready = 1;    // includes EPOLLHUP, so that the reader sees end of file
+        }
+    }
+    return 0;
+}
+
+int reactor_wait_input(reactor_t *reactor, job_list_t *jobs, int block) {
+    // Catch anything that changed state while the shell was busy with the previous command
+    if (drain_signal_fd(reactor) == -1 || reap_jobs(jobs) == -1 || server_report(jobs) == -1 ||
+        capture_drain() == -1 || expire_deadlines(jobs) == -1) {
+        return -1;
+    }
+    if (!block || reactor->input_fd == -1) {
+        return 0;
+    }
+
+    int input_ready = 0;
+    while (!input_ready) {
+        if (handle_events(reactor, jobs, &input_ready) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int reactor_serve(reactor_t *reactor, job_list_t *jobs) {
+    int input_ready = 0;
+    while (handle_events(reactor, jobs, &input_ready) == 0) {
+    }
+    return -1;
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "job_list.h"
+
+typedef struct {
+    int epoll_fd;
+    int signal_fd;    // signalfd that becomes readable whenever SIGCHLD is pending
+    int input_fd;     // descriptor the shell reads commands from, or -1 if it can't be polled
+    int capture_fd;   // readable whenever a background job has written captured output
+    int timer_fd;     // timerfd that expires at the earliest job deadline
+    int server_fd;    // readable whenever the job server has work, or -1 if it isn't running
+} reactor_t;
+
+/*
+ * Set up the shell's event loop: blocks SIGCHLD so it is only delivered through a signalfd, and
+ * registers that signalfd, the command input, captured output (see capture.h), the job deadline
+ * timer, and the job server if it has been started (see server.h) with a new epoll instance
+ * If input_fd does not support polling (e.g., it is a regular file), it is never waited on
+ * reactor: Pointer to the reactor to initialize
+ * input_fd: Descriptor the shell reads commands from, or -1 if commands don't come from one
+ * Returns 0 on success or -1 on error
+ */
+int reactor_init(reactor_t *reactor, int input_fd);
+
+/*
+ * Close the reactor's descriptors and unblock SIGCHLD
+ * reactor: Pointer to the reactor to free
+ */
+void reactor_free(reactor_t *reactor);
+
+/*
+ * Block until there is command input to read, updating the job list as soon as any child process
+ * exits or stops in the meantime (see reap_jobs()), draining captured output as it arrives, and
+ * signalling jobs whose deadlines pass (see expire_deadlines()), and serving the job server
+ * Returns immediately, after reaping, if the input can't be polled or block is 0
+ * reactor: Pointer to the reactor to wait on
+ * jobs: List of jobs currently stopped or running in the background
+ * block: 0 if input is already buffered, so only pending child state changes should be handled
+ * Returns 0 when input is ready (or at end of file) or -1 on error
+ */
+int reactor_wait_input(reactor_t *reactor, job_list_t *jobs, int block);
+
+/*
+ * Run the job server: handle its connections, child state changes, captured output, and
+ * deadlines as they happen, without reading any command input
+ * reactor: Pointer to a reactor initialized after server_start()
+ * jobs: List of jobs, which the server's commands are added to
+ * Returns -1 on error; otherwise it doesn't return
+ */
+int reactor_serve(reactor_t *reactor, job_list_t *jobs);
+
+#endif    // REACTOR_H
@@ -0,0 +1,478 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "job_list.h"
+#include "string_vector.h"
+#include "swish_funcs.h"
+#include "wildcard.h"
+
+#define MAX_EVENTS 8
+#define LISTEN_BACKLOG 64
+#define LISTEN_ID 0    // epoll data of the listening socket; connections have nonzero IDs
+
+typedef struct {
+    int fd;                  // connected socket, or -1 for an unused slot
+    unsigned id;             // connection number, which its jobs refer to
+    int reading;             // 0 once the client has shut down its writing side
+    unsigned outstanding;    // jobs started for the client that have not been reported yet
+    unsigned events;         // events the socket is currently registered for
+    char *in;                // start of a command line still being received
+    size_t in_len;
+    char *out;               // replies not yet sent
+    size_t out_len;
+    size_t out_capacity;
+} client_t;
+
+typedef struct {
+    unsigned id;            // ID of a job that has finished
+    unsigned generation;    // generation of its slot, in case the job is removed some other way
+} finished_t;
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static char *socket_path = NULL;
+static client_t clients[SERVER_MAX_CLIENTS];
+static unsigned next_id = LISTEN_ID + 1;
+static finished_t *finished = NULL;    // jobs noted by server_job_done()
+static unsigned num_finished = 0;
+static unsigned finished_capacity = 0;
+static strvec_t tokens;    // tokens of the command line being started
+
+/*
+ * Bind a new listening socket to path
+ * Returns the socket, or -1 with errno set
+ */
+static int bind_socket(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (bind(fd, (const struct sockaddr *) addr, sizeof(*addr)) == -1 ||
+        listen(fd, LISTEN_BACKLOG) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Returns 1 if nothing is listening on the socket at addr any more, 0 otherwise
+ */
+static int is_stale(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    int stale = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == -1 &&
+                errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+int server_start(const char *path) {
+    for (unsigned i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = bind_socket(&addr);
+    if (listen_fd == -1 && errno == EADDRINUSE && is_stale(&addr)) {
+        unlink(path);
+        listen_fd = bind_socket(&addr);
+    }
+    if (listen_fd == -1) {
+        perror(path);
+        return -1;
+    }
+    if ((socket_path = strdup(path)) == NULL || strvec_init_arena(&tokens) == -1) {
+        fprintf(stderr, "Failed to allocate job server\n");
+        server_stop();
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_ID;
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        perror("epoll");
+        server_stop();
+        return -1;
+    }
+    return 0;
+}
+
+int server_poll_fd(void) {
+    return epoll_fd;
+}
+
+/*
+ * Returns the connection with the given ID, or NULL if it has been closed
+ */
+static client_t *find_client(unsigned id) {
+    for (unsigned i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1 && clients[i].id == id) {
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void close_client(client_t *client) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    free(client->in);
+    free(client->out);
+    client->in = NULL;
+    client->out = NULL;
+}
+
+/*
+ * Register a connection for the events it currently needs, or close it once it is finished with:
+ * the client has stopped sending, and every job it started has been reported
+ */
+static void update_client(client_t *client) {
+    if (!client->reading && client->outstanding == 0 && client->out_len == 0) {
+        close_client(client);
+        return;
+    }
+    unsigned events = (client->reading ? EPOLLIN : 0) | (client->out_len > 0 ? EPOLLOUT : 0);
+    if (events != client->events) {
+        // A socket registered for no events would still wake the loop with every EPOLLHUP or
+        // EPOLLERR, so it leaves the epoll set until it has something to wait for again
+        int op = events == 0 ? EPOLL_CTL_DEL : client->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        struct epoll_event event;
+        event.events = events;
+        event.data.u64 = client->id;
+        if (epoll_ctl(epoll_fd, op, client->fd, &event) == -1) {
+            perror("epoll_ctl");
+            close_client(client);
+            return;
+        }
+        client->events = events;
+    }
+}
+
+/*
+ * Send as much of a connection's queued replies as the socket will take without blocking
+ * Returns 0, or -1 if the connection has been closed
+ */
+static int flush_client(client_t *client) {
+    size_t sent = 0;
+    while (sent < client->out_len) {
+        ssize_t n = send(client->fd, client->out + sent, client->out_len - sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            break;
+        } else if (n == -1) {    // the client has gone away
+            close_client(client);
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(client->out, client->out + sent, client->out_len - sent);
+    client->out_len -= sent;
+    return 0;
+}
+
+/*
+ * Queue a line of reply to a connection, and send what can be sent right away
+ * A client that lets more than SERVER_OUTPUT_MAX bytes of replies pile up is disconnected
+ * Returns 0, or -1 if the connection has been closed
+ */
+static int reply(client_t *client, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len < 0) {
+        return 0;
+    } else if (len > sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+
+    if (client->out_len + len > client->out_capacity) {
+        size_t capacity = client->out_capacity == 0 ? sizeof(line) : 2 * client->out_capacity;
+        while (client->out_len + len > capacity) {
+            capacity *= 2;
+        }
+        char *out = capacity > SERVER_OUTPUT_MAX ? NULL : realloc(client->out, capacity);
+        if (out == NULL) {
+            close_client(client);
+            return -1;
+        }
+        client->out = out;
+        client->out_capacity = capacity;
+    }
+    memcpy(client->out + client->out_len, line, len);
+    client->out_len += len;
+    return flush_client(client);
+}
+
+static void accept_clients(void) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno != EAGAIN) {
+                perror("accept");
+            }
+            return;
+        }
+
+        client_t *client = NULL;
+        for (unsigned i = 0; i < SERVER_MAX_CLIENTS && client == NULL; i++) {
+            if (clients[i].fd == -1) {
+                client = &clients[i];
+            }
+        }
+        // One more byte than the longest line, to terminate a last line sent without a newline
+        char *in = client == NULL ? NULL : malloc(SERVER_LINE_MAX + 1);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = next_id;
+        if (in == NULL || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            const char *message = "error too many connections\n";
+            send(fd, message, strlen(message), MSG_NOSIGNAL | MSG_DONTWAIT);
+            free(in);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->id = next_id++;
+        if (next_id == LISTEN_ID) {
+            next_id++;
+        }
+        client->reading = 1;
+        client->outstanding = 0;
+        client->events = EPOLLIN;
+        client->in = in;
+        client->in_len = 0;
+        client->out = NULL;
+        client->out_len = 0;
+        client->out_capacity = 0;
+    }
+}
+
+/*
+ * Start one command line from a connection as a background job, and reply with its job ID
+ * line: The command, which is tokenized in place
+ * Returns 0 on success (including a command that could not be started, or a connection that has
+ * been closed) or -1 on a fatal error
+ */
+static int start_line(client_t *client, char *line, job_list_t *jobs) {
+    strvec_reset(&tokens);
+    int result = tokenize(line, &tokens);
+    if (result == 0) {
+        result = wildcard_expand(&tokens);
+    }
+    if (result == -1) {
+        return -1;
+    } else if (result == 1) {
+        reply(client, "error unterminated quote");
+        return 0;
+    }
+    // Every command runs in the background, so a trailing "&" changes nothing
+    if (tokens.length > 0 && token_kind(tokens.data[tokens.length - 1]) == TOKEN_BACKGROUND) {
+        strvec_take(&tokens, tokens.length - 1);
+    }
+    if (tokens.length == 0) {
+        return 0;
+    }
+
+    if (run_pipeline(&tokens, jobs, 1) == -1) {
+        return -1;
+    }
+    int job_id = get_last_background_job();
+    if (job_id == -1) {
+        reply(client, "error could not start %s", tokens.data[0]);
+        return 0;
+    }
+    job_list_get(jobs, job_id)->server_conn = client->id;
+    client->outstanding++;
+    reply(client, "started %d", job_id);
+    return 0;
+}
+
+/*
+ * Read what a connection has sent, and start every complete command line in it
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int read_commands(client_t *client, job_list_t *jobs) {
+    while (client->fd != -1 && client->reading) {
+        if (client->in_len == SERVER_LINE_MAX) {
+            reply(client, "error command line too long");
+            close_client(client);
+            return 0;
+        }
+        ssize_t n = read(client->fd, client->in + client->in_len, SERVER_LINE_MAX - client->in_len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            break;
+        } else if (n == -1) {
+            close_client(client);
+            return 0;
+        } else if (n == 0) {    // the client is done sending, so a last line needs no newline
+            client->reading = 0;
+            if (client->in_len > 0) {
+                client->in[client->in_len++] = '\n';
+            }
+        }
+        client->in_len += n;
+
+        char *line = client->in;
+        char *end = client->in + client->in_len;
+        char *newline;
+        while (client->fd != -1 && (newline = memchr(line, '\n', end - line)) != NULL) {
+            *newline = '\0';
+            if (start_line(client, line, jobs) == -1) {
+                return -1;
+            }
+            line = newline + 1;
+        }
+        if (client->fd != -1) {
+            client->in_len = end - line;
+            memmove(client->in, line, client->in_len);
+        }
+    }
+    if (client->fd != -1) {
+        update_client(client);
+    }
+    return 0;
+}
+
+int server_handle(job_list_t *jobs) {
+    if (epoll_fd == -1) {
+        return 0;
+    }
+    while (1) {
+        struct epoll_event events[MAX_EVENTS];
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.u64 == LISTEN_ID) {
+                accept_clients();
+                continue;
+            }
+            // Looked up by ID, as an earlier event may have closed the connection
+            client_t *client = find_client(events[i].data.u64);
+            if (client != NULL && (events[i].events & EPOLLOUT) && flush_client(client) == 0) {
+                update_client(client);
+            }
+            client = find_client(events[i].data.u64);
+            if (client != NULL && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                read_commands(client, jobs) == -1) {
+                return -1;
+            }
+            // Once the client has hung up and its last commands are started, no reply can reach
+            // it, so the connection is closed and its jobs go on unreported
+            client = find_client(events[i].data.u64);
+            if (client != NULL && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                close_client(client);
+            }
+        }
+        if (num_events < MAX_EVENTS) {
+            return 0;
+        }
+    }
+}
+
+void server_job_done(const job_t *job) {
+    if (num_finished == finished_capacity) {
+        unsigned capacity = finished_capacity == 0 ? MAX_EVENTS : 2 * finished_capacity;
+        finished_t *new_finished = realloc(finished, capacity * sizeof(finished_t));
+        if (new_finished == NULL) {
+            fprintf(stderr, "Failed to record finished job %u\n", job->id);
+            return;
+        }
+        finished = new_finished;
+        finished_capacity = capacity;
+    }
+    finished[num_finished].id = job->id;
+    finished[num_finished++].generation = job->generation;
+}
+
+int server_report(job_list_t *jobs) {
+    for (unsigned i = 0; i < num_finished; i++) {
+        job_t *job = job_list_get(jobs, finished[i].id);
+        if (job == NULL || job->generation != finished[i].generation || job->status != DONE) {
+            continue;    // already removed, e.g., by the jobs builtin
+        }
+        client_t *client = find_client(job->server_conn);
+        if (client != NULL) {
+            const job_usage_t *usage = &job->usage;
+            double real = (usage->end.tv_sec - usage->start.tv_sec) +
+                          (usage->end.tv_nsec - usage->start.tv_nsec) / 1e9;
+            client->outstanding--;
+            if (reply(client, "done %u status=%d real=%.3f user=%.3f sys=%.3f maxrss=%ld",
+                      job->id, job->exit_status, real,
+                      usage->utime.tv_sec + usage->utime.tv_usec / 1e6,
+                      usage->stime.tv_sec + usage->stime.tv_usec / 1e6, usage->maxrss) == 0) {
+                update_client(client);
+            }
+        }
+        job_list_remove(jobs, job->id);
+    }
+    num_finished = 0;
+    return 0;
+}
+
+void server_stop(void) {
+    for (unsigned i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            close_client(&clients[i]);
+        }
+    }
+    if (listen_fd != -1) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if (socket_path != NULL) {
+        unlink(socket_path);
+        free(socket_path);
+        socket_path = NULL;
+    }
+    strvec_clear(&tokens);
+    free(finished);
+    finished = NULL;
+    num_finished = finished_capacity = 0;
+}
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "job_list.h"
+
+#define SERVER_MAX_CLIENTS 64          // most connections served at once; later ones are refused
+#define SERVER_LINE_MAX (64 * 1024)    // longest command line accepted from a connection
+#define SERVER_OUTPUT_MAX (1024 * 1024)    // most replies queued for a client that isn't reading
+
+/*
+ * Job server (swish --serve PATH): local processes connect to a Unix domain socket and send
+ * commands, one per line, any number at a time. Each command is started as a background job in
+ * the shell's job list, and the connection is sent one line of reply for it:
+ *   started ID                   the job is running, with job ID ID
+ *   error MESSAGE                the command could not be started
+ * and, once a started job's processes have all exited:
+ *   done ID status=N real=SECONDS user=SECONDS sys=SECONDS maxrss=KIB
+ * A client that shuts down its writing side still gets the replies for the jobs it started, after
+ * which the connection is closed. Jobs from a client that disconnects keep running unreported
+ *
+ * The listening socket and every connection are registered with one epoll instance, which the
+ * shell's event loop waits on alongside its child processes (see reactor.h)
+ */
+
+/*
+ * Start listening on a Unix domain socket, replacing a stale socket file left at path by a server
+ * that is no longer running
+ * path: Path of the socket
+ * Returns 0 on success or -1 on error (already reported)
+ */
+int server_start(const char *path);
+
+/*
+ * Get the descriptor that becomes readable whenever a connection or command is waiting
+ * Returns the descriptor, or -1 if the server has not been started
+ */
+int server_poll_fd(void);
+
+/*
+ * Accept new connections, start the commands they have sent, and send queued replies, without
+ * blocking
+ * jobs: List of jobs to add the commands' jobs to
+ * Returns 0 on success or -1 on a fatal error
+ */
+int server_handle(job_list_t *jobs);
+
+/*
+ * Note that a job started by the server has finished, to be reported by server_report()
+ * Called as the job becomes DONE, while it must stay in the job list
+ * job: The job, which has a nonzero server_conn
+ */
+void server_job_done(const job_t *job);
+
+/*
+ * Send the results of the jobs noted by server_job_done() to the connections that started them,
+ * and remove the jobs from the list
+ * jobs: List of jobs
+ * Returns 0 on success or -1 on error
+ */
+int server_report(job_list_t *jobs);
+
+/*
+ * Close every connection and the listening socket, and remove the socket file
+ */
+void server_stop(void);
+
+#endif    // SERVER_H
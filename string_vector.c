@@ -7,32 +7,79 @@
 #include <string.h>
 
 #define INITIAL_SIZE 4
+#define ARENA_CHUNK_SIZE 4096
 
 int strvec_init(strvec_t *vec) {
     vec->length = 0;
     vec->capacity = INITIAL_SIZE;
+    vec->use_arena = 0;
+    vec->arena = NULL;
+    vec->arena_cur = NULL;
     vec->data = malloc(INITIAL_SIZE * sizeof(char *));
     if (vec->data == NULL) {
         return -1;
     }
+    vec->data[0] = NULL;
 
     return 0;
 }
 
+int strvec_init_arena(strvec_t *vec) {
+    if (strvec_init(vec) != 0) {
+        return -1;
+    }
+    vec->use_arena = 1;
+    return 0;
+}
+
 void strvec_clear(strvec_t *vec) {
     if (vec->capacity == 0) {
         return;
     }
-    for (int i = 0; i < vec->length; i++) {
-        free(vec->data[i]);
+    if (vec->use_arena) {
+        arena_chunk_t *chunk = vec->arena;
+        while (chunk != NULL) {
+            arena_chunk_t *temp = chunk;
+            chunk = chunk->next;
+            free(temp);
+        }
+    } else {
+        for (int i = 0; i < vec->length; i++) {
+            free(vec->data[i]);
+        }
     }
     free(vec->data);
 
     vec->length = 0;
     vec->capacity = 0;
+    vec->use_arena = 0;
+    vec->arena = NULL;
+    vec->arena_cur = NULL;
 }
 
-int strvec_add(strvec_t *vec, const char *s) {
+void strvec_reset(strvec_t *vec) {
+    if (vec->use_arena) {
+        for (arena_chunk_t *chunk = vec->arena; chunk != NULL; chunk = chunk->next) {
+            chunk->used = 0;
+        }
+        vec->arena_cur = vec->arena;
+    } else {
+        for (int i = 0; i < vec->length; i++) {
+            free(vec->data[i]);
+        }
+    }
+    vec->length = 0;
+    if (vec->capacity > 0) {
+        vec->data[0] = NULL;
+    }
+}
+
+/*
+ * Make sure there is room for one more element in the vector's underlying array, and for the NULL
+ * after it
+ * Returns 0 on success, -1 on error
+ */
+static int strvec_reserve(strvec_t *vec) {
     // If vector was previously cleared, need to reinitialize
     if (vec->capacity == 0) {
         if (strvec_init(vec) != 0) {
@@ -40,7 +87,7 @@ int strvec_add(strvec_t *vec, const char *s) {
         }
     }
 
-    if (vec->length == vec->capacity) {
+    if (vec->length + 1 == vec->capacity) {
         // Expand underlying array
         char **new_data = realloc(vec->data, 2 * vec->capacity * sizeof(char *));
         if (new_data == NULL) {
@@ -50,12 +97,75 @@ int strvec_add(strvec_t *vec, const char *s) {
         }
         vec->capacity = vec->capacity * 2;
     }
+    return 0;
+}
 
-    if ((vec->data[vec->length] = malloc((strlen(s) + 1) * sizeof(char))) == NULL) {
+/*
+ * Bump-allocate n bytes from the vector's arena, moving on to the next chunk (or adding a new one)
+ * when the current chunk is full. Chunks are never moved, so earlier strings stay where they are
+ * Returns a pointer to the bytes on success, or NULL on error
+ */
+static char *arena_alloc(strvec_t *vec, unsigned n) {
+    arena_chunk_t *chunk = vec->arena_cur;
+    while (chunk != NULL && chunk->size - chunk->used < n) {
+        if (chunk->next == NULL) {
+            unsigned size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+            if ((chunk->next = malloc(sizeof(arena_chunk_t) + size)) == NULL) {
+                return NULL;
+            }
+            chunk->next->next = NULL;
+            chunk->next->size = size;
+            chunk->next->used = 0;
+        }
+        chunk = chunk->next;
+    }
+
+    if (chunk == NULL) {    // first string added to this arena
+        unsigned size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+        if ((chunk = malloc(sizeof(arena_chunk_t) + size)) == NULL) {
+            return NULL;
+        }
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        vec->arena = chunk;
+    }
+
+    vec->arena_cur = chunk;
+    char *bytes = chunk->bytes + chunk->used;
+    chunk->used += n;
+    return bytes;
+}
+
+int strvec_add(strvec_t *vec, const char *s) {
+    if (strvec_reserve(vec) != 0) {
         return -1;
     }
-    strcpy(vec->data[vec->length], s);
-    vec->length++;
+
+    unsigned n = (strlen(s) + 1) * sizeof(char);
+    if (vec->use_arena) {
+        vec->data[vec->length] = arena_alloc(vec, n);
+    } else {
+        vec->data[vec->length] = malloc(n);
+    }
+    if (vec->data[vec->length] == NULL) {
+        return -1;
+    }
+    memcpy(vec->data[vec->length], s, n);
+    vec->data[++vec->length] = NULL;
+    return 0;
+}
+
+int strvec_add_ref(strvec_t *vec, char *s) {
+    if (!vec->use_arena) {
+        return strvec_add(vec, s);
+    }
+
+    if (strvec_reserve(vec) != 0) {
+        return -1;
+    }
+    vec->data[vec->length] = s;
+    vec->data[++vec->length] = NULL;
     return 0;
 }
 
@@ -81,8 +191,11 @@ void strvec_take(strvec_t *vec, unsigned n) {
         return;
     }
 
-    for (int i = n; i < vec->length; i++) {
-        free(vec->data[i]);
+    if (!vec->use_arena) {
+        for (int i = n; i < vec->length; i++) {
+            free(vec->data[i]);
+        }
     }
     vec->length = n;
+    vec->data[n] = NULL;
 }
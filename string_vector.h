@@ -4,10 +4,20 @@
 #ifndef STRING_VECTOR_H
 #define STRING_VECTOR_H
 
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    unsigned int size;
+    unsigned int used;
+    char bytes[];
+} arena_chunk_t;
+
 typedef struct {
     unsigned int length;
     unsigned int capacity;
-    char **data;
+    char **data;                 // entries, followed by a NULL so that data can be used as an argv
+    int use_arena;               // nonzero if strings are kept in (or borrowed by) an arena
+    arena_chunk_t *arena;        // first chunk of the arena, or NULL
+    arena_chunk_t *arena_cur;    // chunk that new strings are currently placed in
 } strvec_t;
 
 /*
@@ -17,14 +27,33 @@ typedef struct {
  */
 int strvec_init(strvec_t *vec);
 
+/*
+ * Initializes a new, empty string vector in arena mode
+ * Strings added to an arena vector are not malloc'd one at a time. strvec_add() copies them into a
+ * bump-allocated arena owned by the vector, and strvec_add_ref() stores the caller's pointer as is.
+ * strvec_reset() then releases every string at once while keeping the vector's memory for reuse
+ * vec: Pointer to the vector to initialize
+ * Returns 0 on success, -1 on error
+ */
+int strvec_init_arena(strvec_t *vec);
+
 /*
  * Removes all entries from a string vector
  * The underlying memory for the vector is also freed
  * vec: Pointer to the vector to clear
  * Note: You MUST re-initialize this vector with strvec_init() if you want to use it again
+ * Note: This also releases an arena vector's arena, after which it is an ordinary vector
  */
 void strvec_clear(strvec_t *vec);
 
+/*
+ * Removes all entries from a string vector, but keeps its memory for the strings added next
+ * For an arena vector this frees nothing at all, so a vector that is reset after every input line
+ * stops allocating once it has grown to fit the longest line
+ * vec: Pointer to the vector to reset
+ */
+void strvec_reset(strvec_t *vec);
+
 /*
  * Add a new string to a string vector
  * vec: Pointer to the vector to add to
@@ -34,6 +63,16 @@ void strvec_clear(strvec_t *vec);
  */
 int strvec_add(strvec_t *vec, const char *s);
 
+/*
+ * Add a string to a string vector without copying it, if the vector is in arena mode
+ * vec: Pointer to the vector to add to
+ * s: The string to add, which must stay valid and unchanged until the vector is next reset or
+ *    cleared (e.g., a token inside the input line being parsed)
+ * Returns 0 on success, -1 on error
+ * Note: For an ordinary vector this is the same as strvec_add()
+ */
+int strvec_add_ref(strvec_t *vec, char *s);
+
 /*
  * Retrieve an element from a string vector
  * vec: Pointer to the vector to retrieve from
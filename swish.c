@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,17 +8,90 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "builtins.h"
+#include "capture.h"
+#include "cgroup.h"
 #include "job_list.h"
+#include "line_reader.h"
+#include "path_cache.h"
+#include "plan.h"
+#include "reactor.h"
+#include "server.h"
 #include "string_vector.h"
 #include "swish_funcs.h"
+#include "wildcard.h"
+#include "zygote.h"
 
-#define CMD_LEN 512
 #define PROMPT "@> "
+#define INTERACTIVE_READ_SIZE 4096
+#define BATCH_READ_SIZE (64 * 1024)
+
+/*
+ * Run as a job server on the Unix domain socket at path (see server.h) until an error occurs or
+ * the shell is killed
+ * Returns the shell's exit status
+ */
+static int serve(const char *path) {
+    job_list_t jobs;
+    job_list_init(&jobs);
+    if (server_start(path) == -1) {
+        return 1;
+    }
+    reactor_t reactor;
+    if (reactor_init(&reactor, -1) == -1) {
+        server_stop();
+        return 1;
+    }
+    reactor_serve(&reactor, &jobs);
+
+    reactor_free(&reactor);
+    server_stop();
+    job_list_free(&jobs);
+    cgroup_stop();
+    path_cache_free();
+    wildcard_free();
+    capture_free_all();
+    zygote_stop();
+    return 1;
+}
 
 /**
  * Main function to run Simple Working Implementation Shell (swish):
+ *   swish              read commands from stdin (with a prompt if stdin is a terminal)
+ *   swish -c COMMANDS  run the lines of COMMANDS
+ *   swish SCRIPT       run the lines of the file SCRIPT
+ *   swish --serve PATH run commands sent to the Unix domain socket PATH as background jobs
+ * Environment: SWISH_LAUNCH=fork|zygote picks how jobs are launched, SWISH_CGROUPS=1 puts each
+ * job in a cgroup of its own, and SWISH_AFFINITY=cpu|node spreads background jobs over the CPUs
+ * Exits with the status of the last foreground command, unless 'exit N' says otherwise
  */
 int main(int argc, char **argv) {
+    int input_fd = STDIN_FILENO;
+    const char *command_string = NULL;
+    const char *serve_path = NULL;
+    if (argc >= 2 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "--serve") == 0)) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s [-c commands | --serve socket | script]\n", argv[0]);
+            return 2;
+        }
+        if (argv[1][1] == 'c') {
+            command_string = argv[2];
+        } else {
+            serve_path = argv[2];
+        }
+        input_fd = -1;
+    } else if (argc >= 2) {
+        if ((input_fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+    // Without a terminal there is no prompt to print and no terminal to hand to each job
+    int show_prompt = input_fd == STDIN_FILENO && isatty(STDIN_FILENO);
+    set_interactive(serve_path == NULL && isatty(STDIN_FILENO));
+    set_commands_from_stdin(input_fd == STDIN_FILENO);
+
     struct sigaction sac;
     sac.sa_handler = SIG_IGN;
     if (sigfillset(&sac.sa_mask) == -1) {
@@ -30,191 +104,120 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // SWISH_LAUNCH=fork selects the fork() fallback instead of posix_spawn(), and
+    // SWISH_LAUNCH=zygote launches through a zygote, forked here while the shell is still small
+    const char *launch = getenv("SWISH_LAUNCH");
+    if (launch != NULL && strcmp(launch, "fork") == 0) {
+        set_launch_mode(LAUNCH_FORK);
+    } else if (launch != NULL && strcmp(launch, "zygote") == 0 && zygote_start() == 0) {
+        set_launch_mode(LAUNCH_ZYGOTE);
+    }
+    // SWISH_CGROUPS=1 gives each job a cgroup of its own, see cgroup.h
+    const char *cgroups = getenv("SWISH_CGROUPS");
+    if (cgroups != NULL && strcmp(cgroups, "1") == 0) {
+        cgroup_init();
+    }
+    // SWISH_AFFINITY=cpu or SWISH_AFFINITY=node pins each background job, see affinity.h
+    const char *affinity = getenv("SWISH_AFFINITY");
+    if (affinity != NULL && strcmp(affinity, "cpu") == 0) {
+        affinity_init(AFFINITY_CPU);
+    } else if (affinity != NULL && strcmp(affinity, "node") == 0) {
+        affinity_init(AFFINITY_NODE);
+    }
+    if (serve_path != NULL) {
+        return serve(serve_path);
+    }
+
+    // Tokens point into the line's cached plan, and the vector is reset rather than freed after
+    // each line, so running a line doesn't allocate anything once the vector has grown to fit it
     strvec_t tokens;
-    strvec_init(&tokens);
+    strvec_init_arena(&tokens);
     job_list_t jobs;
     job_list_init(&jobs);
-    char cmd[CMD_LEN];
-
-    printf("%s", PROMPT);
-    while (fgets(cmd, CMD_LEN, stdin) != NULL) {
-        // Need to remove trailing '\n' from cmd. There are fancier ways.
-        int i = 0;
-        while (cmd[i] != '\n') {
-            i++;
-        }
-        cmd[i] = '\0';
+    // Lines of any length are read straight from the input into one reusable buffer, and looked up
+    // in the plan cache from there. Non-interactive input is read in large blocks
+    line_reader_t reader;
+    int reader_result;
+    if (command_string != NULL) {
+        reader_result = line_reader_init_string(&reader, command_string);
+    } else {
+        reader_result = line_reader_init(&reader, input_fd,
+                                         show_prompt ? INTERACTIVE_READ_SIZE : BATCH_READ_SIZE);
+    }
+    if (reader_result == -1) {
+        printf("Failed to allocate input buffer\n");
+        job_list_free(&jobs);
+        return 1;
+    }
+    char *cmd;
+
+    // Wait for input and child state changes together, so background jobs are reaped as soon as
+    // they finish. We only sleep in the event loop if no complete line is buffered yet
+    reactor_t reactor;
+    if (reactor_init(&reactor, input_fd) == -1) {
+        line_reader_free(&reader);
+        job_list_free(&jobs);
+        return 1;
+    }
 
-        if (tokenize(cmd, &tokens) != 0) {
+    if (show_prompt) {
+        printf("%s", PROMPT);
+        fflush(stdout);
+    }
+    while (reactor_wait_input(&reactor, &jobs, !line_reader_has_line(&reader)) == 0 &&
+           line_reader_next(&reader, &cmd) == 1) {
+        // A line that has run before is not tokenized again, see plan.h
+        plan_t *plan;
+        int parsed = plan_get(cmd, &plan);
+        if (parsed == -1) {
             printf("Failed to parse command\n");
             strvec_clear(&tokens);
+            reactor_free(&reactor);
+            line_reader_free(&reader);
             job_list_free(&jobs);
             return 1;
         }
-        if (tokens.length == 0) {
-            printf("%s", PROMPT);
-            continue;
-        }
-        const char *first_token = strvec_get(&tokens, 0);
-
-        // Get the shell's current working directory
-        if (strcmp(first_token, "pwd") == 0) {
-            char dir_name[CMD_LEN];
-            if (getcwd(dir_name, CMD_LEN) == NULL) {
-                perror("getcwd");
-                strvec_clear(&tokens);
-                job_list_free(&jobs);
-                return 1;
-            }
-
-            printf("%s\n", dir_name);
-        }
-
-        // Change the shell's current working directory
-        else if (strcmp(first_token, "cd") == 0) {
-            char *home_dir = getenv("HOME");
-            if (home_dir == NULL) {
-                printf("Failed to get home directory\n");
-            }
-            char *directory = strvec_get(&tokens, 1);
-            if (directory == NULL) {
-                if (chdir(home_dir) == -1) {
-                    perror("chdir");
-                }
-            } else {
-                if (chdir(directory) == -1) {
-                    perror("chdir");
-                }
+        if (parsed == 1) {    // a syntax error, already reported
+            set_last_status(2);
+            if (show_prompt) {
+                printf("%s", PROMPT);
+                fflush(stdout);
             }
+            continue;
         }
 
-        else if (strcmp(first_token, "exit") == 0) {
+        // Builtins were found with a single hash lookup when the plan was made, see builtins.def
+        int result = plan_run(plan, NULL, &tokens, &jobs);
+        if (result == BUILTIN_EXIT) {
             strvec_clear(&tokens);
             break;
+        } else if (result == BUILTIN_FATAL) {
+            strvec_clear(&tokens);
+            reactor_free(&reactor);
+            line_reader_free(&reader);
+            job_list_free(&jobs);
+            return 1;
         }
 
-        // Print out current list of pending jobs
-        else if (strcmp(first_token, "jobs") == 0) {
-            int i = 0;
-            job_t *current = jobs.head;
-            while (current != NULL) {
-                char *status_desc;
-                if (current->status == BACKGROUND) {
-                    status_desc = "background";
-                } else {
-                    status_desc = "stopped";
-                }
-                printf("%d: %s (%s)\n", i, current->name, status_desc);
-                i++;
-                current = current->next;
-            }
-        }
-
-        // Move stopped job into foreground
-        else if (strcmp(first_token, "fg") == 0) {
-            if (resume_job(&tokens, &jobs, 1) == -1) {
-                printf("Failed to resume job in foreground\n");
-            }
-        }
-
-        // Move stopped job into background
-        else if (strcmp(first_token, "bg") == 0) {
-            if (resume_job(&tokens, &jobs, 0) == -1) {
-                printf("Failed to resume job in background\n");
-            }
-        }
-
-        // Wait for a specific job identified by its index in job list
-        else if (strcmp(first_token, "wait-for") == 0) {
-            if (await_background_job(&tokens, &jobs) == -1) {
-                printf("Failed to wait for background job\n");
-            }
-        }
-
-        // Wait for all background jobs
-        else if (strcmp(first_token, "wait-all") == 0) {
-            if (await_all_background_jobs(&jobs) == -1) {
-                printf("Failed to wait for all background jobs\n");
-            }
-        }
-
-        else {
-            const char *last_token = strvec_get(&tokens, tokens.length - 1);
-            if (strcmp(last_token, "&") == 0) {
-                strvec_take(&tokens, tokens.length - 1);
-                pid_t pid = fork();
-                if (pid < 0) {    // an error occurred
-                    perror("fork");
-                    strvec_clear(&tokens);
-                    job_list_free(&jobs);
-                    return 1;
-                } else if (pid == 0) {    // child process
-                    run_command(&tokens);
-                    strvec_clear(&tokens);
-                    job_list_free(&jobs);
-                    exit(1);
-                } else {    // parent process
-                    if (job_list_add(&jobs, pid, first_token, BACKGROUND) == -1) {
-                        printf("Failed to add to job list\n");
-                        strvec_clear(&tokens);
-                        job_list_free(&jobs);
-                        return 1;
-                    }
-                }
-
-            } else {
-                int status;
-                pid_t pid = fork();
-                if (pid < 0) {    // an error occurred
-                    perror("fork");
-                    strvec_clear(&tokens);
-                    job_list_free(&jobs);
-                    return 1;
-                } else if (pid == 0) {    // child process
-                    run_command(&tokens);
-                    strvec_clear(&tokens);
-                    job_list_free(&jobs);
-                    exit(1);
-                } else {    // parent process
-                    // put the child's process group in the foreground
-                    if (tcsetpgrp(STDIN_FILENO, pid) == -1) {
-                        perror("tcsetpgrp");
-                        strvec_clear(&tokens);
-                        job_list_free(&jobs);
-                        return 1;
-                    }
-                    // waits for child process to terminate
-                    if (waitpid(pid, &status, WUNTRACED) == -1) {
-                        perror("waitpid");
-                        strvec_clear(&tokens);
-                        job_list_free(&jobs);
-                        return 1;
-                    }
-                    if (WIFSTOPPED(status)) {
-                        if (job_list_add(&jobs, pid, first_token, STOPPED) == -1) {
-                            printf("Failed to add to job list\n");
-                            strvec_clear(&tokens);
-                            job_list_free(&jobs);
-                            return 1;
-                        }
-                    }
-
-                    pid_t ppid = getpid();
-                    // restore the shell process to the foreground
-                    if (tcsetpgrp(STDIN_FILENO, ppid) == -1) {
-                        perror("tcsetpgrp");
-                        strvec_clear(&tokens);
-                        job_list_free(&jobs);
-                        return 1;
-                    }
-                }
-            }
+        strvec_reset(&tokens);
+        if (show_prompt) {
+            printf("%s", PROMPT);
+            fflush(stdout);
         }
-
-        strvec_clear(&tokens);
-        printf("%s", PROMPT);
     }
 
+    strvec_clear(&tokens);
+    reactor_free(&reactor);
+    line_reader_free(&reader);
     job_list_free(&jobs);
-    return 0;
+    cgroup_stop();
+    path_cache_free();
+    plan_cache_free();
+    wildcard_free();
+    capture_free_all();
+    zygote_stop();
+    if (input_fd > STDIN_FILENO) {
+        close(input_fd);
+    }
+    return get_last_status();
 }
@@ -3,135 +3,2329 @@
 #include "swish_funcs.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+#include <emmintrin.h>
+#endif
 
+#include "affinity.h"
+#include "capture.h"
+#include "cgroup.h"
+#include "graph.h"
 #include "job_list.h"
+#include "line_reader.h"
+#include "path_cache.h"
+#include "server.h"
 #include "string_vector.h"
+#include "wildcard.h"
+#include "zygote.h"
 
-#define MAX_ARGS 10
+#define MAX_LAUNCH_FDS ZYGOTE_MAX_FDS    // most descriptors set up for one launched process
+#define STATUS_NOT_STARTED 127    // exit status of a command that could not be started
+#define STATUS_REDIRECT_FAILED 1  // exit status of a command whose redirections could not be set up
+#define STATUS_TIMED_OUT 124      // exit status of a job that ran past its deadline
+#define POLL_INTERVAL_MS 10       // longest wait for events when there is no signalfd to poll
+#define ITEMS_READ_SIZE 4096      // initial buffer size for reading parallel items from stdin
+#define ARG_HEADROOM 2048         // bytes of ARG_MAX that xargs batches leave unused, as xargs does
+#define SIMD_PAGE_SIZE 4096       // smallest page size, which a vector load mustn't cross past '\0'
+
+extern char **environ;
+
+static launch_mode_t launch_mode = LAUNCH_SPAWN;
+static int interactive = 1;    // whether jobs are handed the terminal while in the foreground
+static int last_status = 0;    // exit status of the most recent foreground job
+static int commands_from_stdin = 1;    // whether the shell reads its own commands from stdin
+static job_usage_t last_usage;    // resources used by the most recent foreground job
+static int not_started_status;    // exit status of the stage spawn_stage() last failed to start
+static int last_background_job = -1;    // ID of the job most recently started in the background
+static int capture_output = 0;    // whether background jobs' output is captured (see capture.h)
+static int child_signal_fd = -1;    // signalfd for SIGCHLD, polled while waiting with captures
+static int timer_fd = -1;    // timerfd that expires at the earliest deadline of any job
+static int timer_armed = 0;    // whether any job may have a deadline pending
+
+// Text of each operator, indexed by token_kind_t. tokenize() adds these very strings to the tokens
+// vector, so token_kind() only has to look at a token's address
+static const char operator_text[][4] = {"", "|", "|&", "&", ";", "<", ">", ">>", "2>", "2>>"};
+
+// Classes of characters for the lexer
+enum {
+    CHAR_PLAIN,           // part of a word
+    CHAR_GLOB,            // part of a word, but escaped when quoted (see tokenize())
+    CHAR_SPACE,
+    CHAR_END,
+    CHAR_SINGLE_QUOTE,
+    CHAR_DOUBLE_QUOTE,
+    CHAR_BACKSLASH,
+    CHAR_OPERATOR,        // starts an operator
+};
+
+static const unsigned char char_class[256] = {
+    ['\0'] = CHAR_END,          [' '] = CHAR_SPACE,          ['\t'] = CHAR_SPACE,
+    ['\n'] = CHAR_SPACE,        ['\v'] = CHAR_SPACE,         ['\f'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,        ['\''] = CHAR_SINGLE_QUOTE,  ['"'] = CHAR_DOUBLE_QUOTE,
+    ['\\'] = CHAR_BACKSLASH,    ['|'] = CHAR_OPERATOR,       ['&'] = CHAR_OPERATOR,
+    ['<'] = CHAR_OPERATOR,      ['>'] = CHAR_OPERATOR,       [';'] = CHAR_OPERATOR,
+    ['*'] = CHAR_GLOB,          ['?'] = CHAR_GLOB,           ['['] = CHAR_GLOB,
+};
+
+/*
+ * State of the lexer within one word. The word is normally compacted in place, with the write
+ * position never passing the read position, since quotes take up room that escapes can reuse. A
+ * run of quoted wildcard characters can need more room than that, in which case the rest of the
+ * word goes to a separate buffer, which is copied into the tokens vector
+ */
+typedef struct {
+    char *r;           // next character to read
+    char *w;           // where the next character of the word goes
+    char *word;        // start of the word
+    int spilled;       // whether word is spill_buf rather than a position in the line
+} lexer_t;
+
+static char *spill_buf = NULL;
+static size_t spill_size = 0;
+
+/*
+ * Returns the length of the run of CHAR_PLAIN and CHAR_GLOB characters at the start of s
+ */
+static size_t plain_run(const char *s) {
+    const char *p = s;
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+    // Sixteen characters at a time, for as long as a load can't stray into the next page (which
+    // might not be mapped) past the end of the line. Without optimization the intrinsics aren't
+    // inlined, which makes this slower than the table lookups below
+    const __m128i quote = _mm_set1_epi8('\'');
+    const __m128i double_quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i bar = _mm_set1_epi8('|');
+    const __m128i ampersand = _mm_set1_epi8('&');
+    const __m128i less = _mm_set1_epi8('<');
+    const __m128i greater = _mm_set1_epi8('>');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8('\r' - '\t');
+    while (((uintptr_t) p & (SIMD_PAGE_SIZE - 1)) <= SIMD_PAGE_SIZE - sizeof(__m128i)) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i from_tab = _mm_sub_epi8(v, tab);    // '\t' to '\r' become 0 to 4
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, double_quote)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, bar))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, ampersand), _mm_cmpeq_epi8(v, less)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, greater), _mm_cmpeq_epi8(v, space))));
+        special = _mm_or_si128(
+            _mm_or_si128(special, _mm_cmpeq_epi8(v, semicolon)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, zero),
+                         _mm_cmpeq_epi8(_mm_min_epu8(from_tab, four), from_tab)));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            return p - s + __builtin_ctz(mask);
+        }
+        p += sizeof(__m128i);
+    }
+#endif
+    while (char_class[(unsigned char) *p] <= CHAR_GLOB) {
+        p++;
+    }
+    return p - s;
+}
+
+/*
+ * Add n bytes to the current word, moving it to spill_buf first if they don't fit in place
+ * Returns 0 on success or -1 on error
+ */
+static int lexer_put(lexer_t *lx, const char *bytes, size_t n) {
+    if (!lx->spilled && lx->w + n > lx->r) {
+        // Every character left on the line takes at most two bytes
+        size_t len = lx->w - lx->word;
+        size_t size = len + n + 2 * strlen(lx->r) + 1;
+        if (size > spill_size) {
+            char *buf = realloc(spill_buf, size);
+            if (buf == NULL) {
+                return -1;
+            }
+            spill_buf = buf;
+            spill_size = size;
+        }
+        memcpy(spill_buf, lx->word, len);
+        lx->word = spill_buf;
+        lx->w = spill_buf + len;
+        lx->spilled = 1;
+    }
+    memmove(lx->w, bytes, n);
+    lx->w += n;
+    return 0;
+}
+
+/*
+ * Add a quoted or escaped character to the current word, itself escaped if it would otherwise be
+ * taken for a wildcard, or for the start of a loop variable (which double quotes don't prevent)
+ * Returns 0 on success or -1 on error
+ */
+static int lexer_put_quoted(lexer_t *lx, char c, int in_double_quotes) {
+    int cls = char_class[(unsigned char) c];
+    char escaped[2] = {'\\', c};
+    if (cls == CHAR_GLOB || cls == CHAR_BACKSLASH || (c == '$' && !in_double_quotes)) {
+        return lexer_put(lx, escaped, 2);
+    }
+    return lexer_put(lx, escaped + 1, 1);
+}
+
+/*
+ * Read the operator at *s, if any, advancing *s past it
+ * Returns the kind of operator, or TOKEN_WORD if there is none
+ */
+static token_kind_t lex_operator(char **s) {
+    char *p = *s;
+    token_kind_t kind;
+    if (p[0] == '|') {
+        kind = p[1] == '&' ? TOKEN_PIPE_ALL : TOKEN_PIPE;
+    } else if (p[0] == '&') {
+        kind = TOKEN_BACKGROUND;
+    } else if (p[0] == ';') {
+        kind = TOKEN_SEPARATOR;
+    } else if (p[0] == '<') {
+        kind = TOKEN_REDIRECT_IN;
+    } else if (p[0] == '>') {
+        kind = p[1] == '>' ? TOKEN_REDIRECT_APPEND : TOKEN_REDIRECT_OUT;
+    } else if (p[0] == '2' && p[1] == '>') {
+        kind = p[2] == '>' ? TOKEN_REDIRECT_ERR_APPEND : TOKEN_REDIRECT_ERR;
+    } else {
+        return TOKEN_WORD;
+    }
+    *s += strlen(operator_text[kind]);
+    return kind;
+}
+
+/*
+ * Read one word, starting at lx->r, up to the whitespace or operator that ends it
+ * Returns 0 on success, 1 for an unterminated quote, or -1 on error
+ */
+static int lex_word(lexer_t *lx) {
+    while (1) {
+        char *r = lx->r;
+        switch (char_class[(unsigned char) *r]) {
+        case CHAR_PLAIN:
+        case CHAR_GLOB: {
+            size_t n = plain_run(r);
+            lx->r += n;
+            if (lx->w == r && !lx->spilled) {
+                lx->w += n;    // nothing has been removed yet, so the run is already in place
+            } else if (lexer_put(lx, r, n) == -1) {
+                return -1;
+            }
+            break;
+        }
+        case CHAR_SINGLE_QUOTE:
+            for (lx->r++; *lx->r != '\'';) {
+                if (*lx->r == '\0') {
+                    return 1;
+                }
+                char c = *lx->r++;    // consumed before it can be written over
+                if (lexer_put_quoted(lx, c, 0) == -1) {
+                    return -1;
+                }
+            }
+            lx->r++;
+            break;
+        case CHAR_DOUBLE_QUOTE:
+            for (lx->r++; *lx->r != '"';) {
+                if (*lx->r == '\0') {
+                    return 1;
+                }
+                if (lx->r[0] == '\\' && (lx->r[1] == '"' || lx->r[1] == '\\')) {
+                    lx->r++;
+                }
+                char c = *lx->r++;
+                if (lexer_put_quoted(lx, c, 1) == -1) {
+                    return -1;
+                }
+            }
+            lx->r++;
+            break;
+        case CHAR_BACKSLASH: {
+            // A backslash at the very end of the line stands for itself
+            char c = r[1] == '\0' ? '\\' : r[1];
+            lx->r += r[1] == '\0' ? 1 : 2;
+            if (lexer_put_quoted(lx, c, 0) == -1) {
+                return -1;
+            }
+            break;
+        }
+        default:    // whitespace, an operator, or the end of the line
+            return 0;
+        }
+    }
+}
 
 int tokenize(char *s, strvec_t *tokens) {
-    char *token = strtok(s, " ");    // specify the string to parse for the first call to strtok
-    while (token != NULL) {
-        if (strvec_add(tokens, token) == -1) {
+    lexer_t lx;
+    lx.r = s;
+    while (1) {
+        while (char_class[(unsigned char) *lx.r] == CHAR_SPACE) {
+            lx.r++;
+        }
+        if (*lx.r == '\0') {
+            return 0;
+        }
+
+        token_kind_t kind = lex_operator(&lx.r);
+        if (kind != TOKEN_WORD) {
+            if (strvec_add_ref(tokens, (char *) operator_text[kind]) == -1) {
+                fprintf(stderr, "Failed to add token to tokens vector\n");
+                return -1;
+            }
+            continue;
+        }
+
+        lx.word = lx.w = lx.r;
+        lx.spilled = 0;
+        int result = lex_word(&lx);
+        if (result == 1) {
+            fprintf(stderr, "swish: unterminated quote\n");
+            return 1;
+        } else if (result == -1) {
+            fprintf(stderr, "Failed to add token to tokens vector\n");
+            return -1;
+        }
+        // The character after the word is consumed before the word's terminator can overwrite it
+        // (an operator is read in full, since its token is a static string anyway)
+        kind = TOKEN_WORD;
+        if (char_class[(unsigned char) *lx.r] == CHAR_SPACE) {
+            lx.r++;
+        } else if (*lx.r != '\0') {
+            kind = lex_operator(&lx.r);
+        }
+        *lx.w = '\0';
+        if ((lx.spilled ? strvec_add(tokens, lx.word) : strvec_add_ref(tokens, lx.word)) == -1 ||
+            (kind != TOKEN_WORD && strvec_add_ref(tokens, (char *) operator_text[kind]) == -1)) {
             fprintf(stderr, "Failed to add token to tokens vector\n");
             return -1;
         }
-        token = strtok(NULL, " ");    // call strtok repeatedly until NULL is returned
+    }
+}
+
+token_kind_t token_kind(const char *tok) {
+    // Compared as integers, since tok usually points somewhere else entirely
+    uintptr_t offset = (uintptr_t) tok - (uintptr_t) operator_text;
+    if (offset >= sizeof(operator_text) || offset % sizeof(operator_text[0]) != 0) {
+        return TOKEN_WORD;
+    }
+    return offset / sizeof(operator_text[0]);
+}
+
+/*
+ * Returns 1 if tok separates two pipeline stages ("|" or "|&"), 0 otherwise
+ */
+static int is_pipe_token(const char *tok) {
+    token_kind_t kind = token_kind(tok);
+    return kind == TOKEN_PIPE || kind == TOKEN_PIPE_ALL;
+}
+
+/*
+ * Returns 1 if tok is a file redirection operator ("<", ">", ">>", "2>", or "2>>"), 0 otherwise
+ */
+static int is_redirect_token(const char *tok) {
+    return token_kind(tok) >= TOKEN_REDIRECT_IN;
+}
+
+int run_command(strvec_t *tokens, pid_t pgid) {
+    // join the requested process group, or lead a new one named after the child's process ID
+    if (setpgid(0, pgid) == -1) {
+        perror("setpgid");
+        return -1;
+    }
+
+    struct sigaction sac;
+
+    sac.sa_handler = SIG_DFL;
+    if (sigfillset(&sac.sa_mask) == -1) {
+        perror("sigfillset");
+        return -1;
+    }
+
+    sac.sa_flags = 0;
+    // set the child’s handlers for SIGTTIN and SIGTTOU back to the default
+    if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+
+    // the shell blocks SIGCHLD for its event loop, which the child must not inherit
+    sigset_t mask;
+    sigemptyset(&mask);
+    if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    // The arguments are the tokens before the first redirection operator
+    unsigned args_end = 0;
+    while (args_end < tokens->length && !is_redirect_token(tokens->data[args_end])) {
+        args_end++;
+    }
+    if (args_end == 0) {
+        fprintf(stderr, "Failed to get token from tokens vector\n");
+        return -1;
+    }
+
+    unsigned i = args_end;
+    while (i < tokens->length) {    // loop that handles the redirection operators if applicable
+        char *redir_token = strvec_get(tokens, i);
+        if (redir_token == NULL) {
+            fprintf(stderr, "Failed to get token from tokens vector");
+        }
+        i++;
+        char *file_name = strvec_get(tokens, i);
+        if (file_name == NULL) {
+            fprintf(stderr, "Failed to get token from tokens vector");
+        }
+        i++;
+        token_kind_t kind = token_kind(redir_token);
+
+        if (kind == TOKEN_REDIRECT_OUT) {    // redirect output
+            int out_fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY,
+                              S_IRUSR | S_IWUSR);    // should overwrite file if it already exists
+            if (out_fd == -1) {
+                perror("Failed to open output file");
+                return -1;
+            } else if (dup2(out_fd, STDOUT_FILENO) == -1) {
+                perror("dup2");
+                close(out_fd);
+                return -1;
+            }
+        } else if (kind == TOKEN_REDIRECT_IN) {    // redirect input
+            int in_fd = open(file_name, O_RDONLY);
+            if (in_fd == -1) {
+                perror("Failed to open input file");
+                return -1;
+            } else if (dup2(in_fd, STDIN_FILENO) == -1) {
+                perror("dup2");
+                close(in_fd);
+                return -1;
+            }
+        } else if (kind == TOKEN_REDIRECT_APPEND) {    // redirect and append output
+            int out_fd = open(file_name, O_CREAT | O_APPEND | O_WRONLY,
+                              S_IRUSR | S_IWUSR);    // should append to file if it already exists
+            if (out_fd == -1) {
+                perror("Failed to open output file");
+                return -1;
+            } else if (dup2(out_fd, STDOUT_FILENO) == -1) {
+                perror("dup2");
+                close(out_fd);
+                return -1;
+            }
+        } else if (kind == TOKEN_REDIRECT_ERR || kind == TOKEN_REDIRECT_ERR_APPEND) {
+            int flags = kind == TOKEN_REDIRECT_ERR ? O_TRUNC : O_APPEND;    // redirect stderr
+            int err_fd = open(file_name, O_CREAT | flags | O_WRONLY, S_IRUSR | S_IWUSR);
+            if (err_fd == -1) {
+                perror("Failed to open output file");
+                return -1;
+            } else if (dup2(err_fd, STDERR_FILENO) == -1) {
+                perror("dup2");
+                close(err_fd);
+                return -1;
+            }
+        }
+    }
+
+    // The vector's own storage is the argument list, ended early if there are redirections. This
+    // is the child's copy, so the tokens after it don't need to be put back
+    char **args = tokens->data;
+    args[args_end] = NULL;
+
+    // The shell has already looked the command up, so its cached path is normally right here
+    const char *path = path_cache_find(args[0]);
+    if (path == NULL) {
+        perror("exec");
+        return -1;
+    }
+    execve(path, args, environ);
+    if (errno == ENOENT && path != args[0]) {    // the cached file has gone, so search again
+        execvp(args[0], args);
+    }
+    perror("exec");
+    return -1;
+}
+
+/*
+ * Convert a status from wait4() into a shell exit status: the process's exit code, or 128 plus the
+ * number of the signal that killed it
+ */
+static int exit_status_of(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/*
+ * Returns 1 if time a is earlier than time b, 0 otherwise
+ */
+static int time_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Add the resources used by a process that has exited to its job's totals
+ */
+static void add_usage(job_usage_t *total, const struct rusage *usage) {
+    timeradd(&total->utime, &usage->ru_utime, &total->utime);
+    timeradd(&total->stime, &usage->ru_stime, &total->stime);
+    if (usage->ru_maxrss > total->maxrss) {
+        total->maxrss = usage->ru_maxrss;
+    }
+    total->nvcsw += usage->ru_nvcsw;
+    total->nivcsw += usage->ru_nivcsw;
+}
+
+void set_launch_mode(launch_mode_t mode) {
+    launch_mode = mode;
+}
+
+void set_interactive(int is_interactive) {
+    interactive = is_interactive;
+}
+
+void set_commands_from_stdin(int from_stdin) {
+    commands_from_stdin = from_stdin;
+}
+
+void set_capture_output(int enabled) {
+    capture_output = enabled;
+}
+
+void set_child_signal_fd(int fd) {
+    child_signal_fd = fd;
+}
+
+int get_last_status(void) {
+    return last_status;
+}
+
+void set_last_status(int status) {
+    last_status = status;
+}
+
+const job_usage_t *get_last_usage(void) {
+    return &last_usage;
+}
+
+int get_last_background_job(void) {
+    return last_background_job;
+}
+
+/*
+ * Returns the flags to open the file named by a redirection operator with, setting *target_fd to
+ * the descriptor that the file replaces, or -1 if kind is not a redirection
+ */
+static int redirect_flags(token_kind_t kind, int *target_fd) {
+    *target_fd = STDOUT_FILENO;
+    switch (kind) {
+    case TOKEN_REDIRECT_OUT:    // redirect output
+        return O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC;
+    case TOKEN_REDIRECT_IN:    // redirect input
+        *target_fd = STDIN_FILENO;
+        return O_RDONLY | O_CLOEXEC;
+    case TOKEN_REDIRECT_APPEND:    // redirect and append output
+        return O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC;
+    case TOKEN_REDIRECT_ERR:    // redirect stderr
+        *target_fd = STDERR_FILENO;
+        return O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC;
+    case TOKEN_REDIRECT_ERR_APPEND:    // redirect and append stderr
+        *target_fd = STDERR_FILENO;
+        return O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Open the files named by the redirection operators in tokens[start, end), for the launched
+ * process to duplicate onto its stdin, stdout, or stderr. Later redirections win, as they would
+ * with dup2() in run_command(). The files are opened close-on-exec, so that the process keeps
+ * only the duplicates
+ * fds, targets: Each file opened is appended to fds, with the descriptor it replaces in targets.
+ *               Both have room for MAX_LAUNCH_FDS entries in all
+ * num_fds: Number of entries in fds and targets, updated as files are opened. The caller must
+ *          close the new descriptors once the process has been launched
+ * Returns 0 on success, or 1 if a file could not be opened or there are more redirections than
+ * fit (already reported), in which case any files opened are closed again
+ */
+static int open_redirects(strvec_t *tokens, unsigned start, unsigned end, int *fds, int *targets,
+                          int *num_fds) {
+    int first_fd = *num_fds;
+    for (unsigned i = start; i + 1 < end; i += 2) {
+        int target_fd;
+        int flags = redirect_flags(token_kind(tokens->data[i]), &target_fd);
+        if (flags == -1) {
+            continue;
+        }
+        int fd = open(tokens->data[i + 1], flags, S_IRUSR | S_IWUSR);
+
+        if (fd == -1 || *num_fds == MAX_LAUNCH_FDS) {
+            if (fd == -1) {
+                perror(target_fd == STDIN_FILENO ? "Failed to open input file"
+                                                 : "Failed to open output file");
+            } else {
+                fprintf(stderr, "Too many redirections, at most %d\n", MAX_LAUNCH_FDS);
+                close(fd);
+            }
+            while (*num_fds > first_fd) {
+                close(fds[--*num_fds]);
+            }
+            return 1;
+        }
+        fds[*num_fds] = fd;
+        targets[(*num_fds)++] = target_fd;
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if any of the redirections in tokens[start, end) names a FIFO. Opening one blocks
+ * until its other end is opened too, which must happen in the child rather than the shell
+ */
+static int redirects_fifo(strvec_t *tokens, unsigned start, unsigned end) {
+    for (unsigned i = start; i + 1 < end; i++) {
+        struct stat st;
+        if (is_redirect_token(tokens->data[i]) && stat(tokens->data[i + 1], &st) == 0 &&
+            S_ISFIFO(st.st_mode)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Initialize spawn attributes so the child joins process group pgid (0 for a new group led by the
+ * child), has its handlers for SIGTTIN and SIGTTOU set back to the default, and does not inherit
+ * any signals the shell has blocked
+ * Returns 0 on success or -1 on error
+ */
+static int init_spawn_attr(posix_spawnattr_t *attr, pid_t pgid) {
+    if (posix_spawnattr_init(attr) != 0) {
+        fprintf(stderr, "Failed to initialize spawn attributes\n");
+        return -1;
+    }
+
+    sigset_t default_signals;
+    sigset_t mask;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGTTIN);
+    sigaddset(&default_signals, SIGTTOU);
+    sigemptyset(&mask);
+    if (posix_spawnattr_setflags(attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                           POSIX_SPAWN_SETSIGMASK) != 0 ||
+        posix_spawnattr_setpgroup(attr, pgid) != 0 ||
+        posix_spawnattr_setsigdefault(attr, &default_signals) != 0 ||
+        posix_spawnattr_setsigmask(attr, &mask) != 0) {
+        fprintf(stderr, "Failed to set spawn attributes\n");
+        posix_spawnattr_destroy(attr);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Launch path with posix_spawn(), or through the zygote in LAUNCH_ZYGOTE mode
+ * args: NULL-terminated argument list
+ * pgid: Process group for the child to join, or 0 to start a new group led by the child
+ * fds, targets: Descriptors to duplicate onto the child's stdin, stdout or stderr, in order
+ * pid: Set to the pid of the child
+ * Returns 0 on success, an errno value if the child could not be started, or -1 on a fatal error
+ */
+static int launch_path(const char *path, char **args, pid_t pgid, const int *fds,
+                       const int *targets, int num_fds, pid_t *pid) {
+    if (launch_mode == LAUNCH_ZYGOTE) {
+        int err;
+        if ((*pid = zygote_spawn(path, args, pgid, fds, targets, num_fds, &err)) != -1) {
+            return *pid == 0 ? err : 0;
+        }
+        // otherwise the zygote is gone, so fall back to posix_spawn()
+    }
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        fprintf(stderr, "Failed to initialize spawn file actions\n");
+        return -1;
+    }
+    for (int i = 0; i < num_fds; i++) {
+        if (posix_spawn_file_actions_adddup2(&actions, fds[i], targets[i]) != 0) {
+            fprintf(stderr, "Failed to add spawn file action\n");
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
+        }
+    }
+    posix_spawnattr_t attr;
+    if (init_spawn_attr(&attr, pgid) == -1) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    int err = posix_spawn(pid, path, &actions, &attr, args, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+/*
+ * Start one pipeline stage with posix_spawn(). glibc creates the child with
+ * clone(CLONE_VM | CLONE_VFORK), so unlike fork() the cost does not grow with the shell's memory
+ * footprint, and exec failures are reported straight back to us. In LAUNCH_ZYGOTE mode the child
+ * is created by the zygote instead (see zygote.h)
+ * tokens: Tokens of the whole pipeline
+ * stage: Where this stage lies within tokens
+ * pgid: Process group for the child to join, or 0 to start a new group led by the child
+ * in_fd, out_fd, err_fd: Pipe ends to use as the child's stdin, stdout, and stderr, or -1 to
+ *                        leave them alone
+ * Returns the pid of the child, 0 if the stage could not be started, or -1 on a fatal error
+ */
+static pid_t spawn_stage(strvec_t *tokens, const stage_t *stage, pid_t pgid, int in_fd,
+                         int out_fd, int err_fd) {
+    // The pipe ends go first, so that redirections take precedence over them
+    int fds[MAX_LAUNCH_FDS];
+    int targets[MAX_LAUNCH_FDS];
+    int num_fds = 0;
+    if (in_fd != -1) {
+        fds[num_fds] = in_fd;
+        targets[num_fds++] = STDIN_FILENO;
+    }
+    if (out_fd != -1) {
+        fds[num_fds] = out_fd;
+        targets[num_fds++] = STDOUT_FILENO;
+    }
+    if (err_fd != -1) {
+        fds[num_fds] = err_fd;
+        targets[num_fds++] = STDERR_FILENO;
+    }
+    int num_pipe_fds = num_fds;
+
+    pid_t pid = 0;
+    not_started_status = STATUS_NOT_STARTED;
+    if (open_redirects(tokens, stage->args_end, stage->end, fds, targets, &num_fds) != 0) {
+        not_started_status = STATUS_REDIRECT_FAILED;
+    } else {
+        // The arguments are passed straight from the vector's storage, with the token after them
+        // swapped for a NULL until the child has been started
+        char **args = tokens->data + stage->start;
+        char *after_args = tokens->data[stage->args_end];
+        tokens->data[stage->args_end] = NULL;
+        // PATH is only searched the first time a command is run, rather than with failed execs
+        // on every launch as posix_spawnp() would
+        const char *path = path_cache_find(args[0]);
+        int err = path == NULL ? errno : launch_path(path, args, pgid, fds, targets, num_fds, &pid);
+        if (err == ENOENT && path != NULL && path != args[0]) {
+            // the cached file has been removed or moved since, so look for it again
+            path_cache_forget(args[0]);
+            path = path_cache_find(args[0]);
+            err = path == NULL ? errno : launch_path(path, args, pgid, fds, targets, num_fds, &pid);
+        }
+        tokens->data[stage->args_end] = after_args;
+        if (err == -1) {
+            pid = -1;
+        } else if (err != 0) {
+            fprintf(stderr, "exec: %s\n", strerror(err));
+            pid = 0;
+        }
+    }
+
+    for (int j = num_pipe_fds; j < num_fds; j++) {
+        close(fds[j]);
+    }
+    return pid;
+}
+
+/*
+ * Start one pipeline stage by forking the shell and calling run_command() in the child. This is
+ * the fallback for systems where posix_spawn() is not usable (see set_launch_mode()), and how
+ * processes are given limits before they execute anything
+ * Takes the same arguments as spawn_stage(), plus the job list so the child can free it, and:
+ * memory_rlimit: RLIMIT_AS for the child, or 0 to leave it as the shell's
+ * Returns the pid of the child, or -1 on a fatal error
+ */
+static pid_t fork_stage(strvec_t *tokens, job_list_t *jobs, const stage_t *stage, pid_t pgid,
+                        int in_fd, int out_fd, int err_fd, long long memory_rlimit) {
+    unsigned start = stage->start;
+    unsigned end = stage->end;
+    // Look the command up before forking, so the result stays cached for later launches and the
+    // child finds it already there
+    path_cache_find(tokens->data[start]);
+    pid_t pid = fork();
+    if (pid < 0) {    // an error occurred
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {    // child process
+        if ((in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) ||
+            (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1) ||
+            (err_fd != -1 && dup2(err_fd, STDERR_FILENO) == -1)) {
+            perror("dup2");
+            exit(1);
+        }
+        struct rlimit limit = {memory_rlimit, memory_rlimit};
+        if (memory_rlimit > 0 && setrlimit(RLIMIT_AS, &limit) == -1) {
+            perror("setrlimit");
+            exit(1);
+        }
+
+        strvec_t stage;
+        strvec_init_arena(&stage);
+        for (unsigned i = start; i < end; i++) {
+            if (strvec_add_ref(&stage, tokens->data[i]) == -1) {
+                fprintf(stderr, "Failed to add token to stage vector\n");
+                break;
+            }
+        }
+        if (stage.length == end - start) {
+            run_command(&stage, pgid);
+        }
+        strvec_clear(&stage);
+        strvec_clear(tokens);
+        job_list_free(jobs);
+        exit(1);
+    }
+
+    // parent process
+    // Also set the group from the parent so it exists before we hand over the terminal. This
+    // fails harmlessly with EACCES if the child has already exec'd (and so set it itself)
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+/*
+ * Report an error as perror() would, from a child of cgroup_stage(). strerrordesc_np() only looks
+ * the message up in a table, and the message goes out in a single writev()
+ */
+static void child_perror(const char *what) {
+    const char *desc = strerrordesc_np(errno);
+    if (desc == NULL) {
+        desc = "Unknown error";
+    }
+    struct iovec parts[] = {
+        {(char *) what, strlen(what)}, {": ", 2}, {(char *) desc, strlen(desc)}, {"\n", 1},
+    };
+    writev(STDERR_FILENO, parts, 4);
+}
+
+/*
+ * Start one pipeline stage in a job's cgroup, with cgroup_fork(). The child is made with a bare
+ * clone3() rather than glibc's fork(), so it may only make async-signal-safe calls until it
+ * execs: everything that allocates is done here first, and the child opens its redirections and
+ * reports errors with plain system calls. Opening the redirections in the child keeps a FIFO from
+ * blocking the shell
+ * Takes the same arguments as fork_stage(), plus:
+ * cgroup_fd: Cgroup to create the child in (see cgroup.h)
+ * Returns the pid of the child, 0 if the stage could not be started, or -1 on a fatal error
+ */
+static pid_t cgroup_stage(strvec_t *tokens, const stage_t *stage, pid_t pgid, int in_fd,
+                          int out_fd, int err_fd, int cgroup_fd, long long memory_rlimit) {
+    not_started_status = STATUS_NOT_STARTED;
+    char **args = tokens->data + stage->start;
+    const char *path = path_cache_find(args[0]);
+    if (path == NULL) {
+        perror("exec");
+        return 0;
+    }
+    struct sigaction sac;
+    memset(&sac, 0, sizeof(sac));
+    sac.sa_handler = SIG_DFL;
+    sigfillset(&sac.sa_mask);
+    sigset_t mask;
+    sigemptyset(&mask);
+    struct rlimit limit = {memory_rlimit, memory_rlimit};
+
+    pid_t pid = cgroup_fork(cgroup_fd);
+    if (pid < 0) {    // an error occurred
+        perror("clone3");
+        return -1;
+    } else if (pid == 0) {    // child process: only async-signal-safe calls from here on
+        if (setpgid(0, pgid) == -1) {
+            child_perror("setpgid");
+            _exit(STATUS_NOT_STARTED);
+        }
+        // the same signal handling as run_command() sets up
+        if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1 ||
+            sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
+            child_perror("sigaction");
+            _exit(STATUS_NOT_STARTED);
+        }
+        if ((in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) ||
+            (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1) ||
+            (err_fd != -1 && dup2(err_fd, STDERR_FILENO) == -1)) {
+            child_perror("dup2");
+            _exit(STATUS_NOT_STARTED);
+        }
+        if (memory_rlimit > 0 && setrlimit(RLIMIT_AS, &limit) == -1) {
+            child_perror("setrlimit");
+            _exit(STATUS_NOT_STARTED);
+        }
+        for (unsigned i = stage->args_end; i + 1 < stage->end; i += 2) {
+            int target_fd;
+            int flags = redirect_flags(token_kind(tokens->data[i]), &target_fd);
+            int fd = flags == -1 ? -1 : open(tokens->data[i + 1], flags, S_IRUSR | S_IWUSR);
+            if (flags != -1 && (fd == -1 || dup2(fd, target_fd) == -1)) {
+                child_perror(target_fd == STDIN_FILENO ? "Failed to open input file"
+                                                       : "Failed to open output file");
+                _exit(STATUS_REDIRECT_FAILED);
+            }
+        }
+        // This is the child's copy of the tokens, so the token after the arguments stays NULL
+        tokens->data[stage->args_end] = NULL;
+        execve(path, args, environ);
+        child_perror("exec");
+        _exit(STATUS_NOT_STARTED);
+    }
+
+    // parent process: set the group here too, as fork_stage() does
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+/*
+ * Returns 1 if tokens[0, len) form a pipeline with no empty stages, 0 for e.g. "| wc", "ls |" or
+ * "ls | | wc", or for a list of commands separated by ';', which only a command plan can run (see
+ * plan.h)
+ */
+static int valid_pipeline(char **tokens, unsigned len) {
+    for (unsigned i = 0; i < len; i++) {
+        if (is_pipe_token(tokens[i]) && (i == 0 || i == len - 1 || is_pipe_token(tokens[i + 1]))) {
+            return 0;
+        } else if (token_kind(tokens[i]) == TOKEN_SEPARATOR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Find where the pipeline stage starting at tokens[start] ends, and where its redirections begin
+ * stage: Filled in for the stage
+ */
+static void scan_stage(char **tokens, unsigned len, unsigned start, stage_t *stage) {
+    unsigned i = start;
+    while (i < len && !is_pipe_token(tokens[i]) && !is_redirect_token(tokens[i])) {
+        i++;
+    }
+    stage->start = start;
+    stage->args_end = i;
+    while (i < len && !is_pipe_token(tokens[i])) {
+        i++;
+    }
+    stage->end = i;
+}
+
+unsigned find_stages(char **tokens, unsigned len, stage_t *stages) {
+    if (!valid_pipeline(tokens, len)) {
+        return 0;
+    }
+    unsigned num_stages = 0;
+    unsigned start = 0;
+    do {
+        stage_t *stage = &stages[num_stages++];
+        scan_stage(tokens, len, start, stage);
+        if (stage->end == stage->start) {
+            return 0;
+        }
+        start = stage->end + 1;
+    } while (start <= len);
+    return num_stages;
+}
+
+/*
+ * Set a new job's limits in its cgroup, falling back to setrlimit() for a memory limit the cgroup
+ * can't take. A CPU limit has no fallback, so the job runs without one
+ * cgroup_fd: The job's cgroup, or -1 if it has none
+ * Returns the RLIMIT_AS to give each of the job's processes, or 0 for none
+ */
+static long long apply_limits(int cgroup_fd, const job_limits_t *limits) {
+    if (limits->cpu_quota > 0 &&
+        (cgroup_fd == -1 || cgroup_set_cpu_max(cgroup_fd, limits->cpu_quota) == -1)) {
+        fprintf(stderr, "limit: CPU limits need the cgroup cpu controller, so none is set\n");
+    }
+    if (limits->memory_max > 0 &&
+        (cgroup_fd == -1 || cgroup_set_memory_max(cgroup_fd, limits->memory_max) == -1)) {
+        return limits->memory_max;
+    }
+    return 0;
+}
+
+/*
+ * Start every stage of a pipeline as part of a job, connecting neighbouring stages with a pipe
+ * tokens: The pipeline, which must have passed valid_pipeline()
+ * jobs: List of jobs currently stopped or running in the background
+ * job_id: ID of the job whose process group the stages join, or -1 to register a new job (named
+ *         after the first command) as soon as its first stage is running. This is then set to the
+ *         new job's ID, or stays -1 if no stage could be started
+ * status: Status of the new job, if one is registered
+ * output_fd: Descriptor for every stage's stderr and the last stage's stdout, or -1 to leave them
+ *            as the shell's
+ * stages: Where each stage lies, from find_stages(), or NULL to find them as they are started
+ * limits: Limits for a new job's processes, or NULL for none
+ * Returns the pid of the last stage, 0 if it could not be started (already reported), or -1 on a
+ * fatal error
+ */
+static pid_t start_stages(strvec_t *tokens, job_list_t *jobs, int *job_id, job_status_t status,
+                          int output_fd, const stage_t *stages, const job_limits_t *limits) {
+    // process group of the job, set to the pid of the first stage of a new job
+    pid_t pgid = *job_id == -1 ? 0 : job_list_get(jobs, *job_id)->pid;
+    // A new job's cgroup is made before its first process, which is created in it
+    int cgroup_fd = *job_id == -1 ? -1 : job_list_get(jobs, *job_id)->cgroup_fd;
+    unsigned cgroup_id = 0;
+    if (*job_id == -1 && cgroup_enabled()) {
+        cgroup_fd = cgroup_create(&cgroup_id);
+    }
+    long long memory_rlimit = limits != NULL ? apply_limits(cgroup_fd, limits) : 0;
+    pid_t pid = 0;
+    int in_fd = -1;    // read end of the pipe from the previous stage, if any
+    unsigned start = 0;
+    for (unsigned n = 0; start < tokens->length; n++) {
+        stage_t scanned;
+        const stage_t *stage = stages != NULL ? &stages[n] : &scanned;
+        if (stages == NULL) {
+            scan_stage(tokens->data, tokens->length, start, &scanned);
+        }
+        unsigned end = stage->end;
+
+        // Stages are connected directly by a kernel pipe, so their data never passes through the
+        // shell. Close-on-exec keeps later stages from inheriting ends they don't use
+        int pipe_fds[2] = {-1, -1};
+        if (end < tokens->length && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            if (in_fd != -1) {
+                close(in_fd);
+            }
+            if (*job_id == -1 && cgroup_fd != -1) {
+                cgroup_remove(cgroup_fd, cgroup_id);
+            }
+            return -1;
+        }
+
+        int out_fd = end < tokens->length ? pipe_fds[1] : output_fd;
+        int merge_stderr =
+            end < tokens->length && token_kind(tokens->data[end]) == TOKEN_PIPE_ALL;
+        int err_fd = merge_stderr ? pipe_fds[1] : output_fd;
+        // Spawned processes get their redirections opened by the shell, so a FIFO needs fork() (or
+        // a cgroup's clone, whose child opens its own). The zygote has an affinity of its own, so a
+        // pinned job's processes come from the shell
+        if (cgroup_fd != -1) {
+            pid = cgroup_stage(tokens, stage, pgid, in_fd, out_fd, err_fd, cgroup_fd,
+                               memory_rlimit);
+        } else if (launch_mode == LAUNCH_FORK || memory_rlimit > 0 ||
+                   (launch_mode == LAUNCH_ZYGOTE && limits != NULL && limits->cpus != NULL) ||
+                   redirects_fifo(tokens, stage->args_end, end)) {
+            pid = fork_stage(tokens, jobs, stage, pgid, in_fd, out_fd, err_fd, memory_rlimit);
+        } else {
+            pid = spawn_stage(tokens, stage, pgid, in_fd, out_fd, err_fd);
+        }
+        int failed = pid == -1;
+        if (pid > 0) {
+            if (*job_id == -1) {
+                pgid = pid;
+                *job_id = job_list_add(jobs, pid, strvec_get(tokens, 0), status);
+                failed = *job_id == -1;
+                if (!failed) {
+                    job_list_get(jobs, *job_id)->cgroup_fd = cgroup_fd;
+                    job_list_get(jobs, *job_id)->cgroup_id = cgroup_id;
+                }
+            } else {
+                failed = job_list_add_pid(jobs, *job_id, pid) == -1;
+            }
+            if (failed) {
+                printf("Failed to add to job list\n");
+            }
+        }
+
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (pipe_fds[1] != -1) {
+            close(pipe_fds[1]);
+        }
+        in_fd = pipe_fds[0];
+        if (failed) {
+            if (in_fd != -1) {
+                close(in_fd);
+            }
+            return -1;
+        }
+        start = end + 1;
+    }
+    if (*job_id == -1 && cgroup_fd != -1) {    // no stage started, so there is no job to own it
+        cgroup_remove(cgroup_fd, cgroup_id);
+    }
+    return pid;
+}
+
+#define MAX_FAILED_STATUS 101    // a batch's exit status is its number of failed runs, up to this
+
+/*
+ * A parallel batch: a command run once for each item, or once for each run of items packed into
+ * its arguments, with at most max_running runs in flight (see run_parallel() and run_xargs()).
+ * The whole batch is a single allocation, laid out as this header, the template and item
+ * pointers, the running and run_ends arrays, and then the strings they point to
+ */
+typedef struct batch {
+    char **template;          // command to run, with every "{}" in it replaced by the item
+    unsigned template_len;
+    int has_placeholder;      // 0 if no token contains "{}", in which case the items are appended
+    char **items;
+    unsigned num_items;
+    unsigned next_item;       // index of the first item of the next run
+    unsigned *run_ends;       // run i has the items before run_ends[i], or NULL for one item each
+    unsigned num_runs;
+    unsigned next_run;        // index of the next run to start
+    pid_t *running;           // pid of the last stage of each run in flight, or 0 for a free slot
+    unsigned max_running;
+    unsigned num_running;
+    unsigned num_failed;      // runs that exited with a nonzero status or could not be started
+    int holder_exited;        // the process holding the job's process group is gone
+} batch_t;
+
+/*
+ * Copy n strings into consecutive memory starting at 'strings', pointing dst[i] at each copy
+ * Operators are static strings (see token_kind()), so they are pointed at rather than copied
+ * Returns the first byte after the copies
+ */
+static char *copy_strings(char **dst, char *const *src, unsigned n, char *strings) {
+    for (unsigned i = 0; i < n; i++) {
+        if (token_kind(src[i]) != TOKEN_WORD) {
+            dst[i] = src[i];
+            continue;
+        }
+        dst[i] = strings;
+        strings = stpcpy(strings, src[i]) + 1;
+    }
+    return strings;
+}
+
+/*
+ * Allocate a batch that runs template_len tokens once for each of num_items items, or with the
+ * items packed into runs
+ * run_ends: End of each run's items (see batch_t), or NULL for one item per run
+ * num_runs: Number of runs, which is num_items without run_ends
+ * Returns the batch, to be freed with free(), or NULL on error
+ */
+static batch_t *batch_alloc(char *const *template, unsigned template_len, char *const *items,
+                            unsigned num_items, const unsigned *run_ends, unsigned num_runs,
+                            unsigned max_running) {
+    size_t size = sizeof(batch_t) + (template_len + num_items) * sizeof(char *) +
+                  max_running * sizeof(pid_t);
+    if (run_ends != NULL) {
+        size += num_runs * sizeof(unsigned);
+    }
+    for (unsigned i = 0; i < template_len; i++) {
+        size += strlen(template[i]) + 1;
+    }
+    for (unsigned i = 0; i < num_items; i++) {
+        size += strlen(items[i]) + 1;
+    }
+    batch_t *batch = malloc(size);
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    batch->template = (char **) (batch + 1);
+    batch->items = batch->template + template_len;
+    batch->running = (pid_t *) (batch->items + num_items);
+    batch->run_ends = NULL;
+    char *strings = (char *) (batch->running + max_running);
+    if (run_ends != NULL) {
+        batch->run_ends = (unsigned *) strings;
+        memcpy(batch->run_ends, run_ends, num_runs * sizeof(unsigned));
+        strings = (char *) (batch->run_ends + num_runs);
+    }
+    strings = copy_strings(batch->template, template, template_len, strings);
+    copy_strings(batch->items, items, num_items, strings);
+    memset(batch->running, 0, max_running * sizeof(pid_t));
+
+    batch->template_len = template_len;
+    batch->has_placeholder = 0;
+    for (unsigned i = 0; i < template_len && run_ends == NULL; i++) {
+        if (strstr(template[i], "{}") != NULL) {
+            batch->has_placeholder = 1;
+        }
+    }
+    batch->num_items = num_items;
+    batch->next_item = 0;
+    batch->num_runs = num_runs;
+    batch->next_run = 0;
+    batch->max_running = max_running;
+    batch->num_running = 0;
+    batch->num_failed = 0;
+    batch->holder_exited = 0;
+    return batch;
+}
+
+/*
+ * Returns a copy of tok, to be freed with free(), with every "{}" replaced by item, or NULL on
+ * error
+ */
+static char *substitute(const char *tok, const char *item) {
+    size_t item_len = strlen(item);
+    size_t len = strlen(tok);
+    for (const char *mark = strstr(tok, "{}"); mark != NULL; mark = strstr(mark + 2, "{}")) {
+        len += item_len;
+    }
+    char *s = malloc(len + 1);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    char *out = s;
+    const char *mark;
+    while ((mark = strstr(tok, "{}")) != NULL) {
+        out = mempcpy(out, tok, mark - tok);
+        out = mempcpy(out, item, item_len);
+        tok = mark + 2;
+    }
+    strcpy(out, tok);
+    return s;
+}
+
+/*
+ * Fill cmd with the command for the next run of a batch, and move on to the run after it
+ * Tokens that don't change are added by reference, so they must outlive cmd
+ * Returns 0 on success or -1 on error
+ */
+static int build_run_command(batch_t *batch, strvec_t *cmd) {
+    char *item = batch->items[batch->next_item];
+    unsigned end = batch->next_item + 1;
+    if (batch->run_ends != NULL) {
+        end = batch->run_ends[batch->next_run];
+    }
+    batch->next_run++;
+    for (unsigned i = 0; i < batch->template_len; i++) {
+        char *tok = batch->template[i];
+        int result;
+        if (strstr(tok, "{}") == NULL || batch->run_ends != NULL) {
+            result = strvec_add_ref(cmd, tok);
+        } else if (strcmp(tok, "{}") == 0) {
+            result = strvec_add_ref(cmd, item);
+        } else {
+            char *s = substitute(tok, item);
+            result = s == NULL ? -1 : strvec_add(cmd, s);
+            free(s);
+        }
+        if (result == -1) {
+            return -1;
+        }
+    }
+    if (batch->has_placeholder) {
+        batch->next_item = end;
+        return 0;
+    }
+    for (; batch->next_item < end; batch->next_item++) {
+        if (strvec_add_ref(cmd, batch->items[batch->next_item]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start runs of a job's batch until max_running of them are in flight or none are left
+ * Each run is a pipeline in the job's process group. Runs that can't be started count as failed
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int batch_fill(job_list_t *jobs, job_t *job) {
+    batch_t *batch = job->batch;
+    int job_id = job->id;
+    strvec_t cmd;
+    if (strvec_init_arena(&cmd) == -1) {
+        fprintf(stderr, "Failed to initialize command vector\n");
+        return -1;
+    }
+
+    while (!batch->holder_exited && batch->num_running < batch->max_running &&
+           batch->next_run < batch->num_runs) {
+        strvec_reset(&cmd);
+        if (build_run_command(batch, &cmd) == -1) {
+            fprintf(stderr, "Failed to build command for item\n");
+            strvec_clear(&cmd);
+            return -1;
+        }
+        pid_t pid = start_stages(&cmd, jobs, &job_id, BACKGROUND, -1, NULL, NULL);
+        if (pid == -1) {
+            strvec_clear(&cmd);
+            return -1;
+        } else if (pid == 0) {
+            batch->num_failed++;
+        } else {
+            unsigned i = 0;
+            while (batch->running[i] != 0) {
+                i++;
+            }
+            batch->running[i] = pid;
+            batch->num_running++;
+        }
+    }
+    strvec_clear(&cmd);
+    return 0;
+}
+
+/*
+ * Start more of a job's batch runs if it has free slots (unless the job is stopped), and finish
+ * the batch once none of its runs are left. Finishing kills the process holding the job's process
+ * group, so the job ends once that has been reaped, and sets the job's exit status to the number
+ * of failed runs
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int batch_update(job_list_t *jobs, job_t *job) {
+    batch_t *batch = job->batch;
+    if (job->status != STOPPED && batch_fill(jobs, job) == -1) {
+        return -1;
+    }
+    if (batch->num_running > 0 || (!batch->holder_exited && batch->next_run < batch->num_runs)) {
+        return 0;
+    }
+
+    if (!batch->holder_exited && kill(job->pid, SIGKILL) == -1) {
+        perror("kill");
+        return -1;
+    }
+    // runs that were never started (because the batch was interrupted) count as failed
+    unsigned num_failed = batch->num_failed + batch->num_runs - batch->next_run;
+    job->exit_status = num_failed < MAX_FAILED_STATUS ? num_failed : MAX_FAILED_STATUS;
+    free(batch);
+    job->batch = NULL;
+    return 0;
+}
+
+/*
+ * Record that a process of a job with a batch has exited, and start the next runs in its place
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int batch_child_exited(job_list_t *jobs, job_t *job, pid_t pid, int status) {
+    batch_t *batch = job->batch;
+    if (pid == job->pid) {
+        // The holder was killed (e.g., by ^C), so the process group may be gone. Runs still
+        // running are waited for, but no more are started
+        batch->holder_exited = 1;
+    }
+    for (unsigned i = 0; i < batch->max_running; i++) {
+        if (batch->running[i] == pid) {
+            batch->running[i] = 0;
+            batch->num_running--;
+            if (status != 0) {
+                batch->num_failed++;
+            }
+            break;
+        }
+    }
+    return batch_update(jobs, job);
+}
+
+/*
+ * Start ready nodes of a job's graph until max_running of them are in flight or none are ready
+ * Each node's command runs as a pipeline in the job's process group, with its wildcards expanded
+ * only now, so that they match files made by the nodes it depends on. A node without a command
+ * succeeds at once, and one that can't be started fails at once
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int graph_fill(job_list_t *jobs, job_t *job) {
+    graph_t *graph = job->graph;
+    int job_id = job->id;
+    strvec_t cmd;
+    if (strvec_init_arena(&cmd) == -1) {
+        fprintf(stderr, "Failed to initialize command vector\n");
+        return -1;
+    }
+
+    int node;
+    while (!graph->holder_exited && (node = graph_take_ready(graph)) != -1) {
+        graph_node_t *current = &graph->nodes[node];
+        strvec_reset(&cmd);
+        for (unsigned i = 0; i < current->num_tokens; i++) {
+            if (strvec_add_ref(&cmd, graph->tokens.data[current->first_token + i]) == -1) {
+                fprintf(stderr, "Failed to add token to command vector\n");
+                strvec_clear(&cmd);
+                return -1;
+            }
+        }
+        if (wildcard_expand(&cmd) == -1) {
+            fprintf(stderr, "Failed to expand wildcards\n");
+            strvec_clear(&cmd);
+            return -1;
+        }
+        pid_t pid = 0;
+        if (cmd.length > 0) {
+            pid = start_stages(&cmd, jobs, &job_id, BACKGROUND, -1, NULL, NULL);
+        }
+        if (pid == -1) {
+            strvec_clear(&cmd);
+            return -1;
+        }
+        current->pid = pid;
+        if (pid == 0) {
+            graph_node_done(graph, node, cmd.length == 0 ? 0 : STATUS_NOT_STARTED);
+        }
+    }
+    strvec_clear(&cmd);
+    return 0;
+}
+
+/*
+ * Start more of a job's graph nodes if it has free slots (unless the job is stopped), and finish
+ * the graph once nothing is running and nothing more can start. Finishing kills the process
+ * holding the job's process group, and sets the job's exit status to the number of nodes that
+ * failed or never ran. The graph itself is kept, so that jobs can list the nodes that failed
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int graph_update(job_list_t *jobs, job_t *job) {
+    graph_t *graph = job->graph;
+    if (graph->finished) {
+        return 0;
+    }
+    if (job->status != STOPPED && graph_fill(jobs, job) == -1) {
+        return -1;
+    }
+    if (graph->num_running > 0 || (!graph->holder_exited && graph->num_ready > 0)) {
+        return 0;
+    }
+
+    if (!graph->holder_exited && kill(job->pid, SIGKILL) == -1) {
+        perror("kill");
+        return -1;
+    }
+    // Nodes behind a failed one never become ready, nor do any left when the graph is interrupted
+    for (unsigned i = 0; i < graph->num_nodes; i++) {
+        if (graph->nodes[i].state == NODE_WAITING || graph->nodes[i].state == NODE_READY) {
+            graph->num_unrun++;
+        }
+    }
+    unsigned num_failed = graph->num_failed + graph->num_unrun;
+    job->exit_status = num_failed < MAX_FAILED_STATUS ? num_failed : MAX_FAILED_STATUS;
+    graph->finished = 1;
+    if (job->status == FOREGROUND && num_failed > 0) {
+        // The job is removed as soon as it finishes, so this is the only chance to say what failed
+        fprintf(stderr, "run-graph: %u failed, %u not run:", graph->num_failed, graph->num_unrun);
+        unsigned pos = 0;
+        const graph_node_t *node;
+        while ((node = graph_next_failed(graph, &pos)) != NULL) {
+            fprintf(stderr, " %s (%d)", node->target, node->exit_status);
+        }
+        fprintf(stderr, "\n");
+    }
+    return 0;
+}
+
+/*
+ * Record that a process of a job with a graph has exited. If it ran a node's command, the node's
+ * successors may become ready, and are started right away
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int graph_child_exited(job_list_t *jobs, job_t *job, pid_t pid, int status) {
+    graph_t *graph = job->graph;
+    if (pid == job->pid) {
+        // As for a batch, nodes still running are waited for, but no more are started
+        graph->holder_exited = 1;
+    }
+    int node = graph_find_pid(graph, pid);
+    if (node != -1) {
+        graph_node_done(graph, node, status);
+    }
+    return graph_update(jobs, job);
+}
+
+/*
+ * Fork a process that does nothing but lead a new process group until it is killed. A parallel
+ * batch starts its items in this group, so the group outlives any one item and the batch can be
+ * stopped, resumed, and given the terminal as a unit
+ * Returns the pid of the process, or -1 on error
+ */
+static pid_t start_group_holder(void) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {    // child process
+        setpgid(0, 0);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        while (1) {
+            pause();
+        }
+    }
+
+    // parent process: set the group here too, so it exists before any item tries to join it
+    setpgid(pid, pid);
+    return pid;
+}
+
+/*
+ * Update the job list for a child process that has exited or stopped, as reported by wait4()
+ * A job whose processes have all exited becomes DONE. If the job is running a parallel batch or a
+ * graph, its next items or nodes are started right away
+ * pid, status, usage: The process and what wait4() reported about it
+ * Returns 0 on success or -1 on a fatal error
+ */
+static int handle_child_event(job_list_t *jobs, pid_t pid, int status, const struct rusage *usage) {
+    if (WIFSTOPPED(status)) {
+        job_t *job = job_list_find_pid(jobs, pid);
+        if (job != NULL) {
+            job->status = STOPPED;
+        }
+        return 0;
+    }
+
+    job_t *job = job_list_remove_pid(jobs, pid);
+    if (job == NULL) {
+        return 0;
+    }
+    add_usage(&job->usage, usage);
+    if (pid == job->last_pid) {
+        job->exit_status = exit_status_of(status);
+    }
+    if (job->batch != NULL && batch_child_exited(jobs, job, pid, exit_status_of(status)) == -1) {
+        return -1;
+    }
+    if (job->graph != NULL && graph_child_exited(jobs, job, pid, exit_status_of(status)) == -1) {
+        return -1;
+    }
+    if (job->num_procs == 0) {
+        job->status = DONE;
+        if (job->cpus != NULL) {    // the CPUs still show in jobs, but are no longer busy
+            affinity_release(&job->cpus->set);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &job->usage.end);
+        if (job->timed_out) {    // as coreutils timeout reports it, however the job ended
+            job->exit_status = STATUS_TIMED_OUT;
+        }
+        if (job->server_conn != 0) {
+            server_job_done(job);
+        }
+    }
+    return 0;
+}
+
+int deadline_timer_fd(void) {
+    if (timer_fd == -1 &&
+        (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        perror("timerfd_create");
+    }
+    return timer_fd;
+}
+
+/*
+ * Arm the deadline timer for the earliest deadline of any job that has not finished, or disarm it
+ * if there is none
+ * Returns 0 on success or -1 on error
+ */
+static int arm_deadline_timer(job_list_t *jobs) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    for (job_t *job = job_list_next(jobs, 0); job != NULL; job = job_list_next(jobs, job->id + 1)) {
+        int has_deadline = job->deadline.tv_sec != 0 || job->deadline.tv_nsec != 0;
+        if (job->status != DONE && has_deadline &&
+            ((spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) ||
+             time_before(&job->deadline, &spec.it_value))) {
+            spec.it_value = job->deadline;
+        }
+    }
+    timer_armed = spec.it_value.tv_sec != 0 || spec.it_value.tv_nsec != 0;
+    if (deadline_timer_fd() == -1) {
+        return -1;
+    } else if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Give a job a deadline, unless it already has an earlier one
+ * timeout: Time from now until the job is sent SIGTERM
+ * kill_grace: Time from then until it is sent SIGKILL, if it is still running
+ * Returns 0 on success or -1 on error
+ */
+static int set_deadline(job_list_t *jobs, job_t *job, const struct timespec *timeout,
+                        const struct timespec *kill_grace) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout->tv_sec;
+    deadline.tv_nsec += timeout->tv_nsec;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    if (job->timed_out || ((job->deadline.tv_sec != 0 || job->deadline.tv_nsec != 0) &&
+                           time_before(&job->deadline, &deadline))) {
+        return 0;
+    }
+    job->deadline = deadline;
+    job->kill_grace = *kill_grace;
+    return arm_deadline_timer(jobs);
+}
+
+int signal_job(const job_t *job, int sig) {
+    int result = kill(-job->pid, sig);
+    // Processes that have left the job's process group are still in its cgroup
+    if (job->cgroup_fd != -1 && cgroup_signal(job->cgroup_fd, sig) == 0) {
+        result = 0;
+    }
+    return result;
+}
+
+int expire_deadlines(job_list_t *jobs) {
+    // The timer is armed for the earliest deadline, so if it hasn't expired, no deadline has passed
+    uint64_t expirations;
+    if (read(deadline_timer_fd(), &expirations, sizeof(expirations)) == -1) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        perror("read from timerfd");
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (job_t *job = job_list_next(jobs, 0); job != NULL; job = job_list_next(jobs, job->id + 1)) {
+        if (job->status == DONE || (job->deadline.tv_sec == 0 && job->deadline.tv_nsec == 0) ||
+            time_before(&now, &job->deadline)) {
+            continue;
+        }
+        if (job->timed_out == 0) {
+            // A stopped job is continued, so that it can act on SIGTERM
+            signal_job(job, SIGTERM);
+            signal_job(job, SIGCONT);
+            job->timed_out = SIGTERM;
+            job->deadline.tv_sec = now.tv_sec + job->kill_grace.tv_sec;
+            job->deadline.tv_nsec = now.tv_nsec + job->kill_grace.tv_nsec;
+            if (job->deadline.tv_nsec >= 1000000000) {
+                job->deadline.tv_sec++;
+                job->deadline.tv_nsec -= 1000000000;
+            }
+        } else {
+            signal_job(job, SIGKILL);
+            job->timed_out = SIGKILL;
+            memset(&job->deadline, 0, sizeof(struct timespec));
+        }
+    }
+    return arm_deadline_timer(jobs);
+}
+
+/*
+ * Consume the pending SIGCHLD notifications from child_signal_fd, so that polling it blocks again
+ */
+static void consume_child_signal(void) {
+    struct signalfd_siginfo info;
+    while (read(child_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+}
+
+/*
+ * Block until a child may have changed state, meanwhile draining captured output and signalling
+ * jobs that run past their deadlines. Without a signalfd to poll, this returns after a few
+ * milliseconds at most
+ * Returns 0 on success or -1 on error
+ */
+static int wait_for_event(job_list_t *jobs) {
+    struct pollfd fds[3] = {
+        {child_signal_fd, POLLIN, 0},
+        {capture_active() > 0 ? capture_poll_fd() : -1, POLLIN, 0},
+        {timer_armed ? timer_fd : -1, POLLIN, 0},
+    };
+    if (poll(fds, 3, child_signal_fd == -1 ? POLL_INTERVAL_MS : -1) == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+    if (fds[0].revents != 0) {
+        consume_child_signal();    // wait4() is about to act on it
+    }
+    if (fds[1].revents != 0 && capture_drain() == -1) {
+        return -1;
+    }
+    if (fds[2].revents != 0 && expire_deadlines(jobs) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Block in wait4() until any child exits or stops
+ * While any captured output pipe is open or any job has a deadline, the wait is done by polling
+ * instead (see wait_for_event()), so that jobs never block on a full capture pipe and deadlines are
+ * enforced on time
+ * Returns the pid of the child, or -1 on error
+ */
+static pid_t wait_child(job_list_t *jobs, int *status, int options, struct rusage *usage) {
+    while (capture_active() > 0 || timer_armed) {
+        pid_t pid = wait4(-1, status, options | WNOHANG, usage);
+        if (pid != 0) {
+            return pid;
+        }
+        if (wait_for_event(jobs) == -1) {
+            return -1;
+        }
+    }
+    return wait4(-1, status, options, usage);
+}
+
+/*
+ * Block until every remaining process in a job has either exited or stopped
+ * Processes that exit are removed from the job (see job_list_remove_pid()). Other jobs are updated
+ * too while we wait, so that their parallel batches keep starting items
+ * jobs: List containing the job
+ * job: The job to wait for
+ * Returns 1 if the job was stopped, 0 if all of its processes exited, or -1 on error
+ */
+static int wait_for_job(job_list_t *jobs, job_t *job) {
+    unsigned num_stopped = 0;
+    while (num_stopped < job->num_procs) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait_child(jobs, &status, WUNTRACED, &usage);
+        if (pid == -1) {
+            perror("wait4");
+            return -1;
+        }
+        if (WIFSTOPPED(status) && job_list_find_pid(jobs, pid) == job) {
+            num_stopped++;
+        }
+        if (handle_child_event(jobs, pid, status, &usage) == -1) {
+            return -1;
+        }
+    }
+    return job->num_procs > 0;
+}
+
+/*
+ * Give a newly started job the terminal and wait for it to finish or stop
+ * A job that finishes is removed from the list, and its exit status becomes the shell's
+ * jobs: List containing the job
+ * job_id: ID of the job
+ * Returns 0 on success or -1 on error
+ */
+static int run_in_foreground(job_list_t *jobs, unsigned job_id) {
+    job_t *job = job_list_get(jobs, job_id);
+    // put the job's process group in the foreground
+    if (interactive && tcsetpgrp(STDIN_FILENO, job->pid) == -1) {
+        perror("tcsetpgrp");
+        return -1;
+    }
+    // waits for every process to terminate, or for the job to be stopped
+    int stopped = wait_for_job(jobs, job);
+    if (stopped == -1) {
+        return -1;
+    }
+    if (stopped) {
+        job->status = STOPPED;
+    } else {
+        last_status = job->exit_status;
+        last_usage = job->usage;
+        job_list_remove(jobs, job_id);
+    }
+
+    // restore the shell process to the foreground
+    if (interactive && tcsetpgrp(STDIN_FILENO, getpid()) == -1) {
+        perror("tcsetpgrp");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Launch a valid, non-empty pipeline as a new job, and wait for it unless it is in the background
+ * stages: Where each stage lies, from find_stages(), or NULL to find them while launching
+ * timeout, kill_grace: Deadline of the job, as for run_pipeline_timeout(), or NULL for none
+ * limits: Limits of the job, as for run_pipeline_limits(), or NULL for none
+ * Returns 0 on success or -1 on error
+ */
+static int launch_pipeline(strvec_t *tokens, const stage_t *stages, job_list_t *jobs,
+                           int is_background, const struct timespec *timeout,
+                           const struct timespec *kill_grace, const job_limits_t *limits) {
+    // Output from builtins must appear before anything the job prints, even when stdout is a file
+    // or pipe and therefore fully buffered
+    fflush(stdout);
+
+    // A captured job writes into a pipe that the shell drains into the job's ring buffer
+    capture_t *capture = NULL;
+    int output_fd = -1;
+    if (is_background && capture_output && (capture = capture_open(&output_fd)) == NULL) {
+        return 0;
+    }
+
+    // A new background job is spread over the CPUs by the automatic policy, if there is one,
+    // unless it was pinned already. The job's processes inherit its CPUs from the shell
+    job_limits_t picked;
+    cpu_mask_t cpus;
+    if (is_background && (limits == NULL || limits->cpus == NULL) && affinity_pick(&cpus.set)) {
+        picked = limits != NULL ? *limits : (job_limits_t) {0, 0, NULL};
+        picked.cpus = &cpus;
+        limits = &picked;
+    }
+    // The job keeps its own copy of its CPUs, made before anything is launched
+    cpu_mask_t *job_cpus = NULL;
+    if (limits != NULL && limits->cpus != NULL) {
+        if ((job_cpus = malloc(sizeof(cpu_mask_t))) == NULL) {
+            fprintf(stderr, "Failed to allocate CPU mask\n");
+            if (output_fd != -1) {
+                close(output_fd);
+            }
+            capture_free(capture);
+            return -1;
+        }
+        *job_cpus = *limits->cpus;
+    }
+    cpu_set_t saved_cpus;
+    if (job_cpus != NULL && affinity_enter(&job_cpus->set, &saved_cpus) == -1) {
+        free(job_cpus);
+        if (output_fd != -1) {
+            close(output_fd);
+        }
+        capture_free(capture);
+        last_status = STATUS_NOT_STARTED;
+        return 0;
     }
 
-    return 0;
+    int job_id = -1;    // the job is registered as soon as its first stage is running
+    pid_t pid = start_stages(tokens, jobs, &job_id, is_background ? BACKGROUND : FOREGROUND,
+                             output_fd, stages, limits);
+    if (job_cpus != NULL) {
+        affinity_leave(&saved_cpus);
+    }
+    if (output_fd != -1) {
+        close(output_fd);
+    }
+    if (pid == -1 || job_id == -1) {
+        capture_free(capture);
+        free(job_cpus);
+    }
+    if (pid == -1) {
+        return -1;
+    }
+    if (job_id == -1) {    // every stage failed to start, and has already reported why
+        last_status = not_started_status;
+        return 0;
+    }
+    job_t *job = job_list_get(jobs, job_id);
+    job->last_pid = pid;
+    job->capture = capture;
+    if (job_cpus != NULL) {
+        job->cpus = job_cpus;
+        affinity_claim(&job->cpus->set);
+    }
+    if (pid == 0) {    // the last stage failed to start, so it determines the job's status
+        job->exit_status = not_started_status;
+    }
+    if (timeout != NULL && set_deadline(jobs, job, timeout, kill_grace) == -1) {
+        return -1;
+    }
+    if (is_background) {
+        last_background_job = job_id;
+        return 0;
+    }
+    return run_in_foreground(jobs, job_id);
 }
 
-int run_command(strvec_t *tokens) {
-    pid_t pid = getpid();
-    if (setpgid(pid, pid) == -1) {    // changing child's process group to the child's process ID
-        perror("setpgid");
+int run_pipeline(strvec_t *tokens, job_list_t *jobs, int is_background) {
+    return run_pipeline_timeout(tokens, jobs, is_background, NULL, NULL);
+}
+
+int run_pipeline_timeout(strvec_t *tokens, job_list_t *jobs, int is_background,
+                         const struct timespec *timeout, const struct timespec *kill_grace) {
+    if (is_background) {
+        last_background_job = -1;
+    }
+    // Reject empty stages before launching anything
+    if (!valid_pipeline(tokens->data, tokens->length)) {
+        fprintf(stderr, "Invalid pipeline\n");
+        return 0;
+    }
+    if (tokens->length == 0) {
+        return 0;
+    }
+    return launch_pipeline(tokens, NULL, jobs, is_background, timeout, kill_grace, NULL);
+}
+
+int run_pipeline_limits(strvec_t *tokens, job_list_t *jobs, int is_background,
+                        const job_limits_t *limits) {
+    if (is_background) {
+        last_background_job = -1;
+    }
+    if (!valid_pipeline(tokens->data, tokens->length)) {
+        fprintf(stderr, "Invalid pipeline\n");
+        return 0;
+    }
+    if (tokens->length == 0) {
+        return 0;
+    }
+    return launch_pipeline(tokens, NULL, jobs, is_background, NULL, NULL, limits);
+}
+
+int run_stages(strvec_t *tokens, const stage_t *stages, job_list_t *jobs, int is_background) {
+    if (is_background) {
+        last_background_job = -1;
+    }
+    return launch_pipeline(tokens, stages, jobs, is_background, NULL, NULL, NULL);
+}
+
+int parse_duration(const char *s, struct timespec *duration) {
+    char *end;
+    errno = 0;
+    double seconds = strtod(s, &end);
+    if (end == s || errno != 0 || seconds < 0) {
+        return -1;
+    }
+    // A suffix picks the unit, as with coreutils timeout
+    if (strcmp(end, "m") == 0) {
+        seconds *= 60;
+    } else if (strcmp(end, "h") == 0) {
+        seconds *= 60 * 60;
+    } else if (strcmp(end, "d") == 0) {
+        seconds *= 24 * 60 * 60;
+    } else if (*end != '\0' && strcmp(end, "s") != 0) {
         return -1;
     }
+    if (seconds > INT32_MAX) {
+        return -1;
+    }
+    duration->tv_sec = (time_t) seconds;
+    duration->tv_nsec = (long) ((seconds - duration->tv_sec) * 1e9);
+    if (duration->tv_sec == 0 && duration->tv_nsec == 0) {
+        duration->tv_nsec = 1;    // a zero deadline would mean none at all
+    }
+    return 0;
+}
 
-    struct sigaction sac;
+int simple_command_args(const strvec_t *tokens) {
+    unsigned num_args = 0;
+    while (num_args < tokens->length && !is_redirect_token(tokens->data[num_args])) {
+        if (is_pipe_token(tokens->data[num_args]) ||
+            token_kind(tokens->data[num_args]) == TOKEN_BACKGROUND) {
+            return -1;
+        }
+        num_args++;
+    }
+    // Anything after the first redirection must be more redirections, each with its file
+    for (unsigned i = num_args; i < tokens->length; i += 2) {
+        if (!is_redirect_token(tokens->data[i]) || i + 1 == tokens->length ||
+            is_redirect_token(tokens->data[i + 1]) || is_pipe_token(tokens->data[i + 1]) ||
+            token_kind(tokens->data[i + 1]) == TOKEN_BACKGROUND) {
+            return -1;
+        }
+    }
+    return num_args;
+}
 
-    sac.sa_handler = SIG_DFL;
-    if (sigfillset(&sac.sa_mask) == -1) {
-        perror("sigfillset");
+int apply_redirects(strvec_t *tokens, unsigned start, int *saved_fds) {
+    saved_fds[STDIN_FILENO] = -1;
+    saved_fds[STDOUT_FILENO] = -1;
+    saved_fds[STDERR_FILENO] = -1;
+    int fds[MAX_LAUNCH_FDS];
+    int targets[MAX_LAUNCH_FDS];
+    int num_fds = 0;
+    if (open_redirects(tokens, start, tokens->length, fds, targets, &num_fds) != 0) {
+        last_status = STATUS_REDIRECT_FAILED;
+        return 1;
+    }
+    // Anything already buffered belongs to the shell's own stdout
+    fflush(stdout);
+
+    int result = 0;
+    for (int i = 0; i < num_fds; i++) {
+        int target = targets[i];
+        if (result == 0 && saved_fds[target] == -1 &&
+            (saved_fds[target] = fcntl(target, F_DUPFD_CLOEXEC, STDERR_FILENO + 1)) == -1) {
+            perror("fcntl");
+            result = -1;
+        }
+        if (result == 0 && dup2(fds[i], target) == -1) {
+            perror("dup2");
+            result = -1;
+        }
+        close(fds[i]);
+    }
+    if (result == -1) {
+        restore_redirects(saved_fds);
+    }
+    return result;
+}
+
+void restore_redirects(int *saved_fds) {
+    fflush(stdout);
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+        if (saved_fds[fd] != -1) {
+            if (dup2(saved_fds[fd], fd) == -1) {
+                perror("dup2");
+            }
+            close(saved_fds[fd]);
+            saved_fds[fd] = -1;
+        }
+    }
+}
+
+/*
+ * Read the items of a parallel batch, one per line, skipping empty lines
+ * fd: File descriptor to read the items from
+ * items: Vector to add the items to
+ * Returns 0 on success or -1 on error
+ */
+static int read_items(int fd, strvec_t *items) {
+    line_reader_t reader;
+    if (line_reader_init(&reader, fd, ITEMS_READ_SIZE) == -1) {
+        fprintf(stderr, "Failed to allocate input buffer\n");
         return -1;
     }
+    char *line;
+    int result;
+    while ((result = line_reader_next(&reader, &line)) == 1) {
+        if (line[0] != '\0' && strvec_add(items, line) == -1) {
+            fprintf(stderr, "Failed to add item to items vector\n");
+            result = -1;
+            break;
+        }
+    }
+    line_reader_free(&reader);
+    return result;
+}
 
-    sac.sa_flags = 0;
-    // set the child’s handlers for SIGTTIN and SIGTTOU back to the default
-    if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
-        perror("sigaction");
+/*
+ * Start a batch as a new job, with a process holding its process group, and run it in the
+ * foreground unless is_background is set
+ * name: Name of the job
+ * Returns 0 on success or -1 on failure
+ */
+static int start_batch(batch_t *batch, const char *name, job_list_t *jobs, int is_background) {
+    fflush(stdout);
+
+    pid_t holder = start_group_holder();
+    if (holder == -1) {
+        free(batch);
+        return -1;
+    }
+    int job_id = job_list_add(jobs, holder, name, is_background ? BACKGROUND : FOREGROUND);
+    if (job_id == -1) {
+        printf("Failed to add to job list\n");
+        free(batch);
+        kill(holder, SIGKILL);
         return -1;
     }
+    // The holder's own exit status means nothing, so last_pid is left unset and the batch sets the
+    // job's exit status when it finishes
+    job_t *job = job_list_get(jobs, job_id);
+    job->last_pid = 0;
+    job->batch = batch;
+    if (cgroup_enabled()) {    // for the runs, rather than the holder
+        job->cgroup_fd = cgroup_create(&job->cgroup_id);
+    }
+    if (batch_update(jobs, job) == -1) {
+        return -1;
+    }
+    if (is_background) {
+        return 0;
+    }
+    return run_in_foreground(jobs, job_id);
+}
 
-    char *args[MAX_ARGS];    // string array to be filled from the tokens vector
+int run_parallel(strvec_t *tokens, job_list_t *jobs) {
+    int is_background = 0;
+    if (tokens->length > 1 && token_kind(tokens->data[tokens->length - 1]) == TOKEN_BACKGROUND) {
+        strvec_take(tokens, tokens->length - 1);
+        is_background = 1;
+    }
 
-    // boolean indicating if the next token should be retrieved from the tokens vector
-    int get_next_token = 1;
-    int i = 0;    // current index of the tokens vector
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned start = 1;    // first token of the command
+    if (start < tokens->length && strcmp(tokens->data[start], "-j") == 0) {
+        char *end = "";
+        max_running = start + 1 < tokens->length ? strtol(tokens->data[start + 1], &end, 10) : 0;
+        if (max_running <= 0 || *end != '\0') {
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            last_status = STATUS_USAGE;
+            return 0;
+        }
+        start += 2;
+    }
+    int separator = strvec_find(tokens, ":::");
+    unsigned template_end = separator == -1 ? tokens->length : (unsigned) separator;
+    // Without ":::", a trailing "< file" names the file to read the items from, rather than being
+    // a redirection of each item's command
+    const char *items_path = NULL;
+    if (separator == -1 && template_end >= start + 2 &&
+        token_kind(tokens->data[template_end - 2]) == TOKEN_REDIRECT_IN) {
+        items_path = tokens->data[template_end - 1];
+        template_end -= 2;
+    }
+    if (template_end <= start) {
+        fprintf(stderr, "Usage: parallel [-j N] command [arg...] [::: item... | < file] [&]\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
+    if (!valid_pipeline(tokens->data + start, template_end - start)) {
+        fprintf(stderr, "Invalid pipeline\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
+    // The line reader has already buffered whatever follows this line on stdin, so the rest of the
+    // script can't double as the list of items
+    if (separator == -1 && items_path == NULL && commands_from_stdin) {
+        fprintf(stderr, "parallel: commands are read from stdin, so items need ::: or < file\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
 
-    // loop that gets the arguments (not redirection operators) from the tokens vector
-    while (get_next_token == 1) {
-        char *curr_arg = strvec_get(tokens, i);
-        if (curr_arg == NULL) {
-            fprintf(stderr, "Failed to get token from tokens vector\n");
+    // Items follow ":::" on the command line, or else are read from a file or stdin
+    strvec_t stdin_items;
+    char **items = tokens->data + template_end + 1;
+    unsigned num_items = separator == -1 ? 0 : tokens->length - template_end - 1;
+    if (separator == -1) {
+        int items_fd = STDIN_FILENO;
+        if (items_path != NULL && (items_fd = open(items_path, O_RDONLY | O_CLOEXEC)) == -1) {
+            perror(items_path);
+            last_status = STATUS_REDIRECT_FAILED;
+            return 0;
+        }
+        if (strvec_init(&stdin_items) == -1) {
+            fprintf(stderr, "Failed to initialize items vector\n");
+            if (items_fd != STDIN_FILENO) {
+                close(items_fd);
+            }
             return -1;
         }
-
-        if (strcmp(curr_arg, ">") == 0 || strcmp(curr_arg, "<") == 0 ||
-            strcmp(curr_arg, ">>") == 0) {
-            get_next_token = 0;
-        } else {
-            args[i] = curr_arg;
-            i++;
+        int result = read_items(items_fd, &stdin_items);
+        if (items_fd != STDIN_FILENO) {
+            close(items_fd);
         }
+        if (result == -1) {
+            strvec_clear(&stdin_items);
+            return -1;
+        }
+        items = stdin_items.data;
+        num_items = stdin_items.length;
+    }
+    if (num_items == 0) {
+        if (separator == -1) {
+            strvec_clear(&stdin_items);
+        }
+        last_status = 0;
+        return 0;
+    }
+    if (max_running > num_items) {
+        max_running = num_items;
+    }
+    batch_t *batch = batch_alloc(tokens->data + start, template_end - start, items, num_items,
+                                 NULL, num_items, max_running);
+    if (separator == -1) {
+        strvec_clear(&stdin_items);
+    }
+    if (batch == NULL) {
+        fprintf(stderr, "Failed to allocate parallel batch\n");
+        return -1;
+    }
+    return start_batch(batch, "parallel", jobs, is_background);
+}
+
+/*
+ * Work out how to pack items into as few runs of a command as possible: each run takes items until
+ * its arguments and the environment would no longer fit in ARG_MAX, or it has max_args of them
+ * (0 for no limit). An item too long to fit even on its own gets a run to itself, which then
+ * fails to start
+ * run_ends: Filled in with the end of each run's items (see batch_t), with room for num_items
+ * Returns the number of runs
+ */
+static unsigned pack_runs(char *const *template, unsigned template_len, char *const *items,
+                          unsigned num_items, unsigned max_args, unsigned *run_ends) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max == -1) {
+        arg_max = _POSIX_ARG_MAX;
+    }
+    // Every string costs its bytes and its pointer, and both lists end with a NULL pointer
+    size_t fixed = ARG_HEADROOM + 2 * sizeof(char *);
+    for (char **var = environ; *var != NULL; var++) {
+        fixed += strlen(*var) + 1 + sizeof(char *);
+    }
+    for (unsigned i = 0; i < template_len; i++) {
+        fixed += strlen(template[i]) + 1 + sizeof(char *);
+    }
+    size_t limit = (size_t) arg_max > fixed ? arg_max - fixed : 0;
 
-        if (i == tokens->length) {
-            get_next_token = 0;
+    unsigned num_runs = 0;
+    unsigned run_len = 0;
+    size_t run_size = 0;
+    for (unsigned i = 0; i < num_items; i++) {
+        size_t size = strlen(items[i]) + 1 + sizeof(char *);
+        if (run_len > 0 && (run_size + size > limit || run_len == max_args)) {
+            run_ends[num_runs++] = i;
+            run_len = 0;
+            run_size = 0;
         }
+        run_len++;
+        run_size += size;
     }
+    if (run_len > 0) {
+        run_ends[num_runs++] = num_items;
+    }
+    return num_runs;
+}
 
-    args[i] = NULL;    // adding NULL sentinel
+int run_xargs(strvec_t *tokens, job_list_t *jobs) {
+    int is_background = 0;
+    if (tokens->length > 1 && token_kind(tokens->data[tokens->length - 1]) == TOKEN_BACKGROUND) {
+        strvec_take(tokens, tokens->length - 1);
+        is_background = 1;
+    }
 
-    while (i < tokens->length) {    // loop that handles the redirection operators if applicable
-        char *redir_token = strvec_get(tokens, i);
-        if (redir_token == NULL) {
-            fprintf(stderr, "Failed to get token from tokens vector");
+    long max_running = 1;
+    long max_args = 0;
+    unsigned start = 1;    // first token of the command
+    while (start + 1 < tokens->length &&
+           (strcmp(tokens->data[start], "-P") == 0 || strcmp(tokens->data[start], "-n") == 0)) {
+        char *end;
+        long value = strtol(tokens->data[start + 1], &end, 10);
+        if (value <= 0 || *end != '\0') {
+            fprintf(stderr, "xargs: %s needs a positive number\n", tokens->data[start]);
+            last_status = STATUS_USAGE;
+            return 0;
         }
-        i++;
-        char *file_name = strvec_get(tokens, i);
-        if (file_name == NULL) {
-            fprintf(stderr, "Failed to get token from tokens vector");
+        if (tokens->data[start][1] == 'P') {
+            max_running = value;
+        } else {
+            max_args = value;
         }
-        i++;
+        start += 2;
+    }
+    int separator = strvec_find(tokens, ":::");
+    if (separator == -1 || (unsigned) separator <= start) {
+        fprintf(stderr, "Usage: xargs [-P N] [-n MAX] command [arg...] ::: arg... [&]\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
+    if (!valid_pipeline(tokens->data + start, separator - start)) {
+        fprintf(stderr, "Invalid pipeline\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
 
-        if (strcmp(redir_token, ">") == 0) {    // redirect output
-            int out_fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY,
-                              S_IRUSR | S_IWUSR);    // should overwrite file if it already exists
-            if (out_fd == -1) {
-                perror("Failed to open output file");
-                return -1;
-            } else if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                perror("dup2");
-                close(out_fd);
-                return -1;
-            }
-        } else if (strcmp(redir_token, "<") == 0) {    // redirect input
-            int in_fd = open(file_name, O_RDONLY);
-            if (in_fd == -1) {
-                perror("Failed to open input file");
-                return -1;
-            } else if (dup2(in_fd, STDIN_FILENO) == -1) {
-                perror("dup2");
-                close(in_fd);
-                return -1;
-            }
-        } else if (strcmp(redir_token, ">>") == 0) {    // redirect and append output
-            int out_fd = open(file_name, O_CREAT | O_APPEND | O_WRONLY,
-                              S_IRUSR | S_IWUSR);    // should append to file if it already exists
-            if (out_fd == -1) {
-                perror("Failed to open output file");
-                return -1;
-            } else if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                perror("dup2");
-                close(out_fd);
-                return -1;
+    char **items = tokens->data + separator + 1;
+    unsigned num_items = tokens->length - separator - 1;
+    if (num_items == 0) {
+        last_status = 0;
+        return 0;
+    }
+    unsigned *run_ends = malloc(num_items * sizeof(unsigned));
+    if (run_ends == NULL) {
+        fprintf(stderr, "Failed to allocate xargs runs\n");
+        return -1;
+    }
+    unsigned num_runs =
+        pack_runs(tokens->data + start, separator - start, items, num_items, max_args, run_ends);
+    if (max_running > num_runs) {
+        max_running = num_runs;
+    }
+    batch_t *batch = batch_alloc(tokens->data + start, separator - start, items, num_items,
+                                 run_ends, num_runs, max_running);
+    free(run_ends);
+    if (batch == NULL) {
+        fprintf(stderr, "Failed to allocate xargs batch\n");
+        return -1;
+    }
+    return start_batch(batch, "xargs", jobs, is_background);
+}
+
+int run_graph(strvec_t *tokens, job_list_t *jobs) {
+    int is_background = 0;
+    if (tokens->length > 1 && token_kind(tokens->data[tokens->length - 1]) == TOKEN_BACKGROUND) {
+        strvec_take(tokens, tokens->length - 1);
+        is_background = 1;
+    }
+
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = NULL;
+    for (unsigned i = 1; i < tokens->length; i++) {
+        if (strcmp(tokens->data[i], "-j") == 0) {
+            char *end = "";
+            max_running = i + 1 < tokens->length ? strtol(tokens->data[++i], &end, 10) : 0;
+            if (max_running <= 0 || *end != '\0') {
+                fprintf(stderr, "run-graph: -j needs a positive number\n");
+                last_status = STATUS_USAGE;
+                return 0;
             }
+        } else if (path == NULL) {
+            path = tokens->data[i];
+        } else {
+            path = NULL;
+            break;
         }
     }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: run-graph FILE [-j N] [&]\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
 
-    execvp(args[0], args);
-    perror("exec");
-    return -1;
+    // A graph file that can't be read or is malformed fails the command, so that a script can
+    // tell it from a graph whose commands all succeeded
+    graph_t *graph = graph_load(path, max_running);
+    if (graph == NULL) {
+        last_status = STATUS_USAGE;
+        return 0;
+    }
+    // Check every command before anything runs, so that a typo doesn't surface halfway through
+    for (unsigned i = 0; i < graph->num_nodes; i++) {
+        const graph_node_t *node = &graph->nodes[i];
+        if (!valid_pipeline(graph->tokens.data + node->first_token, node->num_tokens)) {
+            fprintf(stderr, "run-graph: %s:%u: invalid pipeline\n", path, node->line);
+            graph_free(graph);
+            last_status = STATUS_USAGE;
+            return 0;
+        }
+    }
+    if (graph->num_nodes == 0) {
+        graph_free(graph);
+        last_status = 0;
+        return 0;
+    }
+    fflush(stdout);
+
+    pid_t holder = start_group_holder();
+    if (holder == -1) {
+        graph_free(graph);
+        return -1;
+    }
+    int job_id = job_list_add(jobs, holder, "run-graph", is_background ? BACKGROUND : FOREGROUND);
+    if (job_id == -1) {
+        printf("Failed to add to job list\n");
+        graph_free(graph);
+        kill(holder, SIGKILL);
+        return -1;
+    }
+    // As for a parallel batch, the graph sets the job's exit status when it finishes
+    job_t *job = job_list_get(jobs, job_id);
+    job->last_pid = 0;
+    job->graph = graph;
+    if (cgroup_enabled()) {
+        job->cgroup_fd = cgroup_create(&job->cgroup_id);
+    }
+    if (graph_update(jobs, job) == -1) {
+        return -1;
+    }
+    if (is_background) {
+        return 0;
+    }
+    return run_in_foreground(jobs, job_id);
 }
 
 int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground) {
@@ -148,34 +2342,49 @@ int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground) {
             fprintf(stderr, "Job index out of bounds\n");
             return -1;
         }
+        if (toBeResumed->status == DONE) {
+            fprintf(stderr, "Job has already finished\n");
+            return -1;
+        }
         // Send to be resumed to the foreground
-        if (tcsetpgrp(STDIN_FILENO, toBeResumed->pid) == -1) {
+        if (interactive && tcsetpgrp(STDIN_FILENO, toBeResumed->pid) == -1) {
             perror("tcsetpgrp when resuming stopped process");
             return -1;
         }
-        // Send the continue/resume signal
-        if (kill(toBeResumed->pid, SIGCONT) == -1) {
+        // Send the continue/resume signal to every process in the job
+        if (kill(-toBeResumed->pid, SIGCONT) == -1) {
             perror("Could not send SIGCONT to resume a process");
             return -1;
         }
 
-        // Repeated code from main() to wait for process to exit
-        int status;
-        // Waits for child process to terminate
-        if (waitpid(toBeResumed->pid, &status, WUNTRACED) == -1) {
-            perror("waitpid");
+        // Waits for all of the job's processes to terminate (or for the job to stop again)
+        toBeResumed->status = FOREGROUND;
+        // a batch or graph may have had slots free up while it was stopped
+        if (toBeResumed->batch != NULL && batch_update(jobs, toBeResumed) == -1) {
+            return -1;
+        }
+        if (toBeResumed->graph != NULL && graph_update(jobs, toBeResumed) == -1) {
+            return -1;
+        }
+        int stopped = wait_for_job(jobs, toBeResumed);
+        if (stopped == -1) {
             return -1;
         }
 
         // Remove jobs that have not stopped (Been moved to foreground or exited)
-        if (!WIFSTOPPED(status)) {
+        if (stopped) {
+            toBeResumed->status = STOPPED;
+        } else {
+            last_status = toBeResumed->exit_status;
+            last_usage = toBeResumed->usage;
             if (job_list_remove(jobs, index) == -1) {
                 fprintf(stderr, "Failed to remove job from list");
             }
         }
 
+        // restore the shell process to the foreground
         pid_t ppid = getpid();
-        if (tcsetpgrp(STDIN_FILENO, ppid) == -1) {    // restore the shell process to the foreground
+        if (interactive && tcsetpgrp(STDIN_FILENO, ppid) == -1) {
             perror("tcsetpgrp");
             return -1;
         }
@@ -192,13 +2401,23 @@ int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground) {
             fprintf(stderr, "Job index out of bounds\n");
             return -1;
         }
+        if (toBeResumed->status == DONE) {
+            fprintf(stderr, "Job has already finished\n");
+            return -1;
+        }
 
         toBeResumed->status = BACKGROUND;
-        // Send the continue/resume signal
-        if (kill(toBeResumed->pid, SIGCONT) == -1) {
+        // Send the continue/resume signal to every process in the job
+        if (kill(-toBeResumed->pid, SIGCONT) == -1) {
             perror("Could not send SIGCONT to resume a process");
             return -1;
         }
+        if (toBeResumed->batch != NULL && batch_update(jobs, toBeResumed) == -1) {
+            return -1;
+        }
+        if (toBeResumed->graph != NULL && graph_update(jobs, toBeResumed) == -1) {
+            return -1;
+        }
 
     } else {
         return -1;
@@ -223,19 +2442,36 @@ int await_background_job(strvec_t *tokens, job_list_t *jobs) {
         fprintf(stderr, "Job index is for stopped process not background process\n");
         return -1;
     }
+    // "--timeout D" bounds the wait by giving the job a deadline D from now
+    char *option = strvec_get(tokens, 2);
+    if (option != NULL) {
+        struct timespec timeout;
+        struct timespec kill_grace = {DEFAULT_KILL_GRACE, 0};
+        char *duration = strvec_get(tokens, 3);
+        if (strcmp(option, "--timeout") != 0 || duration == NULL ||
+            parse_duration(duration, &timeout) == -1) {
+            fprintf(stderr, "Usage: wait-for N [--timeout DURATION]\n");
+            return -1;
+        }
+        if (toWaitFor->status != DONE &&
+            set_deadline(jobs, toWaitFor, &timeout, &kill_grace) == -1) {
+            return -1;
+        }
+    }
 
-    // Repeated code from main() to wait for process to exit
-    int status;
-    // Waits for child process to terminate
-    if (waitpid(toWaitFor->pid, &status, WUNTRACED) == -1) {
-        perror("waitpid");
+    // Waits for all of the job's processes to terminate (or for the job to stop). This returns
+    // right away for a DONE job, whose processes have all been reaped already
+    int stopped = wait_for_job(jobs, toWaitFor);
+    if (stopped == -1) {
         return -1;
     }
 
     // Update jobs that have been stopped, remove those which finish
-    if (WIFSTOPPED(status)) {
+    if (stopped) {
         toWaitFor->status = STOPPED;
     } else {
+        last_status = toWaitFor->exit_status;
+        last_usage = toWaitFor->usage;
         if (job_list_remove(jobs, index) == -1) {
             fprintf(stderr, "Failed to remove job from list");
             return -1;
@@ -245,25 +2481,155 @@ int await_background_job(strvec_t *tokens, job_list_t *jobs) {
     return 0;
 }
 
-int await_all_background_jobs(job_list_t *jobs) {
-    int status;
-    for (int i = 0; i < jobs->length; i++) {
-        job_t *currentJob = job_list_get(jobs, i);
-        if (currentJob == NULL) {
-            fprintf(stderr, "Failed to get a job from list");
+/*
+ * Block until any background job finishes, reaping every child in the order its state changes
+ * A job that had already finished by the time of the call counts too, and if there are several,
+ * the one that finished first is chosen
+ * finished: Set to the finished (DONE) job, or NULL if no job is left running in the background
+ * Returns 0 on success or -1 on error
+ */
+static int wait_for_any_job(job_list_t *jobs, job_t **finished) {
+    *finished = NULL;
+    unsigned num_running = 0;
+    for (job_t *job = job_list_next(jobs, 0); job != NULL; job = job_list_next(jobs, job->id + 1)) {
+        if (job->status == DONE &&
+            (*finished == NULL || time_before(&job->usage.end, &(*finished)->usage.end))) {
+            *finished = job;
+        } else if (job->status == BACKGROUND) {
+            num_running++;
+        }
+    }
+
+    // From here on, only the job each child belongs to needs checking, rather than the whole list
+    while (*finished == NULL && num_running > 0) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait_child(jobs, &status, WUNTRACED, &usage);
+        if (pid == -1) {
+            perror("wait4");
             return -1;
         }
-        if (currentJob->status == BACKGROUND) {
-            if (waitpid(currentJob->pid, &status, WUNTRACED) == -1) {
-                perror("waitpid while looping through bg jobs list");
-                return -1;
-            }
-            if (WIFSTOPPED(status)) {
-                currentJob->status = STOPPED;
-            }
+        job_t *job = job_list_find_pid(jobs, pid);
+        int was_running = job != NULL && job->status == BACKGROUND;
+        if (handle_child_event(jobs, pid, status, &usage) == -1) {
+            return -1;
+        }
+        if (was_running && job->status == DONE) {
+            *finished = job;
+        } else if (was_running && job->status == STOPPED) {
+            num_running--;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Report a background job that has finished, make its exit status the shell's, and remove it
+ */
+static void finish_background_job(job_list_t *jobs, job_t *job) {
+    printf("%u: %s (done, exit status %d%s)\n", job->id, job->name, job->exit_status,
+           job->timed_out ? ", timed out" : "");
+    fflush(stdout);
+    last_status = job->exit_status;
+    last_usage = job->usage;
+    job_list_remove(jobs, job->id);
+}
+
+int await_any_background_job(job_list_t *jobs) {
+    job_t *job;
+    if (wait_for_any_job(jobs, &job) == -1) {
+        return -1;
+    }
+    if (job == NULL) {
+        fprintf(stderr, "No background jobs to wait for\n");
+        return 0;
+    }
+    finish_background_job(jobs, job);
+    return 0;
+}
+
+int await_all_background_jobs(job_list_t *jobs, int show_progress) {
+    // Reap jobs as they finish, so a long job doesn't hold up reporting the ones after it
+    job_t *job;
+    if (wait_for_any_job(jobs, &job) == -1) {
+        return -1;
+    }
+    while (job != NULL) {
+        if (show_progress) {
+            finish_background_job(jobs, job);
+        } else {
+            job_list_remove(jobs, job->id);
+        }
+        if (wait_for_any_job(jobs, &job) == -1) {
+            return -1;
         }
     }
-    job_list_remove_by_status(jobs, BACKGROUND);
+    return 0;
+}
+
+int show_job_output(strvec_t *tokens, job_list_t *jobs) {
+    char *second_token = strvec_get(tokens, 1);
+    if (second_token == NULL) {
+        fprintf(stderr, "Usage: output N [--follow]\n");
+        last_status = STATUS_USAGE;
+        return 0;
+    }
+    char *option = strvec_get(tokens, 2);
+    int follow = option != NULL && strcmp(option, "--follow") == 0;
+    int index = atoi(second_token);
+    job_t *job = job_list_get(jobs, index);
+    capture_t *capture = job != NULL ? job->capture : capture_find_retired(index);
+    if (capture == NULL) {
+        fprintf(stderr, "Job %d has no captured output\n", index);
+        last_status = 1;
+        return 0;
+    }
 
+    // Pick up anything written since the shell last drained the pipes
+    if (capture_drain() == -1) {
+        return -1;
+    }
+    fflush(stdout);
+    unsigned long long pos = 0;
+    long long skipped = capture_print(capture, &pos, STDOUT_FILENO);
+    if (skipped > 0) {
+        fprintf(stderr, "output: the first %lld bytes were dropped\n", skipped);
+    }
+    // Keep printing until every process that could write to the pipe has closed it
+    while (follow && skipped != -1 && capture_is_open(capture)) {
+        if (wait_for_event(jobs) == -1 || reap_jobs(jobs) == -1) {
+            return -1;
+        }
+        skipped = capture_print(capture, &pos, STDOUT_FILENO);
+        if (skipped > 0) {
+            fprintf(stderr, "output: %lld bytes were dropped\n", skipped);
+        }
+    }
+    if (skipped == -1) {
+        perror("write");
+        return -1;
+    }
     return 0;
 }
+
+int reap_jobs(job_list_t *jobs) {
+    while (1) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED | WNOHANG, &usage);
+        if (pid == -1) {
+            if (errno == ECHILD) {    // the shell has no children left
+                return 0;
+            }
+            perror("wait4");
+            return -1;
+        }
+        if (pid == 0) {    // no other child has changed state
+            return 0;
+        }
+
+        if (handle_child_event(jobs, pid, status, &usage) == -1) {
+            return -1;
+        }
+    }
+}
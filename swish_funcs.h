@@ -4,39 +4,415 @@
 #ifndef SWISH_FUNCS_H
 #define SWISH_FUNCS_H
 
+#include <time.h>
+
+#include "cgroup.h"
 #include "job_list.h"
 #include "string_vector.h"
 
+#define STATUS_USAGE 2    // exit status of a builtin given a malformed command line
+#define DEFAULT_KILL_GRACE 5    // seconds from SIGTERM to SIGKILL for a job that times out
+
+typedef enum {
+    LAUNCH_SPAWN,    // start commands with posix_spawn() (the default)
+    LAUNCH_FORK,     // fork() the shell and call run_command() in the child
+    LAUNCH_ZYGOTE,   // have the zygote process start commands (see zygote.h)
+} launch_mode_t;
+
+/**
+ * @brief Kinds of token produced by tokenize()
+ */
+typedef enum {
+    TOKEN_WORD,                 // a command name, argument, or file name
+    TOKEN_PIPE,                 // |
+    TOKEN_PIPE_ALL,             // |&, which pipes stderr as well as stdout
+    TOKEN_BACKGROUND,           // &
+    TOKEN_SEPARATOR,            // ;, which ends a command in a list (see plan.h)
+    TOKEN_REDIRECT_IN,          // <
+    TOKEN_REDIRECT_OUT,         // >
+    TOKEN_REDIRECT_APPEND,      // >>
+    TOKEN_REDIRECT_ERR,         // 2>
+    TOKEN_REDIRECT_ERR_APPEND,  // 2>>
+} token_kind_t;
+
 /**
- * @brief Divide a string into substrings separated by a single space (" ")
+ * @brief Divide a command line into words and operators
  *
- * @details A input string s gets converted into a vector of strings (strvec_t*)
- * which can be indexed and manipulated with the functions in string_vector.h
+ * @details Words are separated by any whitespace, and by the operators "|", "|&", "&", ";", "<",
+ * ">", ">>", "2>", and "2>>" (the last two only at the start of a word), which need no spaces
+ * around them. Single quotes keep everything up to the next single quote literally; double quotes
+ * do the same except that a backslash still escapes '"' or '\'; and outside quotes a backslash
+ * escapes any character. Quoted characters never form operators
+ * The line is scanned once, with words compacted in place, so an arena vector's entries point
+ * into s, which must outlive them. Operators are added as shared static strings, which is how
+ * token_kind() tells them apart from words with the same text
+ * Quoted '*', '?', '[', and '\' characters are left escaped with a backslash, so that they aren't
+ * taken for wildcards, as is a '$' in single quotes or after a backslash, so that it isn't taken
+ * for a loop variable; wildcard_expand() (see wildcard.h) removes the escapes
  *
  * @param s Input string to be tokenized (character pointer)
  * @param tokens Pointer to the output String Vector (strvec_t*)
  *
- * @return 0 on success, -1 on failure
+ * @return 0 on success, 1 if the line has an unterminated quote (already reported), -1 on failure
  */
 int tokenize(char *s, strvec_t *tokens);
 
+/**
+ * @brief Find what kind of token tokenize() produced, from its address alone
+ *
+ * @param tok A token from tokenize() (or a copy of its pointer)
+ *
+ * @return The kind of operator, or TOKEN_WORD for anything else
+ */
+token_kind_t token_kind(const char *tok);
+
 /**
  * @brief Runs a user-specified command with file redirection and signal handling
  *
  * @details This function should only be called in the CHILD process of a shell
- * It takes in the arguments from strvec_t* tokens and attempts to run an execvp()
- * syscall to perform the command
+ * It takes in the arguments from strvec_t* tokens and attempts to run an execve()
+ * syscall to perform the command, using the path cached for it by the shell (see path_cache.h)
  *
  * Adds features for file I/O redirection with "<", ">", and ">>" tokens
  * Ensures SIGTTIN and SITTOU signals are NOT ignored
  *
  * @param tokens String vector that contains the name of the executable, followed by arguments to
  * the command
+ * @param pgid Process group for the child to join, or 0 to start a new group led by the child
  *
  * @return Returns 1 on failure. Does not return on success (completes execvp() and then terminates
  * the calling proccess)
  */
-int run_command(strvec_t *tokens);
+int run_command(strvec_t *tokens, pid_t pgid);
+
+/**
+ * @brief Checks whether a command line is a single command that the shell could run itself
+ *
+ * @details Such a line has no pipes and no trailing "&", and any redirection operators come after
+ * the command's arguments, each followed by its file name
+ *
+ * @param tokens The command line, starting with the command's name
+ *
+ * @return The number of tokens before the first redirection (i.e., the command and its
+ * arguments), or -1 if the line is not a single command
+ */
+int simple_command_args(const strvec_t *tokens);
+
+/**
+ * @brief Redirects the shell's own stdin, stdout, and stderr for a command it runs in-process
+ *
+ * @details Opens the files named by the redirection operators in tokens, as run_command() would,
+ * and duplicates them onto the shell's stdin, stdout, or stderr. The original descriptors are kept
+ * so that restore_redirects() can put them back once the command has finished. Buffered output
+ * is flushed first, so it goes where it was meant to
+ *
+ * @param tokens A command line that has passed simple_command_args()
+ * @param start Index of the first redirection operator in tokens (the number it returned)
+ * @param saved_fds Array of three descriptors, set to the shell's saved stdin, stdout, and stderr
+ * (or -1)
+ *
+ * @return 0 on success, 1 if a file could not be opened (already reported, and the last status
+ * set as for a command that could not be started), or -1 on error
+ */
+int apply_redirects(strvec_t *tokens, unsigned start, int *saved_fds);
+
+/**
+ * @brief Undoes apply_redirects(), after flushing anything written to stdout
+ *
+ * @param saved_fds The descriptors saved by apply_redirects(), which are closed
+ */
+void restore_redirects(int *saved_fds);
+
+/**
+ * @brief Selects how run_pipeline() starts each command
+ *
+ * @details LAUNCH_SPAWN uses posix_spawn(), which avoids copying the shell's page tables for every
+ * command. LAUNCH_FORK keeps the classic fork() + run_command() path as a fallback. LAUNCH_ZYGOTE
+ * requires zygote_start() to have succeeded, and falls back to posix_spawn() if the zygote exits
+ *
+ * @param mode The launch mode to use from now on
+ */
+void set_launch_mode(launch_mode_t mode);
+
+/**
+ * @brief Selects whether the shell is running interactively
+ *
+ * @details An interactive shell hands the terminal to each foreground job with tcsetpgrp() and
+ * takes it back afterwards. When commands come from a script, a -c string, or a stdin that is not
+ * a terminal, there is no terminal to hand over, so these calls are skipped
+ *
+ * @param is_interactive 1 if the shell is interactive (the default), 0 otherwise
+ */
+void set_interactive(int is_interactive);
+
+/**
+ * @brief Records whether the shell reads its own commands from stdin
+ *
+ * @details When it does, the line reader may already hold input past the current line, so
+ * builtins that would otherwise read data from stdin (like parallel) refuse to
+ *
+ * @param from_stdin 1 if commands come from stdin (the default), 0 for -c strings and scripts
+ */
+void set_commands_from_stdin(int from_stdin);
+
+/**
+ * @brief Selects whether the output of background jobs is captured
+ *
+ * @details A captured job's stdout and stderr go to a pipe instead of the terminal. The shell
+ * drains the pipe without blocking, between commands and while it waits for jobs, into a ring
+ * buffer of the job's last CAPTURE_SIZE bytes of output (see capture.h), which show_job_output()
+ * prints
+ *
+ * @param enabled 1 to capture the output of background jobs started from now on, 0 not to (the
+ * default)
+ */
+void set_capture_output(int enabled);
+
+/**
+ * @brief Tells the job functions about the signalfd that receives SIGCHLD
+ *
+ * @details Waiting for a child while captured output must be drained is done by polling this
+ * descriptor together with the capture pipes, rather than blocking in wait4()
+ *
+ * @param fd The signalfd, or -1 if there is none
+ */
+void set_child_signal_fd(int fd);
+
+/**
+ * @brief Returns the exit status of the most recent foreground job
+ *
+ * @details This is the status of the job's last pipeline stage, 128 + N if that stage was killed
+ * by signal N, or 127 if it could not be started. Waiting for a background job with wait-for or
+ * bringing one to the foreground with fg also sets it
+ *
+ * @return The exit status, which is 0 before any job has finished
+ */
+int get_last_status(void);
+
+/**
+ * @brief Overrides the exit status reported by get_last_status()
+ *
+ * @param status The new exit status
+ */
+void set_last_status(int status);
+
+/**
+ * @brief Returns the resources used by the most recent foreground job that finished
+ *
+ * @details Covers the same jobs as get_last_status(): the job's start and end times, and the CPU
+ * time, peak memory, and context switches of all of its processes
+ *
+ * @return Pointer to the usage, which is all zero before any job has finished
+ */
+const job_usage_t *get_last_usage(void);
+
+/**
+ * @brief Returns the job most recently started in the background, as with $! in sh
+ *
+ * @return The ID of the job started by the last background call to run_pipeline(), or -1 if that
+ * call could not start it
+ */
+int get_last_background_job(void);
+
+/**
+ * @brief Where one stage of a pipeline lies within the pipeline's tokens
+ */
+typedef struct {
+    unsigned start;       // first token of the stage
+    unsigned args_end;    // first redirection operator of the stage, or end if it has none
+    unsigned end;         // pipe operator after the stage, or the number of tokens for the last one
+} stage_t;
+
+/**
+ * @brief Finds where every stage of a pipeline lies, so that it can be launched again and again
+ * without scanning its tokens for pipes and redirections each time (see run_stages())
+ *
+ * @param tokens The pipeline's tokens, without any trailing "&"
+ * @param len Number of tokens
+ * @param stages Filled with one entry per stage. It must have room for one more entry than there
+ * are pipe operators among the tokens
+ *
+ * @return The number of stages, or 0 if the pipeline has an empty stage (e.g., "| wc" or "ls |")
+ * or a ';' and so can't be launched
+ */
+unsigned find_stages(char **tokens, unsigned len, stage_t *stages);
+
+/**
+ * @brief Launches a command, or a pipeline of commands separated by "|", as a single job
+ *
+ * @details Starts one child per stage and connects neighbouring stages with a pipe. A stage
+ * followed by "|&" sends both its stdout and stderr into the pipe. All stages share one process
+ * group, led by the first stage, so the job can be stopped, resumed, and waited for as a unit.
+ * Each stage may still use "<", ">", and ">>", which take precedence over the pipe
+ *
+ * The job is added to the job list as soon as its first stage starts. A foreground job is given
+ * the terminal and waited for, and is removed from the list again unless it is stopped
+ *
+ * @param tokens String Vector of command line arguments, without any trailing "&"
+ * @param jobs List of jobs currently stopped or running in the background
+ * @param is_background 1 if the job should run in the background, 0 for the foreground
+ *
+ * @return 0 on success (or if the pipeline was malformed and nothing was launched), -1 on failure
+ */
+int run_pipeline(strvec_t *tokens, job_list_t *jobs, int is_background);
+
+/**
+ * @brief Launches a pipeline like run_pipeline(), from stages already found by find_stages()
+ *
+ * @param tokens String Vector of command line arguments, without any trailing "&"
+ * @param stages Where each stage lies within tokens, which must have at least one stage
+ * @param jobs List of jobs currently stopped or running in the background
+ * @param is_background 1 if the job should run in the background, 0 for the foreground
+ *
+ * @return 0 on success, -1 on failure
+ */
+int run_stages(strvec_t *tokens, const stage_t *stages, job_list_t *jobs, int is_background);
+
+/**
+ * @brief Launches a job like run_pipeline(), with a deadline
+ *
+ * @details Once the timeout has passed, the job is sent SIGTERM (and SIGCONT, in case it is
+ * stopped) with signal_job(), then SIGKILL if it is still running kill_grace later. The job
+ * records the last signal sent in timed_out, and its exit status becomes 124, as with coreutils
+ * timeout. Deadlines are enforced with a timerfd, both while the shell waits for a job and at the
+ * prompt
+ *
+ * @param tokens String Vector of command line arguments, without any trailing "&"
+ * @param jobs List of jobs currently stopped or running in the background
+ * @param is_background 1 if the job should run in the background, 0 for the foreground
+ * @param timeout Time from launch to SIGTERM, or NULL for no deadline
+ * @param kill_grace Time from SIGTERM to SIGKILL
+ *
+ * @return 0 on success (or if the pipeline was malformed and nothing was launched), -1 on failure
+ */
+int run_pipeline_timeout(strvec_t *tokens, job_list_t *jobs, int is_background,
+                         const struct timespec *timeout, const struct timespec *kill_grace);
+
+/**
+ * @brief Launches a job like run_pipeline(), with limits on its memory and CPU use
+ *
+ * @details The limits are set in the job's cgroup if it has one (see cgroup.h). Otherwise, or if
+ * the cgroup lacks the controller, a memory limit becomes the RLIMIT_AS of each of the job's
+ * processes, and a CPU limit is reported as unsupported. Either way a job with a memory or CPU
+ * limit is launched with fork(), so that the limits are in place before it executes anything. A
+ * job pinned to a set of CPUs is recorded as such, and counts towards their load (see affinity.h)
+ *
+ * @param tokens String Vector of command line arguments, without any trailing "&"
+ * @param jobs List of jobs currently stopped or running in the background
+ * @param is_background 1 if the job should run in the background, 0 for the foreground
+ * @param limits The limits
+ *
+ * @return 0 on success (or if the pipeline was malformed and nothing was launched), -1 on failure
+ */
+int run_pipeline_limits(strvec_t *tokens, job_list_t *jobs, int is_background,
+                        const job_limits_t *limits);
+
+/**
+ * @brief Sends a signal to every process of a job
+ *
+ * @details The job's process group is signalled, and if the job has a cgroup, so is every process
+ * in it, including any that left the process group. SIGKILL then goes through cgroup.kill
+ *
+ * @param job The job
+ * @param sig The signal
+ *
+ * @return 0 if any process was signalled, -1 on failure
+ */
+int signal_job(const job_t *job, int sig);
+
+/**
+ * @brief Parses a duration such as "10", "2.5s", "3m", "1h", or "1d" (seconds by default)
+ *
+ * @param s The duration
+ * @param duration Set to the parsed duration, which is never zero
+ *
+ * @return 0 on success, -1 if s is not a valid duration
+ */
+int parse_duration(const char *s, struct timespec *duration);
+
+/**
+ * @brief Returns the timerfd that expires at the earliest job deadline, creating it if needed
+ *
+ * @details The shell's event loop polls it, and calls expire_deadlines() when it is readable
+ *
+ * @return The timerfd, or -1 on error
+ */
+int deadline_timer_fd(void);
+
+/**
+ * @brief Signals every job whose deadline has passed, and rearms the deadline timer
+ *
+ * @details Does nothing but read the timer if it has not expired, so this is cheap to call often
+ *
+ * @param jobs List of jobs currently stopped or running in the background
+ *
+ * @return 0 on success, -1 on failure
+ */
+int expire_deadlines(job_list_t *jobs);
+
+/**
+ * @brief Runs a command once for each of a list of items, with a bounded number running at once
+ *
+ * @details Used to implement 'parallel [-j N] command [arg...] [::: item... | < file] [&]'. Each
+ * "{}" in the command is replaced by the item, or if there is none, the item is appended as the
+ * last argument. Items follow ":::", or if there is no ":::" they are read one per line from the
+ * file after a trailing "<", or else from stdin. Stdin is only used when the shell's own commands
+ * come from somewhere else (see set_commands_from_stdin()).
+ * At most N items (by default, one per online CPU) run at a time, and as soon as any of them
+ * exits the next one is started, whichever order they finish in
+ *
+ * The whole batch is a single job named "parallel", so jobs, fg, bg, wait-for and wait-all treat
+ * it like any other. Its items share a process group led by a placeholder process that lives as
+ * long as the batch. The job's exit status is the number of items that failed (at most 101)
+ *
+ * @param tokens String Vector of command line arguments, starting with "parallel"
+ * @param jobs List of jobs currently stopped or running in the background
+ *
+ * @return 0 on success (or if the command line was malformed, in which case nothing is launched
+ * and the exit status is 2), -1 on failure
+ */
+int run_parallel(strvec_t *tokens, job_list_t *jobs);
+
+/**
+ * @brief Runs a command with a list of arguments packed into as few runs as the system allows
+ *
+ * @details Used to implement 'xargs [-P N] [-n MAX] command [arg...] ::: arg... [&]'. The
+ * arguments after ":::" are appended to the command, as many to each run as fit in ARG_MAX
+ * alongside the environment (and at most MAX, if given), so that even a list too long for one
+ * command line takes as few launches as possible. At most N runs (by default, 1) go at a time
+ *
+ * Like a parallel batch, the runs are a single job, named "xargs", whose exit status is the
+ * number of runs that failed (at most 101)
+ *
+ * @param tokens String Vector of command line arguments, starting with "xargs"
+ * @param jobs List of jobs currently stopped or running in the background
+ *
+ * @return 0 on success (or if the command line was malformed, in which case nothing is launched
+ * and the exit status is 2), -1 on failure
+ */
+int run_xargs(strvec_t *tokens, job_list_t *jobs);
+
+/**
+ * @brief Runs the commands of a dependency graph, each as soon as the ones it depends on succeed
+ *
+ * @details Used to implement 'run-graph FILE [-j N] [&]'. FILE has one 'target: dep... ; command'
+ * line per node (see graph.h), and is checked in full before anything runs. At most N commands
+ * (by default, one per online CPU) run at a time, and whenever one finishes, the nodes it unblocks
+ * are started right away, longest remaining chain first. A node that fails keeps its successors
+ * from running, but not anything else
+ *
+ * Like a parallel batch, the whole graph is a single job, named "run-graph", whose commands share
+ * a process group led by a placeholder process. The job's exit status is the number of nodes that
+ * failed or never ran (at most 101). jobs lists the nodes that failed, and in the foreground they
+ * are reported when the graph finishes
+ *
+ * @param tokens String Vector of command line arguments, starting with "run-graph"
+ * @param jobs List of jobs currently stopped or running in the background
+ *
+ * @return 0 on success (or if the command line or graph file was malformed, in which case nothing
+ * is launched and the exit status is 2), -1 on failure
+ */
+int run_graph(strvec_t *tokens, job_list_t *jobs);
 
 /**
  * @brief Resumes a stopped proccess in either the background (bg) or foreground (fg)
@@ -59,30 +435,80 @@ int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground);
  * @brief Block the calling shell process until a specific background (not stopped) job
  * stops running (either is stopped or exits)
  *
- * @details Uses waitpid() with WUNTRACED flag to wait for a specific job from the background.
- * Ignores stopped proccesses waitpid() will return if the request job either exited or is stopped
+ * @details Uses wait4() with WUNTRACED flag to wait for a specific job from the background.
+ * Ignores stopped proccesses wait4() will return if the request job either exited or is stopped
  * with the SIGINT signal. The job is removed from the job list if it has exited. The job is kept in
  * the list, but its status is updated to "STOPPED" if it was stopped by SIGINT
  *
+ * With "--timeout D", the job is given a deadline D from now (see run_pipeline_timeout()), so the
+ * wait ends within D plus the grace period before SIGKILL
+ *
  * @param tokens String Vector containing command line arguments, should be either "wait-for
- * [index]", where [index] is a valid integer index to the jobs list
+ * [index]" or "wait-for [index] --timeout [duration]", where [index] is a valid integer index to
+ * the jobs list
  * @param jobs List of jobs currently stopped or running in the background
  *
  * @return 0 on success, -1 on failure
  */
 int await_background_job(strvec_t *tokens, job_list_t *jobs);
 
+/**
+ * @brief Block the calling shell process until any background job finishes
+ *
+ * @details Used to implement the wait-any command. Every child is reaped in the order it exits or
+ * stops, so the job reported is whichever finishes first, not the first one in the job list. If
+ * some jobs had already finished, the earliest of them is reported without waiting. The job is
+ * printed with its exit status, which becomes the shell's, and removed from the job list
+ *
+ * @param jobs List of jobs currently stopped or running in the background
+ *
+ * @return 0 on success (including when there are no background jobs), -1 on failure
+ */
+int await_any_background_job(job_list_t *jobs);
+
 /**
  * @brief Block the calling shell process until all background (not stopped) jobs
  * stop running (either are stopped or exit)
  *
- * @details Loops through the entire job list, ignores STOPPED jobs, and uses waitpid() to wait for
- * background jobs to either exit or be stopped by a signal
+ * @details Reaps every child in the order it exits or stops, ignoring STOPPED jobs, and removes
+ * each background job from the list as soon as it finishes. Background jobs that stop are kept in
+ * the list as STOPPED
+ *
+ * @param jobs List of jobs currently stopped or running in the background
+ * @param show_progress If 1, print each job as it finishes, as wait-any would (wait-all --progress)
+ *
+ * @return 0 on success, -1 on failure
+ */
+int await_all_background_jobs(job_list_t *jobs, int show_progress);
+
+/**
+ * @brief Prints the captured output of a background job: output N [--follow]
+ *
+ * @details Prints what is left in the job's ring buffer, noting on stderr how much older output
+ * was dropped. With --follow, keeps printing new output as it arrives until every process that
+ * could write more has exited or closed it. The output of a job that has been removed from the list
+ * stays available for a while (see capture_retire())
+ *
+ * @param tokens The command line, with the job ID as its second token
+ * @param jobs List of jobs currently stopped or running in the background
+ *
+ * @return 0 on success (or if there is no job ID, or no output for it, in which case the exit
+ * status is 2 or 1), -1 on failure
+ */
+int show_job_output(strvec_t *tokens, job_list_t *jobs);
+
+/**
+ * @brief Collect every job process that has exited or stopped, without blocking
+ *
+ * @details Uses waitid() with WNOHANG on all children, and finds the job each one belongs to by its
+ * pid. A job whose processes have all exited is marked DONE (its entry stays in the list until it
+ * is reported or waited for), and a job with a stopped process is marked STOPPED. Called by the
+ * shell's event loop whenever SIGCHLD arrives, so finished jobs never linger as zombies
  *
  * @param jobs List of jobs currently stopped or running in the background
  *
  * @return 0 on success, -1 on failure
  */
-int await_all_background_jobs(job_list_t *jobs);
+int reap_jobs(job_list_t *jobs);
 
 #endif    // SWISH_FUNCS_H
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Test helper: print each argument on a line of its own, pausing before each line, so tests can
+// observe output that arrives over time
+//   slow_write [-d MILLISECONDS] [line...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_DELAY_MS 100
+
+int main(int argc, char **argv) {
+    long delay_ms = DEFAULT_DELAY_MS;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+        delay_ms = strtol(argv[2], NULL, 10);
+        first = 3;
+    }
+    struct timespec delay = {delay_ms / 1000, (delay_ms % 1000) * 1000000};
+    for (int i = first; i < argc; i++) {
+        nanosleep(&delay, NULL);
+        printf("%s\n", argv[i]);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+# -c and script files run without a prompt, and the shell exits with the status of the last
+# command, or of 'exit N'; many short commands run one after another
+. test_cases/scripts/common.sh
+
+printf '/bin/echo from a script\nfalse\n' > script.sh
+"$SWISH" script.sh
+echo "exit status $?"
+"$SWISH" missing.sh
+echo "exit status $?"
+"$SWISH" -c 2>&1 | sed "s|$SWISH|swish|"
+echo "exit status ${PIPESTATUS[0]}"
+run "false
+exit"
+run "no_such_command_xyz"
+run "exit 7
+/bin/echo not reached"
+for i in $(seq 2000); do
+    echo "true"
+done > many.sh
+echo "/bin/echo done" >> many.sh
+"$SWISH" many.sh
+echo "exit status $?"
@@ -0,0 +1,18 @@
+# swish_bench prints one well-formed JSON object per benchmark, only for those matching its
+# filter, with percentiles in order
+. test_cases/scripts/common.sh
+
+check() {
+    python3 -c '
+import json, sys
+for line in sys.stdin:
+    r = json.loads(line)
+    ordered = 0 < r["p50"] <= r["p90"] <= r["p99"] <= r["max"] and r["ns_per_op"] > 0
+    print(r["bench"], r["n"], "ok" if ordered else "out of order: " + line.strip())
+'
+}
+"$SWISH_BENCH" tokenize | check
+"$SWISH_BENCH" strvec/ | check
+"$SWISH_BENCH" launch/spawn | check
+"$SWISH_BENCH" no_such_bench | check
+"$SWISH_BENCH" a b 2>&1 | sed "s|$SWISH_BENCH|swish_bench|"
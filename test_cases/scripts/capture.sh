@@ -0,0 +1,27 @@
+# With capture on, background jobs' stdout and stderr go to a ring buffer that output N prints,
+# keeping only the newest 64K, and --follow waits for more; with capture off nothing is kept, not
+# even the output of an earlier job with the same ID
+. test_cases/scripts/common.sh
+
+echo 'echo out; echo err >&2' > out_err.sh
+echo 'sleep 0.3; echo late' > late.sh
+run "capture on
+/bin/sh out_err.sh &
+/bin/sleep 0.2
+output 0
+/bin/sh late.sh &
+output 1 --follow
+wait-all
+output 0
+capture off
+/bin/echo not captured &
+wait-all
+output 0" 2>&1
+run "output" 2>&1
+run "output 99" 2>&1
+run "capture sideways" 2>&1
+"$SWISH" -c "capture on
+/usr/bin/head -c 100000 /dev/zero &
+wait-all
+output 0" 2> err | wc -c
+cat err
@@ -0,0 +1,17 @@
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Sourced by each test script, which testius runs from the top of the repository. Tests run in a
+# scratch directory of their own, removed afterwards, with $SWISH pointing at the shell under test
+# (and $SWISH_BENCH at the benchmark binary)
+
+SWISH="$PWD/swish"
+SWISH_BENCH="$PWD/swish_bench"
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH" || exit 1
+
+# Run a script with 'swish -c', then print the shell's exit status
+run() {
+    "$SWISH" -c "$1"
+    echo "exit status $?"
+}
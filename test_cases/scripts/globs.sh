@@ -0,0 +1,23 @@
+# Wildcards expand to the sorted paths they match, or stay as they are if nothing matches; quoted
+# wildcards and redirection targets are never expanded, and the directory cache notices changes
+. test_cases/scripts/common.sh
+
+mkdir -p src/lib/deep docs .hidden
+touch a.c b.c c.h ab.txt .dot.c src/x.c src/lib/y.c src/lib/deep/z.c docs/readme '[a].c'
+run "/bin/echo *.c
+/bin/echo ?.?
+/bin/echo [ab]*
+/bin/echo [!ab].*
+/bin/echo .*.c
+/bin/echo */
+/bin/echo src/**/*.c
+/bin/echo src/**
+/bin/echo *.none
+/bin/echo '*.c' \"?.c\" \\*.c
+/bin/echo out > *.h
+/bin/cat '*.h'"
+run "/bin/echo new*
+/usr/bin/touch new1 new2
+/bin/echo new*
+/bin/rm new1
+/bin/echo new*"
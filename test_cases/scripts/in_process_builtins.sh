@@ -0,0 +1,19 @@
+# echo, true, false and cat run inside the shell for files that can't block it, and through their
+# executables for anything that can, such as /dev/zero or a FIFO
+. test_cases/scripts/common.sh
+
+printf 'one\n' > a
+printf 'two\n' > b
+mkfifo fifo
+run 'echo -n no newline
+echo
+cat a b > both
+cat both
+cat a - b < both
+echo hidden > /dev/null
+false
+cat missing'
+run 'echo lost > no_such_dir/out'
+# Without a reader or writer on the FIFO, only a child process would block, and timeout kills it
+run 'timeout 1 cat /dev/zero > /dev/null
+timeout 1 cat fifo'
@@ -0,0 +1,6 @@
+# Run the shell on the test's terminal, in a scratch directory, for tests that type commands at
+# the prompt. Job control gives it a process group of its own, which the shell expects to lead
+. test_cases/scripts/common.sh
+
+set -m
+"$SWISH"
@@ -0,0 +1,46 @@
+# The job server starts each command it is sent as a job and reports it when done, and stays idle
+# while the jobs of a client that has disconnected run on
+. test_cases/scripts/common.sh
+
+# Send lines to the server, shutting down the writing side unless told to disconnect at once,
+# and print each reply, up to the first of a done line's timings. Jobs may finish in any order, so
+# the replies are sorted
+client() {
+    python3 - "$@" <<'PY'
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect("sock")
+s.sendall(sys.argv[2].encode())
+if sys.argv[1] == "disconnect":
+    print(s.recv(100).decode().strip())
+    s.close()
+    sys.exit()
+s.shutdown(socket.SHUT_WR)
+data = b""
+while chunk := s.recv(4096):
+    data += chunk
+for line in sorted(data.decode().splitlines()):
+    print(line.split(" real=")[0])
+PY
+}
+
+"$SWISH" --serve sock &
+server=$!
+for _ in $(seq 50); do
+    [ -S sock ] && break
+    sleep 0.1
+done
+client wait $'echo hello > out\nfalse\nno_such_command_xyz\nls | | wc\n'
+cat out
+client disconnect $'sleep 2\n'
+sleep 1.5
+# utime and stime, in clock ticks
+ticks=$(awk '{print $14 + $15}' /proc/$server/stat)
+if [ "$ticks" -lt $(($(getconf CLK_TCK) / 2)) ]; then
+    echo "server idle while the job runs"
+else
+    echo "server used $ticks clock ticks"
+fi
+kill $server
+wait $server
+echo "server exit status $?"
@@ -0,0 +1,30 @@
+# limit caps a job's memory (with an address space limit when the shell has no cgroups), and kill
+# signals a job by its ID, in a cgroup or not; bad arguments are reported with status 2 and unknown
+# jobs with status 1
+. test_cases/scripts/common.sh
+
+run "limit -m 100M /usr/bin/python3 -c 'x = bytearray(300000000)'" 2>&1 | grep -v '^ \|^Traceback'
+run "limit -m 100M /usr/bin/python3 -c 'x = bytearray(10000000); print(\"fits\")'"
+run "/bin/sleep 5 &
+kill %0
+wait-for 0"
+run "/bin/sleep 5 &
+kill -s KILL %0
+wait-for 0"
+run "/bin/sleep 5 &
+kill -INT %0
+wait-for 0"
+run "kill %7"
+run "kill -BOGUS %0"
+run "limit -m 1M"
+run "limit -m lots /bin/true"
+run "limit -c 0 /bin/true"
+
+# With SWISH_CGROUPS=1, where the system allows it, a job's processes start in its cgroup and open
+# their redirections themselves; the output is the same either way
+SWISH_CGROUPS=1 run "/bin/echo in a cgroup > out
+/bin/cat < out | /usr/bin/tr a-z A-Z
+/bin/cat < missing
+/bin/sleep 5 &
+kill -s KILL %0
+wait-for 0" 2>&1 | grep -v '^cgroups:'
@@ -0,0 +1,10 @@
+# Input lines of any length, read from a pipe, a script file or -c, are run whole, and a last line
+# without a newline still runs
+. test_cases/scripts/common.sh
+
+word=$(head -c 100000 /dev/zero | tr '\0' x)
+printf '/bin/echo %s\n/bin/echo short\n/bin/echo %s' "$word" "$word" | "$SWISH" | wc -c
+printf '/bin/echo %s\n' "$word" > script.sh
+"$SWISH" script.sh | wc -c
+run "/bin/echo $word > out"
+wc -c < out
@@ -0,0 +1,24 @@
+# repeat runs a command N times and for runs a list of commands once per word with $NAME and
+# ${NAME} replaced; the status is the last command's, and a malformed loop fails with status 2.
+# A loop body's wildcards are expanded after the variable is substituted, and a '$' in single
+# quotes or after a backslash is left alone
+. test_cases/scripts/common.sh
+
+touch a1 a2 b1
+run "repeat 3 /bin/echo hi
+repeat 0 /bin/echo never
+for f in a b c ; do /bin/echo item \$f ; /bin/echo \${f}2 ; done
+for x in ; do /bin/echo never ; done
+repeat 2 for x in 1 2 ; do /bin/echo \$x ; done
+/bin/echo '\$x' \"\$x\" \\\$x
+for x in a ; do /bin/echo '\$x' \"\$x\" \\\$x '\${x}' ; done
+for x in a b ; do /bin/echo \$x* ; done
+for f in a? ; do /bin/echo file \$f '*' ; done
+for x in 1 2 ; do /bin/sh -c \"exit \$x\" ; done"
+run "repeat 2 /bin/echo bg > out &
+wait-all
+/bin/cat out"
+run "repeat -1 /bin/echo no"
+run "repeat x"
+run "for 1x in a ; do /bin/echo no ; done"
+run "for x in a b ; do /bin/echo no"
@@ -0,0 +1,9 @@
+# A command with thousands of arguments reaches the command whole, in every launch mode
+. test_cases/scripts/common.sh
+
+args=$(seq 5000 | tr '\n' ' ')
+for mode in spawn fork zygote; do
+    SWISH_LAUNCH=$mode run "/bin/echo $args > out
+/bin/echo $args $args | /usr/bin/wc -w"
+    tr ' ' '\n' < out | tail -1
+done
@@ -0,0 +1,33 @@
+# parallel runs each item once with at most N at a time, starts the next item as soon as any
+# finishes, reads items from a file after '<' or from stdin without ':::', and exits with the
+# number of items that failed
+. test_cases/scripts/common.sh
+
+mkdir running
+cat > item.sh <<'SH'
+touch running/$1
+sleep 0.3
+ls running | wc -l >> counts
+sleep 0.1
+rm running/$1
+echo $1 >> done
+SH
+run "parallel -j 2 /bin/sh item.sh ::: 1 2 3 4 5 6"
+sort -n done | tr '\n' ' '
+echo
+echo "most running at once: $(sort -n counts | tail -1)"
+
+# The slow item must not hold back the quick ones behind it
+echo 'sleep $1; echo $1' > sleep_echo.sh
+run "parallel -j 2 /bin/sh sleep_echo.sh ::: 1.2 0.2 0.4 0.2"
+printf 'a\nb\n' > items
+printf 'a\nb\n' | "$SWISH" -c "parallel /bin/echo item"
+run "parallel -j 1 /bin/echo file < items"
+printf 'parallel -j 1 /bin/echo piped < items\n/bin/echo after\n' | "$SWISH"
+printf 'parallel /bin/echo item\n/bin/echo still runs\n' | "$SWISH"
+echo "exit status $?"
+run "parallel /bin/echo item < missing"
+echo 'exit $1' > exit.sh
+run "parallel -j 3 /bin/sh exit.sh ::: 0 1 0 2"
+run "parallel -j 0 /bin/true ::: a"
+run "parallel /bin/echo | | /bin/cat ::: a"
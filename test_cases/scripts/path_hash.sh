@@ -0,0 +1,24 @@
+# Commands found on PATH are remembered with a count of their uses, until hash -r or hash -d makes
+# the shell look again
+. test_cases/scripts/common.sh
+
+mkdir a b
+printf '#!/bin/sh\necho tool from b\n' > b/tool
+printf '#!/bin/sh\necho tool from a\n' > a/other
+chmod +x b/tool a/other
+PATH="$SCRATCH/a:$SCRATCH/b:$PATH" run "hash
+tool
+tool
+hash
+/bin/cp a/other a/tool
+tool
+hash -d tool
+tool
+/bin/rm a/tool
+hash -r
+hash
+tool
+hash nonexistent_tool
+hash -d nonexistent_tool
+hash -z" 2> err | sed "s|$SCRATCH|SCRATCH|"
+cat err
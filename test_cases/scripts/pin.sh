@@ -0,0 +1,29 @@
+# pin runs a job on the given CPUs without changing where the shell's other commands run, and
+# SWISH_AFFINITY=cpu gives each background job a CPU of its own while there are enough to go round
+. test_cases/scripts/common.sh
+
+all=$(sed -n 's/^Cpus_allowed_list:\t//p' /proc/self/status)
+first=$(echo "$all" | sed 's/[-,].*//')
+cpus="/bin/sed -n 's/^Cpus_allowed_list:\t//p' /proc/self/status"
+run "pin $first $cpus
+$cpus" | {
+    read -r pinned
+    read -r unpinned
+    [ "$pinned" = "$first" ] && echo "pinned to the first CPU"
+    [ "$unpinned" = "$all" ] && echo "the next command runs on every CPU again"
+    cat
+}
+
+n=$(nproc)
+script=""
+for i in $(seq "$n"); do
+    script="$script/bin/sleep 1 &
+"
+done
+SWISH_AFFINITY=cpu "$SWISH" -c "${script}jobs" | sed 's/.*cpus \([0-9]*\)).*/\1/' | sort -u |
+    wc -l | sed "s/^$n\$/each job on a CPU of its own/"
+
+run "pin 1023 /bin/true"
+run "pin 99999 /bin/true"
+run "pin 3-1 /bin/true"
+run "pin 0"
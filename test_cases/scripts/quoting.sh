@@ -0,0 +1,21 @@
+# Single quotes keep everything literally, double quotes allow \" \\ and \$ escapes, a backslash
+# escapes the next character outside quotes, quoted parts join the words around them, and
+# quoted operators are plain words
+. test_cases/scripts/common.sh
+
+cat > args.sh <<'SH'
+for arg; do
+    printf '[%s]' "$arg"
+done
+echo
+SH
+run "/bin/sh args.sh 'a  b' \"c  d\" e\\ f
+/bin/sh args.sh 'it''s' \"say \\\"hi\\\"\" 'back\\slash' \"back\\\\slash\"
+/bin/sh args.sh pre'mid'\"post\" '' \"\"
+/bin/sh args.sh '|' \">\" \\< '&' \";\"
+/bin/sh args.sh # not a comment
+/bin/sh args.sh 'unterminated
+/bin/echo after the error"
+run "/bin/sh args.sh \"unterminated"
+# Tabs separate words as spaces do, and blank lines are skipped
+run "$(printf '\t /bin/echo  a\t\tb   c  \n\n   \n/bin/echo d')"
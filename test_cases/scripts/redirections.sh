@@ -0,0 +1,22 @@
+# Redirections in each launch mode: the last one of each kind wins, stderr can be redirected too,
+# a missing input file fails the command with status 1, and so does having more than the launcher
+# can pass on, instead of dropping the rest
+. test_cases/scripts/common.sh
+
+many=""
+for i in $(seq 18); do
+    many="$many > c$i"
+done
+for mode in spawn zygote; do
+    echo "$mode:"
+    SWISH_LAUNCH=$mode run "/bin/echo last wins > a > b
+/bin/echo first > a
+/bin/cat < a < b 2> err > c
+/bin/cat c
+/bin/cat missing 2>> err
+/bin/cat err"
+    SWISH_LAUNCH=$mode run "/bin/cat < missing"
+    SWISH_LAUNCH=$mode run "/bin/echo z $many > cfinal"
+    [ -e cfinal ] || echo "cfinal was not created"
+    rm -f a b c* err
+done
@@ -0,0 +1,29 @@
+# run-graph: nodes run in dependency order, a failed node keeps only its own successors from
+# running, and a bad graph file runs nothing and fails with status 2
+. test_cases/scripts/common.sh
+
+cat > good.txt <<'GRAPH'
+# compile, then link
+link: a.o b.o ; /bin/sh -c "cat a.o b.o > prog"
+a.o: ; /bin/sh -c "echo a > a.o"
+b.o: a.o ; /bin/sh -c "echo b > b.o"
+GRAPH
+run "run-graph good.txt -j 1"
+cat prog
+
+cat > fail.txt <<'GRAPH'
+bad: ; /bin/false
+after-bad: bad ; /bin/echo never
+other: ; /bin/sh -c "echo other > other"
+GRAPH
+run "run-graph fail.txt -j 2"
+cat other
+
+printf 'x: ; /bin/true\nx: ; /bin/true\n' > dup.txt
+run "run-graph dup.txt"
+printf 'x: y ; /bin/true\n' > unknown.txt
+run "run-graph unknown.txt"
+printf 'x: y ; /bin/true\ny: x ; /bin/true\n' > cycle.txt
+run "run-graph cycle.txt"
+run "run-graph missing.txt"
+run "run-graph good.txt -j 0"
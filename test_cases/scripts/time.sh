@@ -0,0 +1,25 @@
+# time reports the wall-clock time and resources a foreground command used and keeps its exit
+# status, and jobs -l shows the same for background jobs
+. test_cases/scripts/common.sh
+
+# Show which fields were printed, and whether real and user + sys time are at least some seconds
+check() {
+    awk -v real="$1" -v cpu="$2" '
+        /^(real|user|sys|maxrss|ctxsw)\t/ { fields = fields " " $1 }
+        /^real/ { r = $2 + 0 }
+        /^(user|sys)/ { c += $2 }
+        /^exit status/ { print }
+        END {
+            print "fields:" fields
+            print "real >= " real ": " (r >= real ? "yes" : "no (" r ")")
+            print "cpu >= " cpu ": " (c >= cpu ? "yes" : "no (" c ")")
+        }'
+}
+run "time /bin/sleep 0.3" 2>&1 | check 0.3 0
+echo 'i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done; exit 3' > busy.sh
+run "time /bin/sh busy.sh" 2>&1 | check 0 0.05
+run "time" 2>&1
+run "time /bin/sleep 0.1 &" 2>&1
+run "/bin/sleep 0.2 &
+/bin/sleep 0.5
+jobs -l" | sed 's/pid [0-9]*/pid N/; s/[0-9][0-9.]*\(s\|K\)/N\1/g; s|ctxsw [0-9]*/[0-9]*|ctxsw N/N|'
@@ -0,0 +1,20 @@
+# timeout ends a command at its deadline with status 124, following SIGTERM with SIGKILL after the
+# grace period if it has to; background jobs and wait-for --timeout get deadlines too
+. test_cases/scripts/common.sh
+
+echo 'exit 3' > exit3.sh
+echo 'trap "" TERM; while :; do :; done' > spin.sh
+run "timeout 0.2 /bin/sleep 5"
+run "timeout 2 /bin/sh exit3.sh"
+run "timeout -k 0.2 0.2 /bin/sh spin.sh"
+run "timeout 0.2 /bin/sleep 5 &
+/bin/sleep 0.6
+jobs"
+run "/bin/sleep 5 &
+wait-for 0 --timeout 0.2"
+run "timeout abc /bin/true"
+run "timeout -k 0.1"
+run "timeout 1 &"
+SECONDS=0
+run "timeout 0.3 /bin/sleep 0.1 | /bin/sleep 10"
+echo "pipeline ended early: $((SECONDS < 5))"
@@ -0,0 +1,18 @@
+# wait-any reports whichever background job finishes first and takes its exit status, and
+# wait-all --progress reports the rest in the order they finish
+. test_cases/scripts/common.sh
+
+echo 'sleep $1; exit $2' > job.sh
+jobs3="/bin/sh job.sh 0.9 1 &
+/bin/sh job.sh 0.3 2 &
+/bin/sh job.sh 0.6 &"
+run "$jobs3
+wait-any"
+run "$jobs3
+wait-all --progress"
+run "$jobs3
+/bin/sleep 1.2
+wait-any
+wait-any
+jobs"
+run "wait-any"
@@ -0,0 +1,28 @@
+# xargs packs its arguments into as few runs as fit in ARG_MAX (or MAX per run with -n), runs up
+# to N at once with -P, and exits with the number of runs that failed
+. test_cases/scripts/common.sh
+
+cat > count.sh <<'SH'
+echo $# >> counts
+[ "$1" != fail ]
+SH
+run "xargs -n 3 /bin/sh count.sh ::: a b c d e f g"
+tr '\n' ' ' < counts
+echo
+rm counts
+
+# Too many arguments for one command line, given in a script since -c can't take them either
+echo "xargs -P 2 /bin/sh count.sh ::: $(seq 100000 400000 | tr '\n' ' ')" > big.sh
+"$SWISH" big.sh
+echo "exit status $?"
+awk 'END { print (NR > 1 ? "more than one run" : "one run") }' counts
+awk '{ total += $1 } END { print total " arguments" }' counts
+rm counts
+
+run "xargs -n 1 /bin/sh count.sh ::: ok fail ok fail"
+run "xargs /bin/echo :::"
+run "xargs -P 0 /bin/echo ::: a"
+run "xargs /bin/echo | | /bin/cat ::: a"
+
+# Without ":::" the arguments come from stdin, through the xargs executable
+printf 'x\ny\n' | "$SWISH" -c "xargs /bin/echo"
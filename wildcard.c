@@ -0,0 +1,530 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "wildcard.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "string_vector.h"
+#include "swish_funcs.h"
+
+#define DIRENT_BUF_SIZE (256 * 1024)    // bytes of directory entries read per getdents64() call
+#define INITIAL_ENTRIES 64
+#define INITIAL_NAMES_SIZE 1024
+#define STABLE_SECONDS 1    // how old a directory's mtime must be for its listing to be trusted
+#define MAX_COMPONENTS (PATH_MAX / 2)
+
+/*
+ * Cached listing of one directory. Names are stored back to back in a single buffer, so reading
+ * a directory allocates nothing per entry (the buffers only grow, and are reused when refreshed)
+ */
+typedef struct {
+    char *path;               // path the directory was listed by, or NULL for an unused slot
+    dev_t dev;                // device, inode, and modification time when it was listed
+    ino_t ino;
+    struct timespec mtime;
+    int stable;               // 0 if the mtime was too recent to be trusted when it was listed
+    unsigned pins;            // expansions currently iterating over the listing
+    unsigned long last_used;
+    unsigned count;           // number of entries, not counting "." and ".."
+    unsigned capacity;
+    unsigned *offsets;        // offset in names of each entry's name
+    unsigned char *types;     // d_type of each entry (DT_UNKNOWN if the file system doesn't say)
+    char *names;
+    unsigned names_size;
+    unsigned names_capacity;
+} listing_t;
+
+/*
+ * State of expanding one pattern
+ */
+typedef struct {
+    char *comps[MAX_COMPONENTS];    // the pattern's components, without the separating slashes
+    unsigned num_comps;
+    int dir_only;                   // the pattern ended in '/', so only directories match
+    strvec_t *out;                  // vector that matches are added to
+    char path[PATH_MAX];            // path matched so far
+} expansion_t;
+
+static listing_t cache[WILDCARD_CACHE_DIRS];
+static unsigned long use_clock = 0;
+static char *dirent_buf = NULL;
+static strvec_t scratch;    // vector that the next expansion is built in
+static int scratch_ready = 0;
+static char pattern_buf[PATH_MAX];
+
+int wildcard_is_pattern(const char *tok) {
+    for (const char *p = tok; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '*' || *p == '?' || *p == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Remove the backslashes that escape characters in s, in place
+ */
+static void unescape(char *s) {
+    char *out = s;
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+        }
+        *out++ = *s;
+    }
+    *out = '\0';
+}
+
+/*
+ * Match one character against a bracket expression
+ * p: Points at the '[' that starts the expression. Set to the character after its closing ']'
+ * Returns 1 if c matches, 0 if it doesn't, or -1 if there is no closing ']' (so the '[' is an
+ * ordinary character)
+ */
+static int match_class(const char **p, char c) {
+    const char *q = *p + 1;
+    int negate = *q == '!' || *q == '^';
+    if (negate) {
+        q++;
+    }
+    int matched = 0;
+    // A ']' right at the start is one of the characters listed rather than the end
+    for (int first = 1; *q != '\0' && (first || *q != ']'); first = 0) {
+        if (q[0] == '\\' && q[1] != '\0') {    // an escaped character is just that character
+            matched |= c == q[1];
+            q += 2;
+        } else if (q[1] == '-' && q[2] != '\0' && q[2] != ']') {
+            matched |= (unsigned char) c >= (unsigned char) q[0] &&
+                       (unsigned char) c <= (unsigned char) q[2];
+            q += 3;
+        } else {
+            matched |= c == *q;
+            q++;
+        }
+    }
+    if (*q != ']') {
+        return -1;
+    }
+    *p = q + 1;
+    return matched != negate;
+}
+
+/*
+ * Returns 1 if name matches the pattern component p, 0 otherwise
+ * When a character fails to match, the most recent '*' absorbs one more character and matching
+ * resumes after it; earlier stars never need revisiting, so this takes O(len(p) * len(name))
+ */
+static int match(const char *p, const char *name) {
+    const char *star_p = NULL;
+    const char *star_name = NULL;
+    while (*name != '\0') {
+        if (*p == '*') {
+            star_p = ++p;
+            star_name = name;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            name++;
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            if (p[1] == *name) {
+                p += 2;
+                name++;
+                continue;
+            }
+        } else if (*p == '[') {
+            const char *after = p;
+            int result = match_class(&after, *name);
+            if (result == 1) {
+                p = after;
+                name++;
+                continue;
+            } else if (result == -1 && *name == '[') {
+                p++;
+                name++;
+                continue;
+            }
+        } else if (*p == *name) {
+            p++;
+            name++;
+            continue;
+        }
+        if (star_p == NULL) {
+            return 0;
+        }
+        p = star_p;
+        name = ++star_name;
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+/*
+ * Grow a listing's buffers to fit one more entry with a name of len bytes (including the '\0')
+ * Returns 0 on success or -1 on error
+ */
+static int reserve_entry(listing_t *listing, unsigned len) {
+    if (listing->count == listing->capacity) {
+        unsigned capacity = listing->capacity == 0 ? INITIAL_ENTRIES : 2 * listing->capacity;
+        unsigned *offsets = realloc(listing->offsets, capacity * sizeof(unsigned));
+        if (offsets == NULL) {
+            return -1;
+        }
+        listing->offsets = offsets;
+        unsigned char *types = realloc(listing->types, capacity);
+        if (types == NULL) {
+            return -1;
+        }
+        listing->types = types;
+        listing->capacity = capacity;
+    }
+    if (listing->names_size + len > listing->names_capacity) {
+        unsigned capacity = listing->names_capacity == 0 ? INITIAL_NAMES_SIZE
+                                                         : 2 * listing->names_capacity;
+        while (listing->names_size + len > capacity) {
+            capacity *= 2;
+        }
+        char *names = realloc(listing->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        listing->names = names;
+        listing->names_capacity = capacity;
+    }
+    return 0;
+}
+
+/*
+ * Read every entry of an open directory into a listing, replacing its previous entries
+ * Returns 0 on success or -1 on error
+ */
+static int read_listing(listing_t *listing, int fd) {
+    if (dirent_buf == NULL && (dirent_buf = malloc(DIRENT_BUF_SIZE)) == NULL) {
+        return -1;
+    }
+    listing->count = 0;
+    listing->names_size = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, dirent_buf, DIRENT_BUF_SIZE)) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            struct dirent64 *entry = (struct dirent64 *) (dirent_buf + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned len = strlen(name) + 1;
+            if (reserve_entry(listing, len) == -1) {
+                return -1;
+            }
+            listing->offsets[listing->count] = listing->names_size;
+            listing->types[listing->count++] = entry->d_type;
+            memcpy(listing->names + listing->names_size, name, len);
+            listing->names_size += len;
+        }
+    }
+    return n == -1 ? -1 : 0;
+}
+
+/*
+ * Find the cached listing of a directory, reading it again if it has changed or isn't cached
+ * The listing is pinned, so that it isn't replaced while it is iterated over; the caller must
+ * unpin it once done
+ * path: Path to the directory
+ * Returns the listing, or NULL if the directory can't be read
+ */
+static listing_t *get_listing(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    listing_t *listing = NULL;
+    listing_t *victim = NULL;    // least recently used slot that isn't pinned
+    for (unsigned i = 0; i < WILDCARD_CACHE_DIRS && listing == NULL; i++) {
+        if (cache[i].path != NULL && strcmp(cache[i].path, path) == 0) {
+            listing = &cache[i];
+        } else if (cache[i].pins == 0 &&
+                   (victim == NULL || cache[i].path == NULL ||
+                    (victim->path != NULL && cache[i].last_used < victim->last_used))) {
+            victim = &cache[i];
+        }
+    }
+    if (listing != NULL && listing->stable && listing->dev == st.st_dev &&
+        listing->ino == st.st_ino && listing->mtime.tv_sec == st.st_mtim.tv_sec &&
+        listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        listing->pins++;
+        listing->last_used = ++use_clock;
+        return listing;
+    }
+
+    if (listing == NULL) {
+        if (victim == NULL) {    // every slot is being iterated over
+            return NULL;
+        }
+        listing = victim;
+        free(listing->path);
+        if ((listing->path = strdup(path)) == NULL) {
+            return NULL;
+        }
+    }
+    // The listing is only trusted later if the directory's mtime was already old, since a change
+    // within the same clock tick as the listing would leave the mtime as it is
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->stable = now.tv_sec - st.st_mtim.tv_sec > STABLE_SECONDS;
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        listing->stable = 0;
+        return NULL;
+    }
+    int result = read_listing(listing, fd);
+    close(fd);
+    if (result == -1) {
+        listing->stable = 0;
+        return NULL;
+    }
+    listing->pins++;
+    listing->last_used = ++use_clock;
+    return listing;
+}
+
+/*
+ * Append a name to the path matched so far, with a '/' in between if needed
+ * Returns the new length of the path, or -1 if it would be too long
+ */
+static int append_name(expansion_t *exp, int len, const char *name) {
+    size_t name_len = strlen(name);
+    int slash = len > 0 && exp->path[len - 1] != '/';
+    if (len + slash + name_len + 2 > PATH_MAX) {
+        return -1;
+    }
+    if (slash) {
+        exp->path[len++] = '/';
+    }
+    memcpy(exp->path + len, name, name_len + 1);
+    return len + name_len;
+}
+
+/*
+ * Add the path matched so far to the results, or skip it if only directories match and it isn't
+ * Returns 0 on success or -1 on error
+ */
+static int add_match(expansion_t *exp, int len) {
+    if (exp->dir_only) {
+        struct stat st;
+        if (stat(exp->path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+        exp->path[len] = '/';
+        exp->path[len + 1] = '\0';
+    }
+    return strvec_add(exp->out, exp->path);
+}
+
+/*
+ * Returns 1 if a listed entry is a directory, without following symbolic links
+ */
+static int is_real_dir(expansion_t *exp, unsigned char type) {
+    struct stat st;
+    return type == DT_DIR ||
+           (type == DT_UNKNOWN && lstat(exp->path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+/*
+ * Match the pattern's components from comp onwards, below the path matched so far
+ * len: Length of the path matched so far (0 for the current directory)
+ * Returns 0 on success or -1 on error
+ */
+static int expand_from(expansion_t *exp, int len, unsigned comp) {
+    if (comp == exp->num_comps) {
+        return add_match(exp, len);
+    }
+    const char *p = exp->comps[comp];
+    int is_last = comp + 1 == exp->num_comps;
+    if (!wildcard_is_pattern(p)) {
+        int new_len = append_name(exp, len, p);
+        struct stat st;
+        if (new_len == -1 || (is_last && lstat(exp->path, &st) == -1)) {
+            return 0;
+        }
+        return expand_from(exp, new_len, comp + 1);
+    }
+
+    int globstar = strcmp(p, "**") == 0;
+    if (globstar && !is_last && expand_from(exp, len, comp + 1) == -1) {    // no directories
+        return -1;
+    }
+    exp->path[len] = '\0';
+    listing_t *listing = get_listing(len == 0 ? "." : exp->path);
+    if (listing == NULL) {
+        return 0;    // an unreadable directory just has no matches
+    }
+    int result = 0;
+    for (unsigned i = 0; i < listing->count && result == 0; i++) {
+        const char *name = listing->names + listing->offsets[i];
+        if (name[0] == '.' && p[0] != '.') {
+            continue;    // hidden entries must be matched explicitly
+        }
+        if (globstar) {
+            int new_len = append_name(exp, len, name);
+            if (new_len == -1) {
+                continue;
+            }
+            if (is_last) {
+                result = add_match(exp, new_len);
+            }
+            if (result == 0 && is_real_dir(exp, listing->types[i])) {
+                exp->path[new_len] = '\0';    // add_match() may have added a '/'
+                result = expand_from(exp, new_len, comp);
+            }
+        } else if (match(p, name)) {
+            int new_len = append_name(exp, len, name);
+            if (new_len == -1) {
+                continue;
+            }
+            if (is_last) {
+                result = add_match(exp, new_len);
+            } else if (listing->types[i] == DT_DIR || listing->types[i] == DT_LNK ||
+                       listing->types[i] == DT_UNKNOWN) {
+                result = expand_from(exp, new_len, comp + 1);
+            }
+        }
+    }
+    listing->pins--;
+    return result;
+}
+
+/*
+ * Add the paths that a pattern matches to out, in the order they are found
+ * Returns 0 on success or -1 on error
+ */
+static int expand_pattern(const char *pattern, strvec_t *out) {
+    static expansion_t exp;    // too big for the stack of a deep recursion's caller
+    size_t len = strlen(pattern);
+    if (len + 1 > PATH_MAX) {
+        return 0;
+    }
+    memcpy(pattern_buf, pattern, len + 1);
+    exp.out = out;
+    exp.num_comps = 0;
+    exp.dir_only = len > 0 && pattern[len - 1] == '/';
+    int start = 0;
+    if (pattern[0] == '/') {
+        exp.path[0] = '/';
+        exp.path[1] = '\0';
+        start = 1;
+    }
+    for (char *comp = strtok(pattern_buf, "/"); comp != NULL; comp = strtok(NULL, "/")) {
+        if (exp.num_comps == MAX_COMPONENTS) {
+            return 0;
+        }
+        if (!wildcard_is_pattern(comp)) {
+            unescape(comp);    // matched by name, as is
+        }
+        exp.comps[exp.num_comps++] = comp;
+    }
+    if (exp.num_comps == 0) {
+        return 0;
+    }
+    return expand_from(&exp, start, 0);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Returns 1 if tokens[i] is a pattern to expand, 0 if it isn't or is the file of a redirection
+ */
+static int is_expandable(const strvec_t *tokens, unsigned i) {
+    if (token_kind(tokens->data[i]) != TOKEN_WORD || !wildcard_is_pattern(tokens->data[i])) {
+        return 0;
+    }
+    return i == 0 || token_kind(tokens->data[i - 1]) < TOKEN_REDIRECT_IN;
+}
+
+int wildcard_expand(strvec_t *tokens) {
+    unsigned first = 0;
+    for (; first < tokens->length && !is_expandable(tokens, first); first++) {
+        if (strchr(tokens->data[first], '\\') != NULL) {
+            unescape(tokens->data[first]);
+        }
+    }
+    if (first == tokens->length) {
+        return 0;    // the common case, which costs nothing but the scan
+    }
+
+    if (!scratch_ready) {
+        if (strvec_init_arena(&scratch) == -1) {
+            return -1;
+        }
+        scratch_ready = 1;
+    } else {
+        strvec_reset(&scratch);
+    }
+    // Unexpanded tokens are borrowed, and matches are copied into the scratch vector's arena
+    for (unsigned i = 0; i < tokens->length; i++) {
+        char *tok = tokens->data[i];
+        unsigned start = scratch.length;
+        if (i >= first && is_expandable(tokens, i) && expand_pattern(tok, &scratch) == -1) {
+            return -1;
+        }
+        if (scratch.length == start) {
+            if (i >= first && strchr(tok, '\\') != NULL) {
+                unescape(tok);
+            }
+            if (strvec_add_ref(&scratch, tok) == -1) {
+                return -1;
+            }
+        } else if (scratch.length - start > 1) {
+            qsort(scratch.data + start, scratch.length - start, sizeof(char *), compare_strings);
+        }
+    }
+
+    // The caller's vector takes over the expanded tokens, and its old storage is reused next time
+    strvec_t old = *tokens;
+    *tokens = scratch;
+    scratch = old;
+    return 0;
+}
+
+void wildcard_cache_clear(void) {
+    for (unsigned i = 0; i < WILDCARD_CACHE_DIRS; i++) {
+        free(cache[i].path);
+        free(cache[i].offsets);
+        free(cache[i].types);
+        free(cache[i].names);
+        memset(&cache[i], 0, sizeof(listing_t));
+    }
+}
+
+void wildcard_free(void) {
+    wildcard_cache_clear();
+    free(dirent_buf);
+    dirent_buf = NULL;
+    if (scratch_ready) {
+        strvec_clear(&scratch);
+        scratch_ready = 0;
+    }
+}
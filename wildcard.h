@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef WILDCARD_H
+#define WILDCARD_H
+
+#include "string_vector.h"
+
+#define WILDCARD_CACHE_DIRS 64    // most directory listings kept in the cache
+
+/*
+ * Wildcard (glob) expansion of command-line tokens. A token containing '*', '?', or '[' is a
+ * pattern, matched one path component at a time against directory listings:
+ *   *       any string, including the empty string
+ *   ?       any single character
+ *   [...]   any one of the characters listed, which may include ranges such as a-z. A leading '!'
+ *           or '^' matches any character that is not listed
+ *   **      as a whole component, any number of directories (including none), without following
+ *           symbolic links. As the last component, every file and directory below
+ * Names starting with '.' are only matched by a component that starts with '.' too, and "." and
+ * ".." are never matched. A pattern ending in '/' only matches directories
+ *
+ * Directory listings are read with getdents64() into a large buffer, and cached. A cached listing
+ * is used again for as long as the directory's modification time is unchanged (and was already
+ * more than a second old when it was listed, so that changes within the same clock tick aren't
+ * missed), so repeatedly expanding patterns over large directories doesn't rescan them
+ */
+
+/*
+ * Replace every pattern among tokens with the paths it matches, sorted, or leave it as is if it
+ * matches nothing. The file names after redirection operators are not expanded. Characters that
+ * tokenize() escaped because they were quoted match only themselves, and the escapes are removed
+ * from every token that is left as is
+ * tokens: An arena vector of tokens from tokenize(). It may end up with the storage of another
+ *         vector, which is kept until the next call
+ * Returns 0 on success or -1 on error
+ */
+int wildcard_expand(strvec_t *tokens);
+
+/*
+ * Returns 1 if tok contains any wildcard characters that aren't escaped, 0 otherwise
+ */
+int wildcard_is_pattern(const char *tok);
+
+/*
+ * Empty the cache of directory listings
+ */
+void wildcard_cache_clear(void);
+
+/*
+ * Free all memory used for wildcard expansion, including the cache
+ */
+void wildcard_free(void);
+
+#endif    // WILDCARD_H
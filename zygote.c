@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "zygote.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MAX_MESSAGE (64 * 1024)    // largest request, including the path, cwd and arguments
+
+typedef struct {
+    pid_t pgid;
+    unsigned num_fds;    // descriptors attached to the request, duplicated in order
+    int targets[ZYGOTE_MAX_FDS];
+    unsigned num_args;
+} request_t;    // followed by the path, cwd and arguments, each terminated by '\0'
+
+typedef struct {
+    pid_t pid;    // 0 if the process could not execute the command
+    int err;
+} reply_t;
+
+extern char **environ;
+
+static int zygote_fd = -1;    // the shell's end of the socketpair, or -1 if there is no zygote
+static char message[MAX_MESSAGE];
+
+/*
+ * In the zygote: create a process for a request that has been received, and have it execute the
+ * command. The process is created with CLONE_PARENT, so it is the shell's child, not ours
+ * strings: The request's path, cwd and arguments
+ * Returns the pid of the process, or 0 with *err set if it could not execute the command
+ */
+static pid_t start_child(const request_t *req, char *strings, size_t len, const int *fds,
+                         int *err) {
+    char *argv[req->num_args + 1];
+    char *path = strings;
+    char *cwd = path + strlen(path) + 1;
+    char *arg = cwd + strlen(cwd) + 1;
+    for (unsigned i = 0; i < req->num_args; i++) {
+        if (arg >= strings + len) {
+            *err = EINVAL;
+            return 0;
+        }
+        argv[i] = arg;
+        arg += strlen(arg) + 1;
+    }
+    argv[req->num_args] = NULL;
+
+    // The new process reports why it couldn't execute the command through this pipe, which is
+    // closed without a word if it could
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        *err = errno;
+        return 0;
+    }
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+    if (pid == -1) {
+        *err = errno;
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        return 0;
+    } else if (pid == 0) {    // child process: only async-signal-safe calls from here on
+        int child_err = 0;
+        if (setpgid(0, req->pgid) == -1) {
+            child_err = errno;
+        }
+        for (unsigned i = 0; i < req->num_fds && child_err == 0; i++) {
+            if (dup2(fds[i], req->targets[i]) == -1) {
+                child_err = errno;
+            }
+        }
+        if (child_err == 0 && chdir(cwd) == -1) {
+            child_err = errno;
+        }
+        if (child_err == 0) {
+            execve(path, argv, environ);
+            child_err = errno;
+        }
+        write(err_pipe[1], &child_err, sizeof(child_err));
+        _exit(127);
+    }
+
+    close(err_pipe[1]);
+    int child_err;
+    ssize_t n;
+    while ((n = read(err_pipe[0], &child_err, sizeof(child_err))) == -1 && errno == EINTR) {
+    }
+    close(err_pipe[0]);
+    if (n == sizeof(child_err)) {
+        *err = child_err;
+        return 0;
+    }
+    return pid;
+}
+
+/*
+ * Body of the zygote: serve requests from the shell until it closes its end of the socket
+ */
+static void zygote_main(int fd) {
+    while (1) {
+        request_t req;
+        struct iovec iov[2] = {{&req, sizeof(req)}, {message, MAX_MESSAGE - 1}};
+        union {
+            char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {    // the shell has exited
+            _exit(0);
+        }
+
+        int fds[ZYGOTE_MAX_FDS];
+        unsigned num_fds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        }
+
+        reply_t reply = {0, EINVAL};
+        int truncated = msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC);
+        if (n > sizeof(req) && num_fds == req.num_fds && !truncated) {
+            size_t len = n - sizeof(req);
+            message[len] = '\0';
+            reply.err = 0;
+            reply.pid = start_child(&req, message, len, fds, &reply.err);
+        }
+        for (unsigned i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+            _exit(1);
+        }
+    }
+}
+
+int zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {    // child process
+        close(sv[0]);
+        // Keep out of the terminal's way: signals from the keyboard only reach the foreground
+        // process group, and the zygote is never in it
+        setpgid(0, 0);
+        // Everything the zygote launches inherits this signal state
+        struct sigaction sac;
+        sac.sa_handler = SIG_DFL;
+        sigemptyset(&sac.sa_mask);
+        sac.sa_flags = 0;
+        sigaction(SIGTTIN, &sac, NULL);
+        sigaction(SIGTTOU, &sac, NULL);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_fd = sv[0];
+    return 0;
+}
+
+/*
+ * Give up on a zygote that has stopped responding, so later launches go elsewhere
+ */
+static void zygote_lost(const char *what) {
+    perror(what);
+    fprintf(stderr, "zygote: falling back to posix_spawn()\n");
+    close(zygote_fd);
+    zygote_fd = -1;
+}
+
+pid_t zygote_spawn(const char *path, char *const *args, pid_t pgid, const int *fds,
+                   const int *targets, unsigned num_fds, int *err) {
+    if (zygote_fd == -1 || num_fds > ZYGOTE_MAX_FDS) {
+        return -1;
+    }
+
+    request_t req;
+    memset(&req, 0, sizeof(req));
+    req.pgid = pgid;
+    req.num_fds = num_fds;
+    memcpy(req.targets, targets, num_fds * sizeof(int));
+    if (getcwd(message, PATH_MAX) == NULL) {
+        return -1;
+    }
+    size_t cwd_len = strlen(message) + 1;
+    size_t path_len = strlen(path) + 1;
+    if (path_len + cwd_len >= MAX_MESSAGE) {
+        return -1;
+    }
+    memmove(message + path_len, message, cwd_len);
+    memcpy(message, path, path_len);
+    size_t len = path_len + cwd_len;
+    for (req.num_args = 0; args[req.num_args] != NULL; req.num_args++) {
+        size_t arg_len = strlen(args[req.num_args]) + 1;
+        if (len + arg_len >= MAX_MESSAGE) {    // too big for the zygote to receive
+            return -1;
+        }
+        memcpy(message + len, args[req.num_args], arg_len);
+        len += arg_len;
+    }
+
+    struct iovec iov[2] = {{&req, sizeof(req)}, {message, len}};
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (num_fds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) == -1) {
+        zygote_lost("zygote: sendmsg");
+        return -1;
+    }
+
+    reply_t reply;
+    ssize_t n;
+    while ((n = recv(zygote_fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR) {
+    }
+    if (n != sizeof(reply)) {
+        if (n >= 0) {
+            errno = EPIPE;    // the zygote has exited
+        }
+        zygote_lost("zygote: recv");
+        return -1;
+    }
+    if (reply.pid == 0) {
+        *err = reply.err;
+    }
+    return reply.pid;
+}
+
+void zygote_stop(void) {
+    if (zygote_fd != -1) {
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <sys/types.h>
+
+#define ZYGOTE_MAX_FDS 16    // most descriptors that one launch can pass to the zygote
+
+/*
+ * The zygote is a small helper process forked when the shell starts, before the shell has grown.
+ * It receives each command to launch over a Unix socketpair, and creates the command's process as
+ * a copy of itself rather than of the shell. Thanks to CLONE_PARENT, that process is still a child
+ * of the shell, which reaps it and controls it like any other
+ */
+
+/*
+ * Fork the zygote
+ * Call this early, while the shell is small, since the zygote keeps a copy of its memory
+ * Returns 0 on success or -1 on error
+ */
+int zygote_start(void);
+
+/*
+ * Launch a command through the zygote
+ * path: File to execute
+ * args: NULL-terminated argument list, starting with the command name
+ * pgid: Process group for the new process to join, or 0 to start a new group led by it
+ * fds, targets: Before executing path, fds[i] is duplicated onto descriptor targets[i] (0, 1, or
+ *               2) for each i in order, and the process's working directory is set to the shell's
+ * num_fds: Number of entries in fds and targets
+ * err: Set to an errno value if the process was created but could not execute path
+ * Returns the pid of the new process, 0 if it could not execute path, or -1 if the zygote is not
+ * running or the command could not be sent to it, in which case it should be launched some other
+ * way
+ */
+pid_t zygote_spawn(const char *path, char *const *args, pid_t pgid, const int *fds,
+                   const int *targets, unsigned num_fds, int *err);
+
+/*
+ * Tell the zygote to exit
+ */
+void zygote_stop(void);
+
+#endif    // ZYGOTE_H